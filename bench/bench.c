@@ -0,0 +1,548 @@
+/**
+ * Time the rule matchers of scrub.c on real-world file names.
+ * Copyright 2015 Roman Hargrave <roman@hargrave.info> under the GNU GPL v3
+ *
+ * Built on its own, from the repository root:
+ *
+ *     gcc -std=gnu99 -O2 -pthread -o scrub-bench bench/bench.c -lm
+ *
+ * scrub.c is compiled in whole, with its entry point renamed, so the matchers timed here are the ones scrub runs.
+ */
+
+#define main scrub_main
+#include "../scrub.c"
+#undef main
+
+/*
+ * SECTION: Benchmark
+ * --capture and replay: time the matchers on real-world names rather than synthetic ones
+ */
+
+/**
+ * Extensions kept as they are when anonymizing, besides those the rules name, as they are what rules match.
+ * Sorted, compared without regard to case.
+ */
+static const char* BenchExtensions[] = {
+    "7z", "aac", "bak", "bin", "bmp", "c", "cfg", "conf", "cpp", "css", "csv", "cue", "db", "deb", "desktop",
+    "doc", "docx", "epub", "flac", "gif", "go", "gz", "h", "hpp", "htm", "html", "ico", "ini", "iso", "jar",
+    "java", "jpeg", "jpg", "js", "json", "log", "lua", "m3u", "m4a", "md", "md5", "md5sums", "mkv", "mo",
+    "mov", "mp3", "mp4", "nfo", "o", "odt", "ogg", "opus", "par2", "pdf", "php", "pl", "png", "po", "py",
+    "pyc", "rar", "rb", "rs", "sfv", "sh", "so", "sql", "srt", "svg", "swp", "tar", "tmp", "ts", "ttf", "txt",
+    "url", "wav", "webm", "webp", "xml", "xz", "yaml", "yml", "zip", "zst"
+};
+
+/**
+ * Minimum time spent on each measurement
+ */
+static const double BenchSeconds        = 0.2;
+
+static int
+Bench_compareExtension(const void* left, const void* right) {
+    return strcasecmp(*(char* const*) left, *(char* const*) right);
+}
+
+/**
+ * Returns true if an extension may be kept by Bench_anonymize(): one of BenchExtensions, or one that a rule names
+ *
+ * @param config    configuration
+ * @param extension extension, without its dot
+ */
+static bool
+Bench_keepsExtension(Configuration* config, char* extension) {
+    if (bsearch(&extension, BenchExtensions, sizeof(BenchExtensions) / sizeof(*BenchExtensions), sizeof(char*),
+                Bench_compareExtension)) {
+        return true;
+    }
+
+    if (Configuration_findExtension(config, extension) != NO_RULE || Configuration_findSidecar(config, extension) != NO_RULE
+        || Configuration_isPrimary(config, extension)) {
+        return true;
+    }
+
+    RuleSet* rules = config->rulesPath ? RuleSet_current(config) : NULL;
+
+    return rules && rules->extensionsLen
+        && bsearch(&extension, rules->extensions, rules->extensionsLen, sizeof(char*), RuleSet_compare);
+}
+
+/**
+ * Anonymize a name in place, keeping its shape: letters stay letters of the same case, digits stay digits,
+ * multibyte UTF-8 characters are replaced by characters of the same length, and punctuation is kept.
+ * The extension is kept only if Bench_keepsExtension() allows it, so that one such as `invoice.alice` does not
+ * leak a name.
+ *
+ * @param config    configuration
+ * @param name      name
+ * @param state     random state
+ */
+static void
+Bench_anonymize(Configuration* config, char* name, u64* state) {
+    static const char* Replacements[] = { "", "", "\xc3\xa9", "\xe4\xb8\xad", "\xf0\x9f\x98\x80" };
+
+    char*   extension   = strrchr(name, '.');
+    char*   end         = name + strlen(name);
+
+    unless (extension && extension != name && Bench_keepsExtension(config, extension + 1)) {
+        extension = NULL;
+    }
+
+    end = extension ? extension : end;
+
+    for (char* cursor = name; cursor < end;) {
+        unsigned char   byte    = *cursor;
+        size_t          length  = (byte >= 0xF0) ? 4 : (byte >= 0xE0) ? 3 : (byte >= 0xC0) ? 2 : 1;
+
+        *state ^= *state >> 12;
+        *state ^= *state << 25;
+        *state ^= *state >> 27;
+
+        u64 random = *state * 2685821657736338717ULL;
+
+        if (length > 1 && cursor + length <= end) {
+            memcpy(cursor, Replacements[length], length);
+        } else if (byte >= 'a' && byte <= 'z') {
+            *cursor = 'a' + random % 26;
+        } else if (byte >= 'A' && byte <= 'Z') {
+            *cursor = 'A' + random % 26;
+        } else if (byte >= '0' && byte <= '9') {
+            *cursor = '0' + random % 10;
+        }
+
+        cursor += (length > 1 && cursor + length <= end) ? length : 1;
+    }
+}
+
+static void
+Bench_captureDirectory(Configuration* config, const char* path, FILE* output, u64* state, u64* count) {
+    Arena*      arena   = Arena_get();
+    Frame*      dir     = Frame_open(arena, path);
+    DirEntry*   entry;
+
+    unless (dir) {
+        Runtime_putError("Could not open directory %s: ERRNO %u\n", path, errno);
+        return;
+    }
+
+    while ((entry = Frame_read(arena, dir))) {
+        if ((strcmp(entry->d_name, ".") == 0) || (strcmp(entry->d_name, "..") == 0) || strchr(entry->d_name, '\n')) {
+            continue;
+        }
+
+        unsigned char type = entry->d_type;
+
+        if (type == DT_UNKNOWN) {
+            struct stat statBuffer;
+
+            if (fstatat(dir->fd, entry->d_name, &statBuffer, AT_SYMLINK_NOFOLLOW) == 0) {
+                type = IFTODT(statBuffer.st_mode);
+            }
+        }
+
+        ArenaMark   mark    = Arena_mark(arena);
+        size_t      length  = strlen(entry->d_name);
+        char*       name    = (char*) Arena_alloc(arena, length + 1);
+
+        memcpy(name, entry->d_name, length + 1);
+        Bench_anonymize(config, name, state);
+        fprintf(output, "%s\n", name);
+        ++*count;
+
+        if (type == DT_DIR) {
+            Bench_captureDirectory(config, Arena_path(arena, path, entry->d_name), output, state, count);
+        }
+
+        Arena_release(arena, mark);
+    }
+
+    Frame_close(arena, dir);
+}
+
+/**
+ * Write the anonymized names of everything under the roots
+ *
+ * @param config    configuration
+ * @param path      file to write
+ * @param roots     planned roots
+ * @param count     number of roots
+ * @return errno
+ */
+static int // errno
+Bench_capture(Configuration* config, const char* path, Root* roots, size_t count) {
+    FILE*   output  = fopen(path, "w");
+    u64     state   = ((u64) getpid() << 32) ^ (u64) (Estimate_now() * 1e6) ^ 0x9E3779B97F4A7C15ULL;
+    u64     names   = 0;
+
+    unless (output) {
+        Runtime_putError("Could not open %s: ERRNO %u\n", path, errno);
+        return errno;
+    }
+
+    for (size_t index = 0; index < count; ++index) {
+        if (S_ISDIR(roots[index].mode)) {
+            Bench_captureDirectory(config, roots[index].path, output, &state, &names);
+        }
+    }
+
+    int result = (fclose(output) == 0) ? ENONE : errno;
+
+    Runtime_putError("Wrote %llu names to %s\n", (unsigned long long) names, path);
+    return result;
+}
+
+/**
+ * Hash set of names and extensions, the third matcher
+ */
+typedef struct {
+    StringSet keys;
+} BenchHashSet;
+
+static void
+BenchHashSet_init(BenchHashSet* self, char** names, size_t namesLen, char** extensions, size_t extensionsLen) {
+    self->keys = (StringSet) {0};
+
+    // Extensions are stored with their dot, so that they cannot collide with names
+    for (size_t index = 0; index < namesLen + extensionsLen; ++index) {
+        char* key;
+
+        if (index < namesLen) {
+            key = strdup(names[index]);
+        } else {
+            key = (char*) malloc(strlen(extensions[index - namesLen]) + 2);
+            sprintf(key, ".%s", extensions[index - namesLen]);
+        }
+
+        StringSet_adopt(&self->keys, key);
+    }
+}
+
+static hot bool
+BenchHashSet_matches(BenchHashSet* self, char* basename) {
+    char* extension = strrchr(basename, '.');
+
+    return StringSet_contains(&self->keys, basename, strlen(basename))
+        || (extension && StringSet_contains(&self->keys, extension, strlen(extension)));
+}
+
+static void
+BenchHashSet_free(BenchHashSet* self) {
+    StringSet_free(&self->keys);
+}
+
+typedef enum {
+    BENCH_LINEAR,
+    BENCH_SORTED,
+    BENCH_HASH,
+    BENCH_BACKENDS
+} BenchBackend;
+
+static const char* BenchBackendNames[BENCH_BACKENDS] = { "linear", "sorted", "hash" };
+
+/**
+ * Time one matcher over the corpus, repeating it until BenchSeconds have passed
+ *
+ * @return nanoseconds per name; `matched` receives the matches of one pass
+ */
+static double
+Bench_time(BenchBackend backend, Configuration* rules, RuleSet* sorted, BenchHashSet* hash,
+           char** names, size_t namesLen, u64* matched) {
+    double  started = Estimate_now();
+    double  elapsed = 0;
+    u64     passes  = 0;
+
+    do {
+        u64 hits = 0;
+
+        for (size_t index = 0; index < namesLen; ++index) {
+            switch (backend) {
+                case BENCH_LINEAR:
+                    hits += (File_matchRule(rules, names[index]) != NO_RULE);
+                    break;
+                case BENCH_SORTED:
+                    hits += (RuleSet_match(sorted, names[index]) != NO_RULE);
+                    break;
+                default:
+                    hits += BenchHashSet_matches(hash, names[index]);
+                    break;
+            }
+        }
+
+        *matched = hits;
+        ++passes;
+        elapsed = Estimate_now() - started;
+    } while (elapsed < BenchSeconds);
+
+    return elapsed * 1e9 / ((double) passes * namesLen);
+}
+
+/**
+ * Time every matcher with the given rule lists, and print a row per matcher
+ */
+static void
+Bench_rules(const char* label, char** ruleNames, size_t ruleNamesLen, char** ruleExtensions, size_t ruleExtensionsLen,
+            char** names, size_t namesLen, FILE* stream) {
+    Configuration*  rules   = Configuration_new();
+    RuleSet         sorted  = { 0 };
+    BenchHashSet    hash;
+
+    for (size_t index = 0; index < ruleNamesLen; ++index) {
+        Configuration_clobberName(rules, ruleNames[index]);
+    }
+
+    for (size_t index = 0; index < ruleExtensionsLen; ++index) {
+        Configuration_clobberExtension(rules, ruleExtensions[index]);
+    }
+
+    // The sorted set is what --rules compiles to
+    sorted.names         = (char**) malloc((ruleNamesLen + 1) * sizeof(char*));
+    sorted.extensions    = (char**) malloc((ruleExtensionsLen + 1) * sizeof(char*));
+    sorted.namesLen      = ruleNamesLen;
+    sorted.extensionsLen = ruleExtensionsLen;
+
+    // Every rule gets the same number, as only whether one matched is counted
+    sorted.nameEntries      = (RuleIndex*) calloc(ruleNamesLen + 1, sizeof(RuleIndex));
+    sorted.extensionEntries = (RuleIndex*) calloc(ruleExtensionsLen + 1, sizeof(RuleIndex));
+
+    memcpy(sorted.names, ruleNames, ruleNamesLen * sizeof(char*));
+    memcpy(sorted.extensions, ruleExtensions, ruleExtensionsLen * sizeof(char*));
+    qsort(sorted.names, sorted.namesLen, sizeof(char*), RuleSet_compare);
+    qsort(sorted.extensions, sorted.extensionsLen, sizeof(char*), RuleSet_compare);
+
+    BenchHashSet_init(&hash, ruleNames, ruleNamesLen, ruleExtensions, ruleExtensionsLen);
+
+    for (int backend = 0; backend < BENCH_BACKENDS; ++backend) {
+        u64     matched;
+        double  perName = Bench_time(backend, rules, &sorted, &hash, names, namesLen, &matched);
+
+        fprintf(stream, "%-12s %8zu %-8s %12.1f %12llu\n", label, ruleNamesLen + ruleExtensionsLen,
+                BenchBackendNames[backend], perName, (unsigned long long) matched);
+    }
+
+    BenchHashSet_free(&hash);
+    dispose(sorted.names);
+    dispose(sorted.extensions);
+    dispose(sorted.nameEntries);
+    dispose(sorted.extensionEntries);
+
+    // The sorted set borrowed the caller's strings, but the configuration copied its own
+    for (size_t index = 0; index < rules->clobberNamesLen; ++index) {
+        dispose(rules->clobberNames[index]);
+    }
+
+    for (size_t index = 0; index < rules->clobberExtensionsLen; ++index) {
+        dispose(rules->clobberExtensions[index]);
+    }
+
+    dispose(rules->clobberNames);
+    dispose(rules->clobberExtensions);
+    dispose(rules);
+}
+
+static int
+Bench_compareCounts(const void* left, const void* right) {
+    const SurveyEntry* a = (const SurveyEntry*) left;
+    const SurveyEntry* b = (const SurveyEntry*) right;
+
+    return (a->files[0] < b->files[0]) - (a->files[0] > b->files[0]);
+}
+
+/**
+ * Replay a corpus through each matcher: with the rules given on the command line, if any, then with the
+ * 1, 8, 64 and 512 most common extensions of the corpus (padded with extensions that never match)
+ *
+ * @param config    configuration
+ * @param path      corpus, one name per line
+ * @return errno
+ */
+static int // errno
+Bench_run(Configuration* config, const char* path) {
+    FILE* input = fopen(path, "r");
+
+    unless (input) {
+        Runtime_putError("Could not open %s: ERRNO %u\n", path, errno);
+        return errno;
+    }
+
+    char**  names       = NULL;
+    size_t  namesLen    = 0;
+    size_t  namesSize   = 0;
+    char*   line        = NULL;
+    size_t  capacity    = 0;
+    ssize_t length;
+
+    while ((length = getline(&line, &capacity, input)) > 0) {
+        if (line[length - 1] == '\n') {
+            line[--length] = '\0';
+        }
+
+        if (length == 0) {
+            continue;
+        }
+
+        if (namesLen == namesSize) {
+            namesSize = namesSize ? namesSize * 2 : 1024;
+            names     = (char**) realloc(names, namesSize * sizeof(char*));
+        }
+
+        names[namesLen++] = strdup(line);
+    }
+
+    dispose(line);
+    fclose(input);
+
+    if (namesLen == 0) {
+        Runtime_putError("%s holds no names\n", path);
+        return EINVAL;
+    }
+
+    // Extensions of the corpus by frequency: sorted, then counted run by run into a survey table
+    char**          found           = (char**) malloc(namesLen * sizeof(char*));
+    size_t          foundLen        = 0;
+    SurveyEntry*    extensions      = (SurveyEntry*) calloc(namesLen, sizeof(SurveyEntry));
+    size_t          extensionsLen   = 0;
+
+    for (size_t index = 0; index < namesLen; ++index) {
+        char* extension = strrchr(names[index], '.');
+
+        if (extension && extension != names[index]) {
+            found[foundLen++] = extension + 1;
+        }
+    }
+
+    qsort(found, foundLen, sizeof(char*), RuleSet_compare);
+
+    for (size_t index = 0; index < foundLen; ++index) {
+        if (index == 0 || strcmp(found[index], found[index - 1]) != 0) {
+            extensions[extensionsLen++].extension = found[index];
+        }
+
+        ++extensions[extensionsLen - 1].files[0];
+    }
+
+    qsort(extensions, extensionsLen, sizeof(SurveyEntry), Bench_compareCounts);
+
+    fprintf(stdout, "%zu names from %s, %zu distinct extensions\n\n", namesLen, path, extensionsLen);
+    fprintf(stdout, "%-12s %8s %-8s %12s %12s\n", "rules", "count", "matcher", "ns/name", "matched");
+
+    if (config->clobberNamesLen + config->clobberExtensionsLen > 0) {
+        Bench_rules("given", config->clobberNames, config->clobberNamesLen, config->clobberExtensions, config->clobberExtensionsLen,
+                    names, namesLen, stdout);
+    }
+
+    static const size_t Sizes[] = { 1, 8, 64, 512 };
+
+    for (size_t size = 0; size < sizeof(Sizes) / sizeof(*Sizes); ++size) {
+        char** ruleExtensions = (char**) malloc(Sizes[size] * sizeof(char*));
+
+        for (size_t index = 0; index < Sizes[size]; ++index) {
+            if (index < extensionsLen) {
+                ruleExtensions[index] = strdup(extensions[index].extension);
+            } else {
+                ruleExtensions[index] = (char*) malloc(24);
+                snprintf(ruleExtensions[index], 24, "zz%zu", index);
+            }
+        }
+
+        Bench_rules("corpus", NULL, 0, ruleExtensions, Sizes[size], names, namesLen, stdout);
+
+        for (size_t index = 0; index < Sizes[size]; ++index) {
+            dispose(ruleExtensions[index]);
+        }
+
+        dispose(ruleExtensions);
+    }
+
+    for (size_t index = 0; index < namesLen; ++index) {
+        dispose(names[index]);
+    }
+
+    dispose(names);
+    dispose(found);
+    dispose(extensions);
+    return ENONE;
+}
+
+/*
+ * SECTION: Entry point
+ */
+
+static const struct option BenchOptions[] = {
+    { "help",               no_argument,        0,  'h' },
+    { "clobber-extension",  required_argument,  0,  'c' },
+    { "clobber-name",       required_argument,  0,  'C' },
+    { "rules",              required_argument,  0,  'r' },
+    // Write an anonymized list of the file names under the given paths
+    { "capture",            required_argument,  0,  'w' },
+    { NULL,                 0,                  0,  0   }
+};
+
+static cold void
+Bench_printHelp(char* executableName) {
+    Runtime_putError(
+        "%s - time the rule matchers of scrub on real-world file names\n"
+        "\n"
+        "%s [-c ext]... [-C name]... [--rules=file] corpus\n"
+        "   Replay the names in `corpus`, one per line, through each matcher (the linear lists of -c/-C, the\n"
+        "   sorted set of --rules, and a hash set), with the given rules and with growing sets of rules drawn\n"
+        "   from the corpus, and print the time per name\n"
+        "\n"
+        "%s --capture=file [-c ext]... [--rules=file] path...\n"
+        "   Write the name of every entry under the given paths to `file`, one per line, anonymized: letters\n"
+        "   and digits are scrambled and non-ASCII characters replaced by others of the same encoded length,\n"
+        "   keeping dots and separators. Only common extensions, and those the given rules name, are kept\n",
+        executableName, executableName, executableName
+    );
+}
+
+/**
+ * Entry point
+ */
+int
+main(int argc, char** argv) {
+    char* const     imageName   = *argv;
+    Configuration*  config      = Configuration_new();
+    const char*     capturePath = NULL;
+    int             option;
+
+    while ((option = getopt_long(argc, argv, "hc:C:", BenchOptions, NULL)) != -1) {
+        switch (option) {
+            case 'c':
+                Configuration_clobberExtension(config, optarg);
+                break;
+            case 'C':
+                Configuration_clobberName(config, optarg);
+                break;
+            case 'r':
+                config->rulesPath = optarg;
+                config->rules     = RuleSet_load(optarg);
+
+                unless (config->rules) {
+                    Runtime_putError("Could not load rules from %s: ERRNO %u\n", optarg, errno);
+                    return errno;
+                }
+                break;
+            case 'w':
+                capturePath = optarg;
+                break;
+            default:
+                Bench_printHelp(imageName);
+                return option == 'h' ? ENONE : EINVAL;
+        }
+    }
+
+    char**  files   = argv + optind;
+    size_t  n_files = argc - optind;
+
+    if (capturePath && n_files > 0) {
+        size_t  n_roots;
+        Root*   roots   = Root_plan(config, files, n_files, &n_roots);
+
+        return Bench_capture(config, capturePath, roots, n_roots);
+    }
+
+    unless (!capturePath && n_files == 1) {
+        Bench_printHelp(imageName);
+        return EINVAL;
+    }
+
+    return Bench_run(config, files[0]);
+}
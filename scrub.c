@@ -37,12 +37,13 @@
 /*
  * struct stat 
  * stat()
+ * statx()
  */
 #include <sys/stat.h>
 
 /*
- * readdir()
- * closedir()
+ * getdents64()
+ * struct dirent64
  */
 #include <dirent.h>
 
@@ -62,6 +63,106 @@
  */
 #include <unistd.h>
 
+/*
+ * pthread_create()
+ * pthread_mutex_lock()
+ * pthread_cond_wait()
+ */
+#include <pthread.h>
+
+/*
+ * open()
+ * O_DIRECTORY
+ */
+#include <fcntl.h>
+
+/*
+ * posix_spawnp()
+ */
+#include <spawn.h>
+
+/*
+ * waitpid()
+ */
+#include <sys/wait.h>
+
+/*
+ * mmap()
+ * munmap()
+ */
+#include <sys/mman.h>
+
+/*
+ * ioctl()
+ */
+#include <sys/ioctl.h>
+
+/*
+ * FS_IOC_FIEMAP
+ * struct fiemap
+ */
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+
+/*
+ * fstatfs()
+ * struct statfs
+ */
+#include <sys/vfs.h>
+
+/*
+ * EXT4_SUPER_MAGIC
+ * XFS_SUPER_MAGIC
+ * TMPFS_MAGIC
+ * BTRFS_SUPER_MAGIC
+ */
+#include <linux/magic.h>
+
+/*
+ * BTRFS_IOC_SNAP_DESTROY
+ * struct btrfs_ioctl_vol_args
+ * BTRFS_FIRST_FREE_OBJECTID
+ */
+#include <linux/btrfs.h>
+#include <linux/btrfs_tree.h>
+
+/*
+ * clock_gettime()
+ */
+#include <time.h>
+
+/*
+ * sqrt()
+ */
+#include <math.h>
+
+/*
+ * getpwnam()
+ * getgrnam()
+ */
+#include <pwd.h>
+#include <grp.h>
+
+/*
+ * getrlimit()
+ * RLIMIT_NOFILE
+ */
+#include <sys/resource.h>
+
+/*
+ * sigwait()
+ * SIGHUP
+ */
+#include <signal.h>
+
+/*
+ * socket()
+ * connect()
+ * struct sockaddr_un
+ */
+#include <sys/socket.h>
+#include <sys/un.h>
+
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdlib.h>
@@ -69,11 +170,11 @@
 #include <stdbool.h>
 #include <errno.h>
 
-typedef unsigned int    u32;
-typedef struct option   Option;
+typedef unsigned int            u32;
+typedef unsigned long long      u64;
+typedef struct option           Option;
 
-typedef DIR             Directory;
-typedef struct dirent   DirEntry;
+typedef struct dirent64 DirEntry;
 
 /**
  * "Success value" for errno as defined in errno(3)
@@ -98,7 +199,32 @@ typedef enum {
 
     PRESERVE_SPECIAL    = CHAR_MAX + 1,
     RUN_SIMULATE,
-    VERBOSE_LOGGING
+    VERBOSE_LOGGING,
+    PROFILE_RULES,
+    RUN_SURVEY,
+    JOBS,
+    DURABLE,
+    PRINT_STATS,
+    EMPTY_DIRS_ONLY,
+    ORPHAN_SIDECARS,
+    PRIMARY_EXT,
+    CLOBBER_ZERO,
+    BLOCKLIST,
+    BLOCKLIST_BUILD,
+    PLAN,
+    APPLY,
+    RUN_ESTIMATE,
+    WHY_DIRTY,
+    TOMBSTONE,
+    NOTIFY,
+    NOTIFY_INTERVAL,
+    RULES_FILE,
+    DESTROY_SUBVOLUMES,
+    OWNER,
+    GROUP,
+    HOMOGENEOUS_OWNERS,
+    SORTED_DELETES,
+    HISTORY
 } Flag;
 
 /**
@@ -116,11 +242,101 @@ static Option Options[] = {
     // Do not delete "special" files 
     { "preserve-special",   no_argument,        0,  PRESERVE_SPECIAL},
     // Print actions only 
-    { "simulate",           no_argument,        0,  RUN_SIMULATE    },
+    { "simulate",           optional_argument,  0,  RUN_SIMULATE    },
     { "verbose",            no_argument,        0,  VERBOSE_LOGGING },
+    // Report how often each rule matched
+    { "profile-rules",      no_argument,        0,  PROFILE_RULES   },
+    // Account space by extension instead of deleting
+    { "survey",             no_argument,        0,  RUN_SURVEY      },
+    // Worker threads for parallel modes
+    { "jobs",               required_argument,  0,  JOBS            },
+    // Persist deletions before exiting
+    { "durable",            no_argument,        0,  DURABLE         },
+    // Print counters when done
+    { "stats",              no_argument,        0,  PRINT_STATS     },
+    // Only collapse empty directory trees
+    { "empty-dirs-only",    no_argument,        0,  EMPTY_DIRS_ONLY },
+    // Delete sidecar files left without their primary file
+    { "orphan-sidecars",    required_argument,  0,  ORPHAN_SIDECARS },
+    { "primary",            required_argument,  0,  PRIMARY_EXT     },
+    // Delete files that hold nothing but zeros
+    { "clobber-zero",       no_argument,        0,  CLOBBER_ZERO    },
+    // Delete files whose content is listed in a blocklist
+    { "blocklist",          required_argument,  0,  BLOCKLIST       },
+    // Write a blocklist of the given files instead of deleting anything
+    { "blocklist-build",    required_argument,  0,  BLOCKLIST_BUILD },
+    // Write what would be deleted to a plan file instead of deleting it
+    { "plan",               required_argument,  0,  PLAN            },
+    // Delete what a plan file lists, without walking
+    { "apply",              required_argument,  0,  APPLY           },
+    // Estimate what a run would do from random probes
+    { "estimate",           optional_argument,  0,  RUN_ESTIMATE    },
+    // Report what kept each dirty root from being collapsed
+    { "why-dirty",          no_argument,        0,  WHY_DIRTY       },
+    // Rename fully clobberable directories out of sight, then delete them in the background
+    { "tombstone",          optional_argument,  0,  TOMBSTONE       },
+    // Tell a file, FIFO or socket which top-level directories changed
+    { "notify",             required_argument,  0,  NOTIFY          },
+    // Seconds between notifications
+    { "notify-interval",    required_argument,  0,  NOTIFY_INTERVAL },
+    // Read more rules from a file, again on SIGHUP
+    { "rules",              required_argument,  0,  RULES_FILE      },
+    // Destroy btrfs subvolumes that would be emptied, rather than emptying them
+    { "destroy-subvolumes", no_argument,        0,  DESTROY_SUBVOLUMES },
+    // Only delete what belongs to this user
+    { "owner",              required_argument,  0,  OWNER           },
+    // Only delete what belongs to this group
+    { "group",              required_argument,  0,  GROUP           },
+    // Do not descend into directories that --owner/--group rule out
+    { "homogeneous-owners", no_argument,        0,  HOMOGENEOUS_OWNERS },
+    // Collect what to delete in each directory, and delete it in inode order once the directory is read
+    { "sorted-deletes",     optional_argument,  0,  SORTED_DELETES  },
+    // Keep subtree sizes and durations from run to run, to schedule the walk
+    { "history",            required_argument,  0,  HISTORY         },
     { NULL,                 0,                  0,  0               }
 };
 
+/**
+ * Output formats for --simulate
+ */
+typedef enum {
+    // One `unlink(path)` line per operation
+    SIMULATE_LINES,
+    // Aggregated per-directory tree and per-rule table
+    SIMULATE_SUMMARY,
+    // Same aggregates as SIMULATE_SUMMARY, as JSON
+    SIMULATE_JSON
+} SimulateFormat;
+
+/**
+ * Index of a clobber rule.
+ * Names are numbered first, followed by extensions.
+ */
+typedef long RuleIndex;
+
+static const RuleIndex  NO_RULE = -1;
+
+struct Summary;
+struct RuleProfile;
+
+/*
+ * Rules of --rules files, numbered as they are first read (see the Rule files section)
+ */
+static size_t       RuleSet_entryCount();
+static const char*  RuleSet_entryPattern(RuleIndex entry);
+
+struct Durability;
+struct ExecBatch;
+struct Blocklist;
+struct HashPool;
+struct Plan;
+struct ErrorLog;
+struct WhyDirty;
+struct Tombstones;
+struct Notifier;
+struct RuleSet;
+struct DirCache;
+
 /**
  * Structure that stores the configuration passed on the commandline
  */
@@ -131,6 +347,57 @@ typedef struct {
      * Whether to simulate operations or not
      */
     bool simulate;
+    SimulateFormat simulateFormat;
+
+    /*
+     * Aggregated simulation report, when simulateFormat is not SIMULATE_LINES
+     */
+    struct Summary* summary;
+
+    /*
+     * Whether to report per-rule hit counts at exit
+     */
+    bool profileRules;
+
+    /*
+     * Per-rule counters, when profiling rules or summarizing a simulation
+     */
+    struct RuleProfile* ruleProfile;
+
+    /*
+     * Whether to only account space by extension rather than delete anything
+     */
+    bool survey;
+
+    /*
+     * Number of random probes per root for --estimate, or 0 when not estimating
+     */
+    u32 estimateProbes;
+
+    /*
+     * Number of worker threads for parallel modes
+     */
+    u32 jobs;
+
+    /*
+     * Directories modified by the run, to be flushed before exiting when --durable is given
+     */
+    struct Durability* durability;
+
+    /*
+     * Whether to print walk and allocator counters when done
+     */
+    bool stats;
+
+    /*
+     * Whether to only remove directories that are empty or only hold empty directories, without any rules
+     */
+    bool emptyDirsOnly;
+
+    /*
+     * Command that matched files are handed to instead of being deleted, if any
+     */
+    struct ExecBatch* execBatch;
 
     /*
      * Whether to avoid hidden folders
@@ -153,6 +420,100 @@ typedef struct {
      */
     char**  clobberNames;
     size_t  clobberNamesLen;
+
+    /*
+     * Extensions of sidecar files, to clobber when no primary file with the same stem is next to them
+     */
+    char**  sidecarExtensions;
+    size_t  sidecarExtensionsLen;
+
+    /*
+     * Extensions of primary files
+     */
+    char**  primaryExtensions;
+    size_t  primaryExtensionsLen;
+
+    /*
+     * Whether to clobber non-empty regular files that only hold zeros (or holes)
+     */
+    bool    clobberZero;
+
+    /*
+     * Table of (size, content hash) pairs to clobber, and where it was loaded from
+     */
+    struct Blocklist*   blocklist;
+    char*               blocklistPath;
+
+    /*
+     * Where to write a blocklist of the roots, when building one
+     */
+    char*               blocklistBuildPath;
+
+    /*
+     * Plan being written (--plan), and where; or plan to execute (--apply)
+     */
+    struct Plan*        plan;
+    char*               planPath;
+    char*               applyPath;
+
+    /*
+     * Aggregated errors of the walk
+     */
+    struct ErrorLog*    errorLog;
+
+    /*
+     * Survivors of the current root, when asked why roots stay
+     */
+    struct WhyDirty*    whyDirty;
+
+    /*
+     * How many levels below a root to look for directories to tombstone (0 for none), and the tombstones made
+     */
+    u32                 tombstoneDepth;
+    struct Tombstones*  tombstones;
+
+    /*
+     * Where to send change notifications, how often, and the notifier once running
+     */
+    char*               notifyPath;
+    u32                 notifyInterval;
+    struct Notifier*    notifier;
+
+    /*
+     * Rules read from a file, swapped for a new set when the file is reloaded (never modified in place)
+     */
+    char*               rulesPath;
+    struct RuleSet*     rules;
+
+    /*
+     * Open directories kept for reuse by --apply and --durable
+     */
+    struct DirCache*    dirCache;
+
+    /*
+     * Whether to destroy btrfs subvolumes whose contents would all be clobbered
+     */
+    bool                destroySubvolumes;
+
+    /*
+     * Owner and group that everything deleted must have ((uid_t) -1 and (gid_t) -1 for any), and whether
+     * subtrees can be assumed to belong to the owner of their top directory
+     */
+    uid_t               owner;
+    gid_t               group;
+    bool                homogeneousOwners;
+
+    /*
+     * Bytes of pending deletes held in memory per directory before they are spilled to disk, or 0 to delete files
+     * as the listing is read
+     */
+    size_t              sortedDeletes;
+
+    /*
+     * Where subtree sizes and durations are kept between runs, and what was loaded from there
+     */
+    char*               historyPath;
+    struct History*     history;
 } Configuration;
 
 /**
@@ -165,12 +526,51 @@ Configuration_new() {
     
     self->verbose              = false;
     self->simulate             = false;
+    self->simulateFormat       = SIMULATE_LINES;
+    self->summary              = NULL;
+    self->profileRules         = false;
+    self->ruleProfile          = NULL;
+    self->survey               = false;
+    self->estimateProbes       = 0;
+    self->jobs                 = 0;
+    self->durability           = NULL;
+    self->stats                = false;
+    self->emptyDirsOnly        = false;
+    self->execBatch            = NULL;
     self->preserveHidden       = false;
     self->preserveSpecial      = false;
     self->clobberExtensions    = (char**) malloc(sizeof(char**));
     self->clobberExtensionsLen = 0;
     self->clobberNames         = (char**) malloc(sizeof(char**));
     self->clobberNamesLen      = 0;
+    self->sidecarExtensions    = NULL;
+    self->sidecarExtensionsLen = 0;
+    self->primaryExtensions    = NULL;
+    self->primaryExtensionsLen = 0;
+    self->clobberZero          = false;
+    self->blocklist            = NULL;
+    self->blocklistPath        = NULL;
+    self->blocklistBuildPath   = NULL;
+    self->plan                 = NULL;
+    self->planPath             = NULL;
+    self->applyPath            = NULL;
+    self->errorLog             = NULL;
+    self->whyDirty             = NULL;
+    self->tombstoneDepth       = 0;
+    self->tombstones           = NULL;
+    self->notifyPath           = NULL;
+    self->notifyInterval       = 10;
+    self->notifier             = NULL;
+    self->rulesPath            = NULL;
+    self->rules                = NULL;
+    self->dirCache             = NULL;
+    self->destroySubvolumes    = false;
+    self->owner                = (uid_t) -1;
+    self->group                = (gid_t) -1;
+    self->homogeneousOwners    = false;
+    self->sortedDeletes        = 0;
+    self->historyPath          = NULL;
+    self->history              = NULL;
 
     return self;
 }
@@ -183,21 +583,20 @@ Configuration_new() {
  */
 static void 
 Configuration_clobberExtension(Configuration* config, char* extension) {
-    config->clobberExtensions = realloc(config->clobberExtensions, config->clobberExtensionsLen + 1);
+    config->clobberExtensions = realloc(config->clobberExtensions, (config->clobberExtensionsLen + 1) * sizeof(char*));
     char** nextPtr = config->clobberExtensions + config->clobberExtensionsLen;
-    *nextPtr = malloc(strlen(extension) * sizeof(char));
-    strcpy(*nextPtr, extension);
+    *nextPtr = strdup(extension);
     ++config->clobberExtensionsLen;
 }
 
 /**
- * Returns true if the provided extension should be clobbered 
+ * Returns the position of the provided extension in the list of extensions to clobber, or NO_RULE
  *
  * @param config    configuration
  * @param extension extension
  */
-static hot pure bool
-Configuration_shouldClobberExtension(Configuration* config, char* extension) {
+static hot pure RuleIndex
+Configuration_findExtension(Configuration* config, char* extension) {
     // Linear search, though this should not be too impactful as I highly doubt you would ever need to remove
     // a significantly large number of unique extension names 
  
@@ -205,13 +604,13 @@ Configuration_shouldClobberExtension(Configuration* config, char* extension) {
 
     while (index < config->clobberExtensionsLen) {
         if (strcmp(extension, *(config->clobberExtensions + index)) == 0) {
-            return true;
+            return index;
         }
 
         ++index;
     }
 
-    return false;
+    return NO_RULE;
 }
 
 /**
@@ -222,34 +621,195 @@ Configuration_shouldClobberExtension(Configuration* config, char* extension) {
  */
 static void
 Configuration_clobberName(Configuration* config, char* name) {
-    config->clobberNames = realloc(config->clobberNames, config->clobberNamesLen + 1);
+    config->clobberNames = realloc(config->clobberNames, (config->clobberNamesLen + 1) * sizeof(char*));
     char** nextPtr = config->clobberNames + config->clobberNamesLen;
-    *nextPtr = malloc(strlen(name) * sizeof(char));
-    strcpy(*nextPtr, name);
+    *nextPtr = strdup(name);
     ++config->clobberNamesLen;
 }
 
 /**
- * Returns true if the provided file name should be clobbered 
+ * Returns the position of the provided file name in the list of names to clobber, or NO_RULE
  *
  * @param config    configuration
  * @param name      file name
  */
-static hot pure bool
-Configuration_shouldClobberName(Configuration* config, char* name) {
+static hot pure RuleIndex
+Configuration_findName(Configuration* config, char* name) {
     size_t index = 0;
 
     while (index < config->clobberNamesLen) {
         if (strcmp(name, *(config->clobberNames + index)) == 0) {
-            return true;
+            return index;
         }
 
         ++index;
     }
 
+    return NO_RULE;
+}
+
+/**
+ * Add each item of a comma-separated list to a list of strings
+ *
+ * @param list      list
+ * @param listLen   list length
+ * @param items     comma-separated items
+ */
+static void
+Configuration_appendList(char*** list, size_t* listLen, char* items) {
+    char* item = items;
+
+    while (item) {
+        char* next = strchr(item, ',');
+
+        if (next) {
+            *next++ = '\0';
+        }
+
+        if (*item) {
+            *list = realloc(*list, (*listLen + 1) * sizeof(char*));
+            *(*list + *listLen) = strdup(item);
+            ++*listLen;
+        }
+
+        item = next;
+    }
+}
+
+/**
+ * Returns the position of the provided extension in the list of sidecar extensions, or NO_RULE
+ *
+ * @param config    configuration
+ * @param extension extension
+ */
+static hot pure RuleIndex
+Configuration_findSidecar(Configuration* config, char* extension) {
+    for (size_t index = 0; index < config->sidecarExtensionsLen; ++index) {
+        if (strcmp(extension, *(config->sidecarExtensions + index)) == 0) {
+            return index;
+        }
+    }
+
+    return NO_RULE;
+}
+
+/**
+ * Returns true if the provided extension is that of a primary file
+ *
+ * @param config    configuration
+ * @param extension extension
+ */
+static hot pure bool
+Configuration_isPrimary(Configuration* config, char* extension) {
+    for (size_t index = 0; index < config->primaryExtensionsLen; ++index) {
+        if (strcmp(extension, *(config->primaryExtensions + index)) == 0) {
+            return true;
+        }
+    }
+
     return false;
 }
 
+/**
+ * Number of threads for --survey and for hashing: --jobs, or the number of online processors
+ *
+ * @param config    configuration
+ */
+static u32
+Configuration_jobs(Configuration* config) {
+    long processors = config->jobs ? (long) config->jobs : sysconf(_SC_NPROCESSORS_ONLN);
+
+    return processors > 0 ? (u32) processors : 1;
+}
+
+/**
+ * Total number of rules (names, extensions, sidecar extensions, --clobber-zero, --blocklist and every rule read
+ * from the --rules file so far)
+ *
+ * @param config    configuration
+ */
+static pure size_t
+Configuration_ruleCount(Configuration* config) {
+    return config->clobberNamesLen + config->clobberExtensionsLen + config->sidecarExtensionsLen
+         + config->clobberZero + (config->blocklist != NULL) + (config->rulesPath ? RuleSet_entryCount() : 0);
+}
+
+/**
+ * Index of the --clobber-zero rule, which comes after all the others
+ *
+ * @param config    configuration
+ */
+static pure RuleIndex
+Configuration_zeroRule(Configuration* config) {
+    return config->clobberNamesLen + config->clobberExtensionsLen + config->sidecarExtensionsLen;
+}
+
+/**
+ * Index of the --blocklist rule, which follows --clobber-zero
+ *
+ * @param config    configuration
+ */
+static pure RuleIndex
+Configuration_blocklistRule(Configuration* config) {
+    return Configuration_zeroRule(config) + config->clobberZero;
+}
+
+/**
+ * Index of the first rule of the --rules file, which follow --blocklist
+ *
+ * @param config    configuration
+ */
+static pure RuleIndex
+Configuration_rulesFileRule(Configuration* config) {
+    return Configuration_blocklistRule(config) + (config->blocklist != NULL);
+}
+
+/**
+ * Returns the kind of a rule, `name`, `ext`, `orphan`, `zero`, `blocklist` or `rules`
+ *
+ * @param config    configuration
+ * @param rule      rule index
+ */
+static pure const char*
+Configuration_ruleKind(Configuration* config, RuleIndex rule) {
+    if ((size_t) rule < config->clobberNamesLen) {
+        return "name";
+    } else if ((size_t) rule < config->clobberNamesLen + config->clobberExtensionsLen) {
+        return "ext";
+    } else if (rule < Configuration_zeroRule(config)) {
+        return "orphan";
+    } else if (rule < Configuration_blocklistRule(config)) {
+        return "zero";
+    } else if (rule < Configuration_rulesFileRule(config)) {
+        return "blocklist";
+    } else {
+        return "rules";
+    }
+}
+
+/**
+ * Returns the pattern (file name or extension) of a rule
+ *
+ * @param config    configuration
+ * @param rule      rule index
+ */
+static pure const char*
+Configuration_rulePattern(Configuration* config, RuleIndex rule) {
+    if ((size_t) rule < config->clobberNamesLen) {
+        return *(config->clobberNames + rule);
+    } else if ((size_t) rule < config->clobberNamesLen + config->clobberExtensionsLen) {
+        return *(config->clobberExtensions + (rule - config->clobberNamesLen));
+    } else if (rule < Configuration_zeroRule(config)) {
+        return *(config->sidecarExtensions + (rule - config->clobberNamesLen - config->clobberExtensionsLen));
+    } else if (rule < Configuration_blocklistRule(config)) {
+        return "*";
+    } else if (rule < Configuration_rulesFileRule(config)) {
+        return config->blocklistPath;
+    } else {
+        return RuleSet_entryPattern(rule - Configuration_rulesFileRule(config));
+    }
+}
+
 static pure void 
 Runtime_putError(char* format, ...) {
     va_list args;
@@ -293,194 +853,7179 @@ Runtime_printHelp(char* executableName) {
         "--preserve-special\n"
         "   Do not delete special files (such as sockets, block devices, and pipes)\n"
         "\n"
-        "--simulate\n"
-        "   Rather than calling unlink() and the like, output a message\n"
+        "--simulate[=format]\n"
+        "   Rather than calling unlink() and the like, report what would be done\n"
+        "   `lines` (the default) prints one message per operation, `summary` prints a\n"
+        "   per-directory tree and per-rule table of what would be removed, `json` prints\n"
+        "   the same aggregates as JSON\n"
         "\n"
         "--verbose\n"
         "   Verbose logging output\n"
+        "\n"
+        "--profile-rules\n"
+        "   When done, print every rule ranked by the number of files it matched, flagging rules that never matched\n"
+        "\n"
+        "--survey\n"
+        "   Do not delete anything. Instead, print a table of file counts and allocated space by extension,\n"
+        "   split by whether the current rules would clobber them\n"
+        "\n"
+        "--estimate[=probes]\n"
+        "   Do not delete anything. Instead, follow `probes` (default 2000) random paths down each root and\n"
+        "   extrapolate the number of directories, entries, matched files and bytes, and the time a walk would take,\n"
+        "   with 95% confidence intervals. Only name and extension rules are counted. The time is projected from the\n"
+        "   first read of each directory the probes went through; directories still cached from an earlier run make\n"
+        "   it a lower bound\n"
+        "\n"
+        "--why-dirty\n"
+        "   For every root that could not be collapsed, print what kept it: the entries that stayed, counted by\n"
+        "   type and by extension, and a sample of their paths. Directories that only stayed because of what is\n"
+        "   inside them are not counted\n"
+        "\n"
+        "--tombstone[=depth]\n"
+        "   Before walking a directory up to `depth` (default 1) levels below a root, rename it to a hidden tombstone\n"
+        "   in the same directory and check whether everything in it would be deleted. If so, the directory has\n"
+        "   disappeared at once, and the tombstone is deleted in the background; if not, it is renamed back and walked,\n"
+        "   without checking the directories below it again. Waits for the tombstones to be gone before exiting\n"
+        "\n"
+        "--notify=path\n"
+        "   Tell `path` (a file to append to, a FIFO, or a Unix socket) which top-level directories below the roots\n"
+        "   lost anything, so that other programs can refresh just those. Each batch is a list of absolute paths, one\n"
+        "   per line, ended by an empty line, with each directory listed once. `path` is not created: a file to\n"
+        "   append to must exist already, and until a FIFO or socket exists, batches wait for it\n"
+        "\n"
+        "--notify-interval=seconds\n"
+        "   Send a batch at most this often (default 10), and when done. The paths of a batch that could not be sent\n"
+        "   are sent again with the next one\n"
+        "\n"
+        "--rules=file\n"
+        "   Also delete what the rules in `file` match: one rule per line, `name <file name>` or `ext <extension>`,\n"
+        "   with `#` starting a comment. On SIGHUP, the file is read again and its rules replace the previous ones\n"
+        "   from the next entry on, without stopping the walk. If the file cannot be read, the previous rules stay\n"
+        "\n"
+        "--destroy-subvolumes\n"
+        "   When everything in a btrfs subvolume would be deleted, destroy the subvolume with one ioctl instead, and\n"
+        "   let btrfs reclaim it in the background. Needs CAP_SYS_ADMIN or the user_subvol_rm_allowed mount option;\n"
+        "   otherwise, and for subvolumes holding other subvolumes, the subvolume is emptied as usual. The subvolume is\n"
+        "   made read-only while it is checked, so that nothing written meanwhile is lost, and made writable again\n"
+        "   if it stays; writers get EROFS in the meantime. Each subvolume is named on stderr before it is made\n"
+        "   read-only, so that one left so by a run that was killed can be found\n"
+        "\n"
+        "--owner=user, --group=group\n"
+        "   Only delete files and directories that belong to `user` and/or `group` (names or numeric ids). Whatever\n"
+        "   else the rules match stays, and so do the directories holding it\n"
+        "\n"
+        "--homogeneous-owners\n"
+        "   With --owner or --group, assume that everything in a directory belongs to the directory's owner and\n"
+        "   group, and skip directories that are ruled out without looking inside\n"
+        "\n"
+        "--sorted-deletes[=MiB]\n"
+        "   Do not delete files while their directory is being read. Instead, note the names to delete, and once the\n"
+        "   whole directory has been read, delete them in inode order. Past `MiB` (default 64) of names in one\n"
+        "   directory, they are sorted and spilled to a temporary file in batches, which are deleted one after the\n"
+        "   other. Keeps deletion fast and steady in directories with millions of entries\n"
+        "\n"
+        "--history=file\n"
+        "   Remember how many entries the roots and the subtrees up to two levels below them held, and how long they\n"
+        "   took, in `file`, and use what earlier runs remembered to walk the biggest roots first. With --survey, the\n"
+        "   subtrees that took longest are also handed to the workers from the start instead of when they are reached\n"
+        "\n"
+        "--jobs=n\n"
+        "   Number of worker threads for --survey (defaults to the number of online processors),\n"
+        "   and of commands run at once for --exec-batch (defaults to 4)\n"
+        "\n"
+        "--durable\n"
+        "   Before exiting, make sure deletions have reached the disk: fsync() every directory that was modified,\n"
+        "   or syncfs() filesystems on which many directories were modified\n"
+        "\n"
+        "--stats\n"
+        "   When done, print counters for the walk and its allocator to stderr\n"
+        "\n"
+        "--empty-dirs-only\n"
+        "   Do not delete any files, only directory trees that hold nothing but directories.\n"
+        "   Cannot be combined with clobber rules\n"
+        "\n"
+        "--orphan-sidecars=ext[,ext...] --primary=ext[,ext...]\n"
+        "   Delete files with a sidecar extension (e.g. srt,nfo,jpg) when no file with a primary extension\n"
+        "   (e.g. mkv,mp4) and the same stem is in the same directory. `movie.en.srt` belongs to `movie.mkv`\n"
+        "\n"
+        "--clobber-zero\n"
+        "   Also delete non-empty regular files that only hold zeros, such as space preallocated by a download that\n"
+        "   never finished. Asks the filesystem where the data is (SEEK_DATA, FIEMAP) and only reads what it reports\n"
+        "\n"
+        "--blocklist=file\n"
+        "   Also delete files whose size and content hash are listed in `file`, as written by --blocklist-build.\n"
+        "   Only files of a listed size are read\n"
+        "\n"
+        "--blocklist-build=file\n"
+        "   Do not delete anything. Instead, write a blocklist of every non-empty file under the given paths to `file`\n"
+        "\n"
+        "--plan=file\n"
+        "   Do not delete anything. Instead, write everything that would be deleted to `file`, grouped by directory,\n"
+        "   along with each entry's inode and file handle. Directories are recorded by absolute path, so the plan can\n"
+        "   be applied from any working directory. The plan is text and can be reviewed before applying it\n"
+        "\n"
+        "--apply=file\n"
+        "   Delete exactly what a plan lists, without walking. Entries that were replaced or changed type since the\n"
+        "   plan was written are skipped. Takes no paths. With --simulate, only reports what would be deleted\n"
+        "\n"
+        "--exec-batch command [argument...] {} +\n"
+        "   Rather than deleting matched files, run `command` on them, passing as many paths at once as the system\n"
+        "   allows in place of `{}`. Commands run while the walk goes on. Directories holding such files are not\n"
+        "   collapsed, and the run only counts as not empty if other files remain or a command fails\n"
         , executableName
     );
 }
 
 /*
- * SECTION: Implementation
- * Routines relating to deleting things
+ * SECTION: String sets
+ * The hash every string-keyed table here uses, and a set of strings for those that need no more than a set
  */
 
-static pure u32 
-File_unlink(Configuration* config, char* path) {
-    if (config->simulate) {
-        Runtime_putError("unlink(%s)\n", path);
-        return 0;
+/**
+ * FNV-1a of the first `length` bytes of `key`
+ */
+static hot pure u64
+String_hash(const char* key, size_t length) {
+    u64 hash = 14695981039346656037ULL;
+
+    for (size_t index = 0; index < length; ++index) {
+        hash ^= (unsigned char) key[index];
+        hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+/**
+ * Open-addressed (linear probing) set of strings, from malloc(). Zero-initialized, it is empty.
+ */
+typedef struct {
+    char**  slots;
+    size_t  capacity;
+    size_t  length;
+} StringSet;
+
+/**
+ * Returns the slot holding the first `length` bytes of `key`, or the empty slot where they would go
+ */
+static hot char**
+StringSet_slot(char** slots, size_t capacity, const char* key, size_t length) {
+    size_t index = String_hash(key, length) & (capacity - 1);
+
+    while (slots[index] && !(strncmp(slots[index], key, length) == 0 && slots[index][length] == '\0')) {
+        index = (index + 1) & (capacity - 1);
+    }
+
+    return slots + index;
+}
+
+/**
+ * Returns true if the first `length` bytes of `key` are in the set
+ */
+static hot bool
+StringSet_contains(StringSet* self, const char* key, size_t length) {
+    return self->length > 0 && *StringSet_slot(self->slots, self->capacity, key, length) != NULL;
+}
+
+/**
+ * Add a string, taking ownership of it (it is freed if the set holds it already)
+ *
+ * @return true if it was not in the set
+ */
+static bool
+StringSet_adopt(StringSet* self, char* key) {
+    // Keep the load factor at or below 1/2
+    if ((self->length + 1) * 2 > self->capacity) {
+        size_t  capacity = self->capacity ? self->capacity * 2 : 16;
+        char**  slots    = (char**) calloc(capacity, sizeof(char*));
+
+        for (size_t index = 0; index < self->capacity; ++index) {
+            if (self->slots[index]) {
+                *StringSet_slot(slots, capacity, self->slots[index], strlen(self->slots[index])) = self->slots[index];
+            }
+        }
+
+        dispose(self->slots);
+        self->slots    = slots;
+        self->capacity = capacity;
+    }
+
+    char** slot = StringSet_slot(self->slots, self->capacity, key, strlen(key));
+
+    if (*slot) {
+        dispose(key);
+        return false;
+    }
+
+    *slot = key;
+    ++self->length;
+    return true;
+}
+
+/**
+ * Add a copy of the first `length` bytes of `key`
+ *
+ * @return true if they were not in the set
+ */
+static bool
+StringSet_add(StringSet* self, const char* key, size_t length) {
+    return StringSet_contains(self, key, length) ? false : StringSet_adopt(self, strndup(key, length));
+}
+
+static void
+StringSet_free(StringSet* self) {
+    for (size_t index = 0; index < self->capacity; ++index) {
+        dispose(self->slots[index]);
+    }
+
+    dispose(self->slots);
+    self->capacity = 0;
+    self->length   = 0;
+}
+
+/*
+ * SECTION: Error reporting
+ * Errors of the walk, --survey and --blocklist-build are counted by (errno, operation, top-level subtree). The first
+ * few of each kind are printed as they happen, at a limited rate; the rest only show up in the table printed at the end.
+ */
+
+/**
+ * Errors of one kind printed as they happen, before the rest are only counted
+ */
+static const u64        ErrorLiveSamples    = 3;
+
+/**
+ * Live error lines allowed in a burst, and per second after that
+ */
+static const double     ErrorBurst          = 50;
+static const double     ErrorRate           = 10;
+
+/**
+ * Sample paths kept for the final table, per kind
+ */
+#define ERROR_SAMPLES   3
+
+/**
+ * Kinds kept apart; errors of further kinds are counted together, as ErrorOther
+ */
+#define ERROR_KIND_LIMIT    256
+static const size_t     ErrorKindLimit      = ERROR_KIND_LIMIT;
+static const char       ErrorOther[]        = "(other)";
+
+/**
+ * Slots of the table that finds a kind by (errno, operation, subtree), twice ErrorKindLimit
+ */
+#define ERROR_SLOTS         (2 * ERROR_KIND_LIMIT)
+
+typedef struct {
+    int         error;
+    const char* operation;
+    char*       subtree;
+    u64         count;
+    char*       samples[ERROR_SAMPLES];
+} ErrorKind;
+
+typedef struct ErrorLog {
+    ErrorKind*      kinds;
+    size_t          kindsLen;
+    short           slots[ERROR_SLOTS];     // index into `kinds`, or -1
+    const char*     root;
+    u64             total;
+    u64             suppressed;
+    double          tokens;
+    double          refilled;
+    pthread_mutex_t lock;                   // errors come from survey workers and the tombstone deleter too
+} ErrorLog;
+
+static ErrorLog*
+ErrorLog_new() {
+    ErrorLog* self = (ErrorLog*) calloc(1, sizeof(ErrorLog));
+
+    self->kinds  = (ErrorKind*) calloc(ErrorKindLimit + 1, sizeof(ErrorKind));
+    self->tokens = ErrorBurst;
+
+    for (size_t slot = 0; slot < ERROR_SLOTS; ++slot) {
+        self->slots[slot] = -1;
+    }
+
+    pthread_mutex_init(&self->lock, NULL);
+
+    return self;
+}
+
+/**
+ * Set the root that paths of following errors belong to
+ */
+static void
+ErrorLog_enterRoot(ErrorLog* self, const char* root) {
+    self->root = root;
+}
+
+/**
+ * Top-level subtree of a path under `root`: the root plus its first component below the root.
+ * Not copied: the subtree is the first `length` bytes of what is returned.
+ */
+static const char*
+ErrorLog_subtree(const char* root, const char* path, size_t* length) {
+    size_t rootLength = root ? strlen(root) : 0;
+
+    unless (root && strncmp(path, root, rootLength) == 0 && path[rootLength] == '/') {
+        *length = root ? rootLength : strlen(path);
+        return root ? root : path;
+    }
+
+    *length = strchrnul(path + rootLength + 1, '/') - path;
+    return path;
+}
+
+/**
+ * Take a token for a live line, refilling at ErrorRate per second
+ */
+static bool
+ErrorLog_takeToken(ErrorLog* self) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    double seconds = now.tv_sec + now.tv_nsec / 1e9;
+
+    if (self->refilled > 0) {
+        self->tokens += (seconds - self->refilled) * ErrorRate;
+        self->tokens  = (self->tokens > ErrorBurst) ? ErrorBurst : self->tokens;
+    }
+
+    self->refilled = seconds;
+
+    if (self->tokens >= 1) {
+        self->tokens -= 1;
+        return true;
+    } else {
+        return false;
+    }
+}
+
+/**
+ * Report that an operation on a path below a given root failed. Without an error log, the error is printed right
+ * away.
+ *
+ * @param config    configuration
+ * @param root      root the path is under, which its subtree is counted against
+ * @param operation what was attempted, e.g. `unlink`
+ * @param path      path it was attempted on
+ * @param error     errno
+ */
+static void
+ErrorLog_reportUnder(Configuration* config, const char* root, const char* operation, const char* path, int error) {
+    ErrorLog* self = config->errorLog;
+
+    unless (self) {
+        Runtime_putError("Could not %s %s: ERRNO %u\n", operation, path, error);
+        return;
+    }
+
+    size_t      subtreeLength;
+    const char* subtree = ErrorLog_subtree(root, path, &subtreeLength);
+    u64         hash    = String_hash(subtree, subtreeLength) ^ String_hash(operation, strlen(operation)) ^ (u64) error;
+    size_t      slot    = hash & (ERROR_SLOTS - 1);
+    ErrorKind*  kind    = NULL;
+
+    pthread_mutex_lock(&self->lock);
+
+    for (; self->slots[slot] != -1; slot = (slot + 1) & (ERROR_SLOTS - 1)) {
+        ErrorKind* candidate = self->kinds + self->slots[slot];
+
+        if (candidate->error == error && strcmp(candidate->operation, operation) == 0
+            && strncmp(candidate->subtree, subtree, subtreeLength) == 0 && candidate->subtree[subtreeLength] == '\0') {
+            kind = candidate;
+            break;
+        }
+    }
+
+    unless (kind) {
+        if (self->kindsLen < ErrorKindLimit) {
+            self->slots[slot] = self->kindsLen;
+
+            kind = self->kinds + self->kindsLen++;
+            kind->error     = error;
+            kind->operation = operation;
+            kind->subtree   = strndup(subtree, subtreeLength);
+        } else {
+            // Past the limit, everything else shares one catch-all kind
+            kind = self->kinds + ErrorKindLimit;
+
+            unless (kind->subtree) {
+                kind->operation = ErrorOther;
+                kind->subtree   = strdup(ErrorOther);
+                self->kindsLen  = ErrorKindLimit + 1;
+            }
+        }
+    }
+
+    if (kind->count < ERROR_SAMPLES) {
+        kind->samples[kind->count] = strdup(path);
+    }
+
+    ++kind->count;
+    ++self->total;
+
+    if (kind->count <= ErrorLiveSamples && ErrorLog_takeToken(self)) {
+        Runtime_putError("Could not %s %s: ERRNO %u\n", operation, path, error);
+
+        if (kind->count == ErrorLiveSamples) {
+            Runtime_putError("Further `%s` errors (ERRNO %u) under %s will only be counted\n", operation, error, kind->subtree);
+        }
+    } else {
+        ++self->suppressed;
+    }
+
+    pthread_mutex_unlock(&self->lock);
+}
+
+/**
+ * Report that an operation on a path below the current root (see ErrorLog_enterRoot()) failed
+ *
+ * @param config    configuration
+ * @param operation what was attempted, e.g. `unlink`
+ * @param path      path it was attempted on
+ * @param error     errno
+ */
+static void
+ErrorLog_report(Configuration* config, const char* operation, const char* path, int error) {
+    ErrorLog_reportUnder(config, config->errorLog ? config->errorLog->root : NULL, operation, path, error);
+}
+
+static int
+ErrorLog_compareKinds(const void* left, const void* right) {
+    const ErrorKind* a = (const ErrorKind*) left;
+    const ErrorKind* b = (const ErrorKind*) right;
+
+    return (a->count < b->count) - (a->count > b->count);
+}
+
+/**
+ * Print the table of errors, most frequent first, if any error was not printed as it happened
+ */
+static cold void
+ErrorLog_print(ErrorLog* self, FILE* stream) {
+    if (self->suppressed == 0) {
+        return;
+    }
+
+    qsort(self->kinds, self->kindsLen, sizeof(ErrorKind), ErrorLog_compareKinds);
+
+    fprintf(stream, "\n%llu errors, %llu not shown:\n", (unsigned long long) self->total, (unsigned long long) self->suppressed);
+    fprintf(stream, "%12s %6s %-16s %s\n", "count", "errno", "operation", "subtree");
+
+    for (size_t index = 0; index < self->kindsLen; ++index) {
+        ErrorKind* kind = self->kinds + index;
+
+        fprintf(stream, "%12llu %6d %-16s %s\n", (unsigned long long) kind->count, kind->error, kind->operation, kind->subtree);
+
+        for (size_t sample = 0; sample < ERROR_SAMPLES && kind->samples[sample]; ++sample) {
+            fprintf(stream, "%12s %6s %-16s   e.g. %s\n", "", "", "", kind->samples[sample]);
+        }
+    }
+}
+
+/*
+ * SECTION: Rule files
+ * --rules: a rule set compiled from a file. A reload builds a whole new set and publishes it with an atomic
+ * pointer swap, so matching takes no lock. Replaced sets are only freed once nothing can be matching against them:
+ * each reload starts a new epoch, and the threads that match say which epoch they last saw at a point where they
+ * held no set (RuleSet_quiesce()). A set retired in an epoch every such thread has seen is freed.
+ */
+
+typedef struct RuleSet {
+    char**          names;
+    size_t          namesLen;
+    char**          extensions;
+    size_t          extensionsLen;
+
+    /*
+     * Number of each rule (see RuleSet_intern()), in the order of `names` and `extensions`
+     */
+    RuleIndex*      nameEntries;
+    RuleIndex*      extensionEntries;
+
+    struct RuleSet* retired;
+    u64             retiredAt;
+} RuleSet;
+
+/*
+ * Every rule read from a --rules file so far, as written (`name <file name>` or `ext <extension>`), numbered in
+ * the order they were first read. A rule keeps its number across reloads, so that it keeps its counters in the
+ * rule profile.
+ */
+static char**           RuleSet_entries         = NULL;
+static size_t           RuleSet_entriesLen      = 0;
+static RuleIndex*       RuleSet_entrySlots      = NULL;
+static size_t           RuleSet_entryCapacity   = 0;
+static pthread_mutex_t  RuleSet_entriesLock     = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * A thread that matches against the rules, and the last epoch it saw while holding no set
+ */
+typedef struct RuleSetReader {
+    u64                     epoch;
+    struct RuleSetReader*   next;
+} RuleSetReader;
+
+/*
+ * Sets replaced by a reload, and the threads that may still hold them; freed by RuleSet_collect()
+ */
+static RuleSet*                 RuleSet_retired     = NULL;
+static RuleSetReader*           RuleSet_readers     = NULL;
+static pthread_mutex_t          RuleSet_retiredLock = PTHREAD_MUTEX_INITIALIZER;
+static u64                      RuleSet_epoch       = 0;
+static bool                     RuleSet_watching    = false;
+static __thread RuleSetReader*  RuleSet_reader      = NULL;
+
+static int
+RuleSet_compare(const void* left, const void* right) {
+    return strcmp(*(char* const*) left, *(char* const*) right);
+}
+
+static void
+RuleSet_free(RuleSet* self) {
+    for (size_t index = 0; index < self->namesLen; ++index) {
+        dispose(self->names[index]);
+    }
+
+    for (size_t index = 0; index < self->extensionsLen; ++index) {
+        dispose(self->extensions[index]);
+    }
+
+    dispose(self->names);
+    dispose(self->extensions);
+    dispose(self->nameEntries);
+    dispose(self->extensionEntries);
+    dispose(self);
+}
+
+static size_t
+RuleSet_entryCount() {
+    pthread_mutex_lock(&RuleSet_entriesLock);
+    size_t count = RuleSet_entriesLen;
+    pthread_mutex_unlock(&RuleSet_entriesLock);
+
+    return count;
+}
+
+static const char*
+RuleSet_entryPattern(RuleIndex entry) {
+    pthread_mutex_lock(&RuleSet_entriesLock);
+    const char* pattern = (size_t) entry < RuleSet_entriesLen ? RuleSet_entries[entry] : "?";
+    pthread_mutex_unlock(&RuleSet_entriesLock);
+
+    return pattern;
+}
+
+/**
+ * Returns the number of a rule, numbering it if it was never read before
+ *
+ * @param kind      `name` or `ext`
+ * @param pattern   file name or extension
+ */
+static RuleIndex
+RuleSet_intern(const char* kind, const char* pattern) {
+    char* entry = (char*) malloc(strlen(kind) + strlen(pattern) + 2);
+
+    sprintf(entry, "%s %s", kind, pattern);
+    pthread_mutex_lock(&RuleSet_entriesLock);
+
+    // Keep the load factor at or below 1/2
+    if ((RuleSet_entriesLen + 1) * 2 > RuleSet_entryCapacity) {
+        RuleSet_entryCapacity = RuleSet_entryCapacity ? RuleSet_entryCapacity * 2 : 64;
+        RuleSet_entrySlots    = (RuleIndex*) realloc(RuleSet_entrySlots, RuleSet_entryCapacity * sizeof(RuleIndex));
+
+        for (size_t slot = 0; slot < RuleSet_entryCapacity; ++slot) {
+            RuleSet_entrySlots[slot] = NO_RULE;
+        }
+
+        for (size_t index = 0; index < RuleSet_entriesLen; ++index) {
+            size_t slot = String_hash(RuleSet_entries[index], strlen(RuleSet_entries[index])) & (RuleSet_entryCapacity - 1);
+
+            while (RuleSet_entrySlots[slot] != NO_RULE) {
+                slot = (slot + 1) & (RuleSet_entryCapacity - 1);
+            }
+
+            RuleSet_entrySlots[slot] = index;
+        }
+    }
+
+    size_t slot = String_hash(entry, strlen(entry)) & (RuleSet_entryCapacity - 1);
+
+    while (RuleSet_entrySlots[slot] != NO_RULE && strcmp(RuleSet_entries[RuleSet_entrySlots[slot]], entry) != 0) {
+        slot = (slot + 1) & (RuleSet_entryCapacity - 1);
+    }
+
+    if (RuleSet_entrySlots[slot] == NO_RULE) {
+        RuleSet_entries = (char**) realloc(RuleSet_entries, (RuleSet_entriesLen + 1) * sizeof(char*));
+        RuleSet_entries[RuleSet_entriesLen] = entry;
+        RuleSet_entrySlots[slot] = RuleSet_entriesLen++;
+    } else {
+        dispose(entry);
+    }
+
+    RuleIndex number = RuleSet_entrySlots[slot];
+
+    pthread_mutex_unlock(&RuleSet_entriesLock);
+    return number;
+}
+
+/**
+ * Read and compile a rule file: names and extensions go into sorted arrays, searched by bsearch()
+ *
+ * @param path  rule file
+ * @return rule set, or NULL with errno set (EINVAL for a malformed file, after saying where)
+ */
+static RuleSet*
+RuleSet_load(const char* path) {
+    FILE* input = fopen(path, "r");
+
+    unless (input) {
+        return NULL;
+    }
+
+    RuleSet*    self        = (RuleSet*) calloc(1, sizeof(RuleSet));
+    char*       line        = NULL;
+    size_t      capacity    = 0;
+    u64         lineNumber  = 0;
+    bool        malformed   = false;
+    ssize_t     length;
+
+    while ((length = getline(&line, &capacity, input)) > 0) {
+        ++lineNumber;
+
+        while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r' || line[length - 1] == ' ' || line[length - 1] == '\t')) {
+            line[--length] = '\0';
+        }
+
+        char* start = line + strspn(line, " \t");
+
+        if (*start == '\0' || *start == '#') {
+            continue;
+        }
+
+        // The keyword ends at the first space or tab
+        size_t      keyword = strcspn(start, " \t");
+        char*       pattern = start[keyword] ? start + keyword : NULL;
+        char***     list;
+        size_t*     listLen;
+
+        if (pattern && keyword == 4 && strncmp(start, "name", 4) == 0) {
+            list    = &self->names;
+            listLen = &self->namesLen;
+        } else if (pattern && keyword == 3 && strncmp(start, "ext", 3) == 0) {
+            list    = &self->extensions;
+            listLen = &self->extensionsLen;
+        } else {
+            Runtime_putError("%s:%llu: expected `name <file name>` or `ext <extension>`\n", path, (unsigned long long) lineNumber);
+            malformed = true;
+            break;
+        }
+
+        pattern += strspn(pattern, " \t");
+
+        *list = (char**) realloc(*list, (*listLen + 1) * sizeof(char*));
+        (*list)[(*listLen)++] = strdup(pattern);
+    }
+
+    dispose(line);
+    fclose(input);
+
+    if (malformed) {
+        RuleSet_free(self);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    qsort(self->names, self->namesLen, sizeof(char*), RuleSet_compare);
+    qsort(self->extensions, self->extensionsLen, sizeof(char*), RuleSet_compare);
+
+    self->nameEntries      = (RuleIndex*) malloc((self->namesLen + 1) * sizeof(RuleIndex));
+    self->extensionEntries = (RuleIndex*) malloc((self->extensionsLen + 1) * sizeof(RuleIndex));
+
+    for (size_t index = 0; index < self->namesLen; ++index) {
+        self->nameEntries[index] = RuleSet_intern("name", self->names[index]);
+    }
+
+    for (size_t index = 0; index < self->extensionsLen; ++index) {
+        self->extensionEntries[index] = RuleSet_intern("ext", self->extensions[index]);
+    }
+
+    return self;
+}
+
+/**
+ * Returns the number of the rule of the set that a file name matches, or NO_RULE
+ */
+static hot RuleIndex
+RuleSet_match(RuleSet* self, char* basename) {
+    char** found;
+
+    if (self->namesLen && (found = (char**) bsearch(&basename, self->names, self->namesLen, sizeof(char*), RuleSet_compare))) {
+        return self->nameEntries[found - self->names];
+    }
+
+    char* extension = strrchr(basename, '.');
+
+    unless (extension && self->extensionsLen) {
+        return NO_RULE;
+    }
+
+    ++extension;
+
+    if ((found = (char**) bsearch(&extension, self->extensions, self->extensionsLen, sizeof(char*), RuleSet_compare))) {
+        return self->extensionEntries[found - self->extensions];
+    }
+
+    return NO_RULE;
+}
+
+/**
+ * Returns the current rules of the file; they stay valid until the calling thread's next RuleSet_quiesce()
+ */
+static hot inline RuleSet*
+RuleSet_current(Configuration* config) {
+    return __atomic_load_n(&config->rules, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Read the rule file again and publish the new rules. The old set is retired rather than freed, as other
+ * threads may be matching against it.
+ *
+ * @param config    configuration
+ * @return errno
+ */
+static int // errno
+RuleSet_reload(Configuration* config) {
+    RuleSet* fresh = RuleSet_load(config->rulesPath);
+
+    unless (fresh) {
+        int error = errno;
+
+        Runtime_putError("Could not reload rules from %s (ERRNO %u), keeping the previous rules\n", config->rulesPath, error);
+        return error;
+    }
+
+    RuleSet* old = __atomic_exchange_n(&config->rules, fresh, __ATOMIC_ACQ_REL);
+
+    pthread_mutex_lock(&RuleSet_retiredLock);
+    old->retiredAt  = __atomic_add_fetch(&RuleSet_epoch, 1, __ATOMIC_SEQ_CST);
+    old->retired    = RuleSet_retired;
+    RuleSet_retired = old;
+    pthread_mutex_unlock(&RuleSet_retiredLock);
+
+    Runtime_putError("Reloaded rules from %s: %zu names, %zu extensions\n", config->rulesPath, fresh->namesLen, fresh->extensionsLen);
+    return ENONE;
+}
+
+/**
+ * Free the replaced sets that no thread can hold any more: those retired in an epoch every reader has seen
+ */
+static void
+RuleSet_collect() {
+    pthread_mutex_lock(&RuleSet_retiredLock);
+
+    u64 oldest = (u64) -1;
+
+    for (RuleSetReader* reader = RuleSet_readers; reader; reader = reader->next) {
+        u64 epoch = __atomic_load_n(&reader->epoch, __ATOMIC_ACQUIRE);
+
+        if (epoch < oldest) {
+            oldest = epoch;
+        }
+    }
+
+    for (RuleSet** link = &RuleSet_retired; *link;) {
+        RuleSet* set = *link;
+
+        if (set->retiredAt <= oldest) {
+            *link = set->retired;
+            RuleSet_free(set);
+        } else {
+            link = &set->retired;
+        }
+    }
+
+    pthread_mutex_unlock(&RuleSet_retiredLock);
+}
+
+/**
+ * Register the calling thread as one that matches against the rules, if they can be reloaded
+ *
+ * @return true if the thread was not registered yet, and has to call RuleSet_offline() when done
+ */
+static bool
+RuleSet_online() {
+    if (RuleSet_reader || !RuleSet_watching) {
+        return false;
+    }
+
+    RuleSetReader* reader = (RuleSetReader*) malloc(sizeof(RuleSetReader));
+
+    pthread_mutex_lock(&RuleSet_retiredLock);
+    reader->epoch   = __atomic_load_n(&RuleSet_epoch, __ATOMIC_ACQUIRE);
+    reader->next    = RuleSet_readers;
+    RuleSet_readers = reader;
+    pthread_mutex_unlock(&RuleSet_retiredLock);
+
+    RuleSet_reader = reader;
+    return true;
+}
+
+/**
+ * Unregister the calling thread, which no longer matches (or only waits), and free what it was holding back
+ */
+static void
+RuleSet_offline() {
+    unless (RuleSet_reader) {
+        return;
+    }
+
+    pthread_mutex_lock(&RuleSet_retiredLock);
+
+    for (RuleSetReader** link = &RuleSet_readers; *link; link = &(*link)->next) {
+        if (*link == RuleSet_reader) {
+            *link = RuleSet_reader->next;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&RuleSet_retiredLock);
+
+    dispose(RuleSet_reader);
+    RuleSet_collect();
+}
+
+/**
+ * Say that the calling thread holds no rule set. Cheap unless a reload happened since the last call, in which
+ * case what no reader can hold any more is freed.
+ */
+static hot inline void
+RuleSet_quiesce() {
+    RuleSetReader* reader = RuleSet_reader;
+
+    unless (reader) {
+        return;
+    }
+
+    u64 epoch = __atomic_load_n(&RuleSet_epoch, __ATOMIC_ACQUIRE);
+
+    unless (reader->epoch == epoch) {
+        __atomic_store_n(&reader->epoch, epoch, __ATOMIC_RELEASE);
+        RuleSet_collect();
+    }
+}
+
+static void*
+RuleSet_reloader(void* context) {
+    Configuration*  config = (Configuration*) context;
+    sigset_t        signals;
+    int             signal;
+
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGHUP);
+
+    for (;;) {
+        if (sigwait(&signals, &signal) == 0 && RuleSet_reload(config) == ENONE) {
+            // Nothing to wait for if no thread is matching
+            RuleSet_collect();
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Reload the rules on SIGHUP. Must be called before any other thread is started, as they inherit the signal mask.
+ *
+ * @param config    configuration
+ * @return errno
+ */
+static int // errno
+RuleSet_watch(Configuration* config) {
+    sigset_t    signals;
+    pthread_t   reloader;
+
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGHUP);
+
+    // SIGHUP is only ever taken by sigwait() in the reloader
+    int result = pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    if (result == ENONE) {
+        result = pthread_create(&reloader, NULL, RuleSet_reloader, config);
+    }
+
+    if (result == ENONE) {
+        pthread_detach(reloader);
+
+        // The calling thread is the one that walks
+        RuleSet_watching = true;
+        RuleSet_online();
+    }
+
+    return result;
+}
+
+/*
+ * SECTION: Rule profile
+ * Per-rule counters, used to find out which rules still pull their weight
+ */
+
+typedef struct RuleProfile {
+    /*
+     * Files matched by, and their size in bytes, indexed by RuleIndex
+     */
+    u64*    hits;
+    u64*    bytes;
+    size_t  count;
+} RuleProfile;
+
+static RuleProfile*
+RuleProfile_new(size_t ruleCount) {
+    RuleProfile* self = (RuleProfile*) malloc(sizeof(RuleProfile));
+
+    self->hits  = (u64*) calloc(ruleCount, sizeof(u64));
+    self->bytes = (u64*) calloc(ruleCount, sizeof(u64));
+    self->count = ruleCount;
+
+    return self;
+}
+
+/**
+ * Make room for counters up to `count` rules, as a reload of the --rules file may add rules after the others
+ */
+static cold void
+RuleProfile_grow(RuleProfile* self, size_t count) {
+    self->hits  = (u64*) realloc(self->hits, count * sizeof(u64));
+    self->bytes = (u64*) realloc(self->bytes, count * sizeof(u64));
+
+    memset(self->hits + self->count, 0, (count - self->count) * sizeof(u64));
+    memset(self->bytes + self->count, 0, (count - self->count) * sizeof(u64));
+    self->count = count;
+}
+
+/**
+ * Account a file against the rule that matched it
+ */
+static hot void
+RuleProfile_hit(RuleProfile* self, RuleIndex rule, u64 bytes) {
+    if ((size_t) rule >= self->count) {
+        RuleProfile_grow(self, rule + 1);
+    }
+
+    ++self->hits[rule];
+    self->bytes[rule] += bytes;
+}
+
+/**
+ * Add the counters of another profile, such as the one of a subtree that went at once
+ */
+static void
+RuleProfile_merge(RuleProfile* self, RuleProfile* other) {
+    if (other->count > self->count) {
+        RuleProfile_grow(self, other->count);
+    }
+
+    for (size_t rule = 0; rule < other->count; ++rule) {
+        self->hits[rule]  += other->hits[rule];
+        self->bytes[rule] += other->bytes[rule];
+    }
+}
+
+static void
+RuleProfile_free(RuleProfile* self) {
+    dispose(self->hits);
+    dispose(self->bytes);
+    dispose(self);
+}
+
+/*
+ * qsort() has no context argument, so the ranking comparator reads the profile from here
+ */
+static RuleProfile* RuleProfile_sorting = NULL;
+
+/**
+ * Most hits first, then most bytes, then definition order
+ */
+static int
+RuleProfile_compareRank(const void* left, const void* right) {
+    RuleIndex   a = *(const RuleIndex*) left;
+    RuleIndex   b = *(const RuleIndex*) right;
+    u64*        h = RuleProfile_sorting->hits;
+    u64*        y = RuleProfile_sorting->bytes;
+
+    if (h[a] != h[b]) {
+        return h[a] < h[b] ? 1 : -1;
+    } else if (y[a] != y[b]) {
+        return y[a] < y[b] ? 1 : -1;
+    } else {
+        return a < b ? -1 : (a > b);
+    }
+}
+
+/**
+ * Print every rule ranked by hits, flagging the ones that never matched
+ *
+ * @param self      profile
+ * @param config    configuration (for rule descriptions)
+ * @param stream    output
+ */
+static cold void
+RuleProfile_print(RuleProfile* self, Configuration* config, FILE* stream) {
+    RuleIndex*  ranking = (RuleIndex*) malloc((self->count + 1) * sizeof(RuleIndex));
+    size_t      dead    = 0;
+
+    for (size_t rule = 0; rule < self->count; ++rule) {
+        ranking[rule] = rule;
+        dead += (self->hits[rule] == 0);
+    }
+
+    RuleProfile_sorting = self;
+    qsort(ranking, self->count, sizeof(RuleIndex), RuleProfile_compareRank);
+    RuleProfile_sorting = NULL;
+
+    fprintf(stream, "Rule profile: %zu rules, %zu never matched\n\n", self->count, dead);
+    fprintf(stream, "%-6s %-24s %12s %16s\n", "rank", "rule", "hits", "bytes");
+
+    for (size_t index = 0; index < self->count; ++index) {
+        RuleIndex rule = ranking[index];
+
+        if (self->hits[rule] == 0) {
+            fprintf(stream, "%-6s", "dead");
+        } else {
+            fprintf(stream, "%-6zu", index + 1);
+        }
+
+        fprintf(stream, " %6s:%-17s %12llu %16llu\n",
+                Configuration_ruleKind(config, rule), Configuration_rulePattern(config, rule),
+                self->hits[rule], self->bytes[rule]);
+    }
+
+    dispose(ranking);
+}
+
+/*
+ * SECTION: Simulation report
+ * Streaming aggregation of what a simulated run would remove
+ */
+
+/**
+ * Upper bound on the number of directories kept in the report.
+ * When it is reached the report is coarsened (see Summary_record), so memory stays bounded
+ * no matter how large the tree is.
+ */
+static const size_t     SummaryNodeLimit = 4096;
+
+/**
+ * What was (or would be) removed from a directory subtree
+ */
+typedef struct {
+    /*
+     * Entries left behind in the directory itself
+     */
+    u64 survivors;
+
+    /*
+     * Files clobbered in the subtree, and their size in bytes
+     */
+    u64 files;
+    u64 bytes;
+
+    /*
+     * Directories collapsed in the subtree
+     */
+    u64 collapses;
+
+    /*
+     * Survivors that were handed to --exec-batch rather than deleted.
+     * A directory whose survivors were all handed off counts as handed off in its parent.
+     */
+    u64 handedOff;
+
+    /*
+     * Entries read in the subtree
+     */
+    u64 entries;
+
+    /*
+     * Per-rule counts of a subtree classified to go at once (with --profile-rules), applied to the rule profile
+     * only once it went; NULL otherwise
+     */
+    struct RuleProfile* hits;
+} Tally;
+
+/**
+ * Add the removal counts of a child subtree to its parent's.
+ * Survivors are not propagated: they only concern the directory that holds them.
+ */
+static hot void
+Tally_add(Tally* self, Tally* child) {
+    self->files     += child->files;
+    self->bytes     += child->bytes;
+    self->collapses += child->collapses;
+    self->entries   += child->entries;
+}
+
+typedef struct {
+    char*   path;   // NULL for an unused slot
+    u32     depth;
+    Tally   tally;
+} SummaryNode;
+
+typedef struct Summary {
+    /*
+     * Open-addressed (linear probing) table keyed by directory path
+     */
+    SummaryNode*    nodes;
+    size_t          capacity;
+    size_t          used;
+
+    /*
+     * Directories deeper than this are not recorded; their counts are already part of their
+     * recorded ancestors' totals
+     */
+    u32             depthLimit;
+
+    /*
+     * Grand total over all roots
+     */
+    Tally           total;
+} Summary;
+
+static Summary*
+Summary_new() {
+    Summary* self = (Summary*) malloc(sizeof(Summary));
+
+    // Keep the load factor at or below 1/2
+    self->capacity   = SummaryNodeLimit * 2;
+    self->nodes      = (SummaryNode*) calloc(self->capacity, sizeof(SummaryNode));
+    self->used       = 0;
+    self->depthLimit = UINT_MAX;
+    memset(&self->total, 0, sizeof(Tally));
+
+    return self;
+}
+
+/**
+ * Number of path components, used to decide which directories to drop when coarsening
+ */
+static pure u32
+Summary_depth(const char* path) {
+    u32 depth = 0;
+
+    for (; *path; ++path) {
+        if (*path == '/' && *(path + 1) != '/' && *(path + 1) != '\0') {
+            ++depth;
+        }
+    }
+
+    return depth;
+}
+
+static hot SummaryNode*
+Summary_slot(Summary* self, const char* path) {
+    size_t index = String_hash(path, strlen(path)) & (self->capacity - 1);
+
+    while (self->nodes[index].path && strcmp(self->nodes[index].path, path) != 0) {
+        index = (index + 1) & (self->capacity - 1);
+    }
+
+    return self->nodes + index;
+}
+
+/**
+ * Rehash the nodes into a table of `capacity` slots
+ */
+static cold void
+Summary_rehash(Summary* self, size_t capacity) {
+    SummaryNode*    old         = self->nodes;
+    size_t          oldCapacity = self->capacity;
+
+    self->nodes    = (SummaryNode*) calloc(capacity, sizeof(SummaryNode));
+    self->capacity = capacity;
+
+    for (size_t index = 0; index < oldCapacity; ++index) {
+        if (old[index].path) {
+            *Summary_slot(self, old[index].path) = old[index];
+        }
+    }
+
+    dispose(old);
+}
+
+/**
+ * Drop every node at the deepest recorded level and stop recording that level.
+ * Nothing is lost, as subtree totals are inclusive and the dropped directories' parents are recorded
+ * after them (post-order).
+ *
+ * @return true if any node was dropped
+ */
+static cold bool
+Summary_coarsen(Summary* self) {
+    u32 deepest = 0;
+
+    for (size_t index = 0; index < self->capacity; ++index) {
+        if (self->nodes[index].path && self->nodes[index].depth > deepest) {
+            deepest = self->nodes[index].depth;
+        }
+    }
+
+    // Only the roots are left, and they have nowhere coarser to go
+    if (deepest == 0) {
+        return false;
+    }
+
+    SummaryNode* old        = self->nodes;
+    size_t       used       = self->used;
+    self->nodes             = (SummaryNode*) calloc(self->capacity, sizeof(SummaryNode));
+    self->used              = 0;
+    self->depthLimit        = deepest - 1;
+
+    for (size_t index = 0; index < self->capacity; ++index) {
+        if (old[index].path) {
+            if (old[index].depth <= self->depthLimit) {
+                *Summary_slot(self, old[index].path) = old[index];
+                ++self->used;
+            } else {
+                dispose(old[index].path);
+            }
+        }
+    }
+
+    dispose(old);
+    return self->used < used;
+}
+
+/**
+ * Record the inclusive totals of a directory subtree.
+ * Directories that did not lose anything are not recorded.
+ *
+ * @param self  summary
+ * @param path  directory path
+ * @param tally subtree totals
+ */
+static void
+Summary_record(Summary* self, char* path, Tally* tally) {
+    if (tally->files == 0 && tally->collapses == 0) {
+        return;
+    }
+
+    u32 depth = Summary_depth(path);
+
+    if (depth > self->depthLimit) {
+        return;
+    }
+
+    SummaryNode* node = Summary_slot(self, path);
+
+    if (node->path) {
+        // Already recorded, e.g. a root being collapsed after its subtree was recorded
+        Tally_add(&node->tally, tally);
+        return;
+    }
+
+    if (self->used >= SummaryNodeLimit) {
+        if (Summary_coarsen(self)) {
+            Summary_record(self, path, tally);
+            return;
+        }
+
+        // Nothing left to drop: go over the limit rather than lose the directory, keeping the load factor at 1/2
+        if ((self->used + 1) * 2 > self->capacity) {
+            Summary_rehash(self, self->capacity * 2);
+        }
+
+        node = Summary_slot(self, path);
+    }
+
+    node->path  = strdup(path);
+    node->depth = depth;
+    node->tally = *tally;
+    ++self->used;
+}
+
+/**
+ * Path ordering in which a directory sorts immediately before its descendants
+ */
+static int
+Summary_comparePaths(const void* left, const void* right) {
+    const unsigned char* a = (const unsigned char*) ((const SummaryNode*) left)->path;
+    const unsigned char* b = (const unsigned char*) ((const SummaryNode*) right)->path;
+
+    while (*a && *a == *b) {
+        ++a;
+        ++b;
+    }
+
+    int ca = (*a == '/') ? 1 : (*a == '\0' ? 0 : *a + 1);
+    int cb = (*b == '/') ? 1 : (*b == '\0' ? 0 : *b + 1);
+
+    return ca - cb;
+}
+
+/**
+ * Returns true if `ancestor` is a path prefix of `path` on a component boundary
+ */
+static pure bool
+Summary_isAncestor(const char* ancestor, const char* path) {
+    size_t length = strlen(ancestor);
+
+    return strncmp(ancestor, path, length) == 0
+        && (path[length] == '/' || (length > 0 && ancestor[length - 1] == '/'));
+}
+
+static void
+Summary_putJsonString(FILE* stream, const char* string) {
+    fputc('"', stream);
+
+    for (const unsigned char* c = (const unsigned char*) string; *c; ++c) {
+        switch (*c) {
+            case '"':  fputs("\\\"", stream); break;
+            case '\\': fputs("\\\\", stream); break;
+            case '\n': fputs("\\n", stream);  break;
+            case '\t': fputs("\\t", stream);  break;
+            default:
+                if (*c < 0x20) {
+                    fprintf(stream, "\\u%04x", *c);
+                } else {
+                    fputc(*c, stream);
+                }
+        }
+    }
+
+    fputc('"', stream);
+}
+
+/**
+ * Collect the recorded nodes into a sorted array
+ *
+ * @return number of nodes
+ */
+static size_t
+Summary_sorted(Summary* self, SummaryNode** sorted) {
+    size_t count = 0;
+    *sorted      = (SummaryNode*) malloc((self->used + 1) * sizeof(SummaryNode));
+
+    for (size_t index = 0; index < self->capacity; ++index) {
+        if (self->nodes[index].path) {
+            (*sorted)[count++] = self->nodes[index];
+        }
+    }
+
+    qsort(*sorted, count, sizeof(SummaryNode), Summary_comparePaths);
+
+    return count;
+}
+
+static cold void
+Summary_printTree(Summary* self, Configuration* config, FILE* stream) {
+    SummaryNode*    sorted;
+    size_t          count  = Summary_sorted(self, &sorted);
+    const char**    stack  = (const char**) malloc((count + 1) * sizeof(char*));
+    size_t          height = 0;
+
+    fprintf(stream, "Would remove %llu files (%llu bytes) and collapse %llu directories\n\n",
+            self->total.files, self->total.bytes, self->total.collapses);
+
+    for (size_t index = 0; index < count; ++index) {
+        SummaryNode* node = sorted + index;
+
+        while (height > 0 && !Summary_isAncestor(stack[height - 1], node->path)) {
+            --height;
+        }
+
+        const char* name = node->path;
+
+        if (height > 0) {
+            name += strlen(stack[height - 1]);
+            while (*name == '/') {
+                ++name;
+            }
+        }
+
+        fprintf(stream, "%*s%s/  files=%llu bytes=%llu collapses=%llu\n",
+                (int) (height * 2), "", name, node->tally.files, node->tally.bytes, node->tally.collapses);
+
+        stack[height++] = node->path;
+    }
+
+    if (self->depthLimit != UINT_MAX) {
+        fprintf(stream, "(tree truncated below depth %u)\n", self->depthLimit);
+    }
+
+    RuleProfile* profile = config->ruleProfile;
+
+    fprintf(stream, "\n%-24s %12s %16s\n", "rule", "files", "bytes");
+
+    for (size_t rule = 0; rule < profile->count; ++rule) {
+        if (profile->hits[rule] == 0) {
+            continue;
+        }
+
+        fprintf(stream, "%6s:%-17s %12llu %16llu\n",
+                Configuration_ruleKind(config, rule), Configuration_rulePattern(config, rule),
+                profile->hits[rule], profile->bytes[rule]);
+    }
+
+    dispose(stack);
+    dispose(sorted);
+}
+
+static cold void
+Summary_printJson(Summary* self, Configuration* config, FILE* stream) {
+    SummaryNode*    sorted;
+    size_t          count = Summary_sorted(self, &sorted);
+
+    fprintf(stream, "{\"total\":{\"files\":%llu,\"bytes\":%llu,\"collapses\":%llu},",
+            self->total.files, self->total.bytes, self->total.collapses);
+
+    if (self->depthLimit == UINT_MAX) {
+        fputs("\"depthLimit\":null,\"directories\":[", stream);
+    } else {
+        fprintf(stream, "\"depthLimit\":%u,\"directories\":[", self->depthLimit);
+    }
+
+    for (size_t index = 0; index < count; ++index) {
+        SummaryNode* node = sorted + index;
+
+        fputs(index ? ",{\"path\":" : "{\"path\":", stream);
+        Summary_putJsonString(stream, node->path);
+        fprintf(stream, ",\"files\":%llu,\"bytes\":%llu,\"collapses\":%llu}",
+                node->tally.files, node->tally.bytes, node->tally.collapses);
+    }
+
+    fputs("],\"rules\":[", stream);
+
+    RuleProfile*    profile = config->ruleProfile;
+    bool            first   = true;
+
+    for (size_t rule = 0; rule < profile->count; ++rule) {
+        if (profile->hits[rule] == 0) {
+            continue;
+        }
+
+        fputs(first ? "{" : ",{", stream);
+        first = false;
+
+        fprintf(stream, "\"kind\":\"%s\",\"pattern\":", Configuration_ruleKind(config, rule));
+        Summary_putJsonString(stream, Configuration_rulePattern(config, rule));
+
+        fprintf(stream, ",\"files\":%llu,\"bytes\":%llu}", profile->hits[rule], profile->bytes[rule]);
+    }
+
+    fputs("]}\n", stream);
+
+    dispose(sorted);
+}
+
+/*
+ * SECTION: Directory cache
+ * Open directories by path, kept in a bounded LRU. A directory is opened relative to its (cached) parent, and a
+ * cached descriptor is only used after checking that the path still names the same (device, inode).
+ */
+
+/**
+ * Most directories kept open, and the share of the descriptor limit they may take
+ */
+static const size_t     DirCacheLimit           = 256;
+static const size_t     DirCacheLimitDivisor    = 4;
+
+typedef struct {
+    char*   path;
+    u64     hash;
+    int     fd;
+    dev_t   device;
+    ino_t   inode;
+    u64     lastUse;
+    bool    followed;   // opened through a symlink, so checked against what it points to
+} DirCacheEntry;
+
+typedef struct DirCache {
+    DirCacheEntry*  entries;
+    size_t          entriesLen;
+    size_t          capacity;
+    u64             clock;
+    u64             hits;
+    u64             opens;
+} DirCache;
+
+static DirCache*
+DirCache_new() {
+    DirCache*       self    = (DirCache*) calloc(1, sizeof(DirCache));
+    struct rlimit   limit;
+
+    self->capacity = DirCacheLimit;
+
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY && limit.rlim_cur / DirCacheLimitDivisor < self->capacity) {
+        self->capacity = limit.rlim_cur / DirCacheLimitDivisor;
+    }
+
+    self->capacity = self->capacity ? self->capacity : 1;
+    self->entries  = (DirCacheEntry*) calloc(self->capacity, sizeof(DirCacheEntry));
+
+    return self;
+}
+
+static void
+DirCache_evict(DirCache* self, size_t index) {
+    close(self->entries[index].fd);
+    dispose(self->entries[index].path);
+
+    self->entries[index] = self->entries[--self->entriesLen];
+}
+
+static DirCacheEntry*
+DirCache_find(DirCache* self, const char* path, u64 hash) {
+    for (size_t index = 0; index < self->entriesLen; ++index) {
+        if (self->entries[index].hash == hash && strcmp(self->entries[index].path, path) == 0) {
+            return self->entries + index;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Returns an open descriptor for a directory. It belongs to the cache: do not close it, and do not use it after
+ * the next call, which may evict it.
+ *
+ * @param self  cache
+ * @param path  directory
+ * @return descriptor, or -1 with errno set
+ */
+static int
+DirCache_open(DirCache* self, const char* path) {
+    size_t length = strlen(path);
+
+    // `dir/` is `dir`: the last component is what is opened relative to the parent
+    if (length > 1 && path[length - 1] == '/') {
+        char* trimmed = strdup(path);
+
+        while (length > 1 && trimmed[length - 1] == '/') {
+            trimmed[--length] = '\0';
+        }
+
+        int fd = DirCache_open(self, trimmed);
+        int error = errno;
+
+        dispose(trimmed);
+        errno = error;
+        return fd;
+    }
+
+    u64             hash    = String_hash(path, strlen(path));
+    DirCacheEntry*  cached  = DirCache_find(self, path, hash);
+    const char*     slash   = strrchr(path, '/');
+    int             parentFd;
+    const char*     name;
+
+    // Directly below the current directory, below `/`, or below another directory (which is looked up first)
+    if (slash == NULL) {
+        parentFd = AT_FDCWD;
+        name     = path;
+    } else if (slash == path) {
+        parentFd = (path[1] == '\0') ? AT_FDCWD : DirCache_open(self, "/");
+        name     = (path[1] == '\0') ? "/" : path + 1;
+    } else {
+        char* parent = strndup(path, slash - path);
+
+        parentFd = DirCache_open(self, parent);
+        name     = slash + 1;
+        dispose(parent);
+    }
+
+    if (parentFd == -1) {
+        parentFd = AT_FDCWD;
+        name     = path;
+    }
+
+    // The parent may have evicted it, so look again
+    cached = DirCache_find(self, path, hash);
+
+    if (cached) {
+        struct stat statBuffer;
+
+        if (fstatat(parentFd, name, &statBuffer, cached->followed ? 0 : AT_SYMLINK_NOFOLLOW) == 0
+            && statBuffer.st_dev == cached->device && statBuffer.st_ino == cached->inode) {
+            cached->lastUse = ++self->clock;
+            ++self->hits;
+            return cached->fd;
+        }
+
+        // Gone, or replaced by something else since
+        DirCache_evict(self, cached - self->entries);
+    }
+
+    int     fd          = openat(parentFd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    bool    followed    = false;
+
+    /*
+     * A symlink to a directory, or a parent that could not be opened: the whole path, as before the cache.
+     * It is cached all the same, and later checked by following the path as this open did.
+     */
+    if (fd == -1) {
+        fd       = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        followed = true;
+    }
+
+    if (fd == -1) {
+        return -1;
+    }
+
+    struct stat statBuffer;
+
+    if (fstat(fd, &statBuffer) != 0) {
+        int error = errno;
+
+        close(fd);
+        errno = error;
+        return -1;
+    }
+
+    ++self->opens;
+
+    if (self->entriesLen == self->capacity) {
+        size_t oldest = 0;
+
+        for (size_t index = 1; index < self->entriesLen; ++index) {
+            if (self->entries[index].lastUse < self->entries[oldest].lastUse) {
+                oldest = index;
+            }
+        }
+
+        // Never the parent just used to open this one, as the caller may still be holding it
+        if (self->entries[oldest].fd == parentFd && self->entriesLen > 1) {
+            oldest = (oldest + 1) % self->entriesLen;
+        }
+
+        DirCache_evict(self, oldest);
+    }
+
+    self->entries[self->entriesLen++] = (DirCacheEntry) {
+        .path     = strdup(path),
+        .hash     = hash,
+        .fd       = fd,
+        .device   = statBuffer.st_dev,
+        .inode    = statBuffer.st_ino,
+        .lastUse  = ++self->clock,
+        .followed = followed
+    };
+
+    return fd;
+}
+
+/**
+ * Close everything
+ */
+static void
+DirCache_free(DirCache* self) {
+    while (self->entriesLen > 0) {
+        DirCache_evict(self, 0);
+    }
+
+    dispose(self->entries);
+    dispose(self);
+}
+
+/*
+ * SECTION: Durability
+ * Flush exactly what the run changed, rather than the whole system
+ */
+
+/**
+ * Above this many modified directories on one filesystem, a single syncfs() is cheaper than one fsync() each
+ */
+static const size_t     DurableFsyncLimit = 16;
+
+typedef struct {
+    char*   path;   // NULL for an unused slot
+    dev_t   device;
+    bool    walked; // built by the walk, rather than given on the commandline or derived from it
+} DurableDirectory;
+
+typedef struct Durability {
+    /*
+     * Set of modified directories, open-addressed and keyed by path
+     */
+    DurableDirectory*   directories;
+    size_t              capacity;
+    size_t              used;
+} Durability;
+
+static Durability*
+Durability_new() {
+    Durability* self = (Durability*) malloc(sizeof(Durability));
+
+    self->capacity    = 64;
+    self->directories = (DurableDirectory*) calloc(self->capacity, sizeof(DurableDirectory));
+    self->used        = 0;
+
+    return self;
+}
+
+static DurableDirectory*
+Durability_slot(DurableDirectory* directories, size_t capacity, const char* path) {
+    size_t index = String_hash(path, strlen(path)) & (capacity - 1);
+
+    while (directories[index].path && strcmp(directories[index].path, path) != 0) {
+        index = (index + 1) & (capacity - 1);
+    }
+
+    return directories + index;
+}
+
+/**
+ * Remember that an entry was removed from a directory
+ *
+ * @param self      durability tracker
+ * @param path      directory path
+ * @param device    st_dev of the directory
+ * @param walked    whether the walk built the path (so that it can be opened through the directory cache)
+ */
+static void
+Durability_touch(Durability* self, const char* path, dev_t device, bool walked) {
+    DurableDirectory* slot = Durability_slot(self->directories, self->capacity, path);
+
+    if (slot->path) {
+        return;
+    }
+
+    if ((self->used + 1) * 2 > self->capacity) {
+        size_t              capacity    = self->capacity * 2;
+        DurableDirectory*   directories = (DurableDirectory*) calloc(capacity, sizeof(DurableDirectory));
+
+        for (size_t index = 0; index < self->capacity; ++index) {
+            if (self->directories[index].path) {
+                *Durability_slot(directories, capacity, self->directories[index].path) = self->directories[index];
+            }
+        }
+
+        dispose(self->directories);
+        self->directories = directories;
+        self->capacity    = capacity;
+        slot              = Durability_slot(self->directories, self->capacity, path);
+    }
+
+    slot->path   = strdup(path);
+    slot->device = device;
+    slot->walked = walked;
+    ++self->used;
+}
+
+/**
+ * Remember that an entry was removed from the directory holding `path`
+ *
+ * @param self  durability tracker
+ * @param path  path of the removed entry
+ */
+static void
+Durability_touchParentOf(Durability* self, const char* path) {
+    char*       pathCopy = strdup(path);
+    char*       parent   = dirname(pathCopy);
+    struct stat statBuffer;
+
+    if (stat(parent, &statBuffer) == 0) {
+        Durability_touch(self, parent, statBuffer.st_dev, false);
+    }
+
+    dispose(pathCopy);
+}
+
+/**
+ * Flush every modified directory to disk, choosing per filesystem between one fsync() per directory and
+ * a single syncfs()
+ *
+ * @param self      durability tracker
+ * @param config    configuration
+ * @return errno of the first failure, or ENONE
+ */
+static int // errno
+Durability_flush(Durability* self, Configuration* config) {
+    int     result  = ENONE;
+    bool*   flushed = (bool*) calloc(self->capacity, sizeof(bool));
+
+    for (size_t index = 0; index < self->capacity; ++index) {
+        DurableDirectory* first = self->directories + index;
+
+        if (first->path == NULL || flushed[index]) {
+            continue;
+        }
+
+        size_t onDevice = 0;
+
+        for (size_t other = index; other < self->capacity; ++other) {
+            onDevice += (self->directories[other].path && self->directories[other].device == first->device);
+        }
+
+        bool wholeFilesystem = onDevice > DurableFsyncLimit;
+
+        if (wholeFilesystem) {
+            Runtime_verbose(config, "syncfs() on the filesystem holding %s (%zu directories modified)\n",
+                            first->path, onDevice);
+        }
+
+        bool synced = false;
+
+        for (size_t other = index; other < self->capacity; ++other) {
+            DurableDirectory* directory = self->directories + other;
+
+            if (directory->path == NULL || directory->device != first->device) {
+                continue;
+            }
+
+            flushed[other] = true;
+
+            if (synced) {
+                continue;
+            }
+
+            bool    cached  = config->dirCache && directory->walked;
+            int     fd      = cached ? DirCache_open(config->dirCache, directory->path)
+                                     : open(directory->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+            if (fd == -1) {
+                // Collapsed later on; its parent was modified by that and is in the set too
+                unless (errno == ENOENT) {
+                    Runtime_putError("Could not open %s to flush it: ERRNO %u\n", directory->path, errno);
+                    result = result ? result : errno;
+                }
+                continue;
+            }
+
+            if ((wholeFilesystem ? syncfs(fd) : fsync(fd)) == -1) {
+                Runtime_putError("Could not flush %s: ERRNO %u\n", directory->path, errno);
+                result = result ? result : errno;
+            }
+
+            synced = wholeFilesystem;
+
+            unless (cached) {
+                close(fd);
+            }
+        }
+    }
+
+    dispose(flushed);
+    return result;
+}
+
+/*
+ * SECTION: Allocation
+ * Per-thread slabs for directory frames and a bump allocator for paths, so that walking a tree does not
+ * go through malloc() for every directory and entry
+ */
+
+/**
+ * Size of the getdents64() batch held by each frame, same as what glibc uses for a DIR stream
+ */
+#define FRAME_BUFFER_SIZE   32768
+
+/**
+ * Frames are carved out of slabs of this many
+ */
+#define FRAMES_PER_SLAB     8
+
+/**
+ * Default size of a bump allocator chunk
+ */
+#define ARENA_CHUNK_SIZE    65536
+
+/**
+ * An open directory and its current batch of entries
+ */
+typedef struct Frame {
+    struct Frame*   next;       // free list link
+    int             fd;
+    size_t          length;
+    size_t          position;
+    char            buffer[FRAME_BUFFER_SIZE] __attribute__((aligned(8)));
+} Frame;
+
+typedef struct ArenaChunk {
+    struct ArenaChunk*  previous;
+    size_t              size;
+    size_t              used;
+    char                data[] __attribute__((aligned(8)));
+} ArenaChunk;
+
+/**
+ * Position of the bump allocator, to return to once a subtree is done
+ */
+typedef struct {
+    ArenaChunk* chunk;
+    size_t      used;
+} ArenaMark;
+
+typedef struct {
+    u64 directories;    // directories read
+    u64 entries;        // entries seen
+    u64 frameSlabs;     // slabs allocated
+    u64 frameReuses;    // frames handed out again after their subtree completed
+    u64 bumpChunks;     // bump allocator chunks allocated
+    u64 bumpPeak;       // most bump allocator bytes live at once (per thread)
+} Stats;
+
+typedef struct {
+    Frame*      freeFrames;
+    void**      slabs;
+    size_t      slabCount;
+
+    ArenaChunk* chunk;
+    ArenaChunk* spare;      // most recently released chunk, kept to avoid thrashing at a chunk boundary
+    u64         live;
+
+    Stats       stats;
+} Arena;
+
+static __thread Arena*  Arena_local = NULL;
+
+/*
+ * Counters of threads whose arena has been retired
+ */
+static pthread_mutex_t  Stats_lock  = PTHREAD_MUTEX_INITIALIZER;
+static Stats            Stats_total = { 0 };
+
+/**
+ * Returns the calling thread's arena, creating it on first use
+ */
+static hot Arena*
+Arena_get() {
+    unless (Arena_local) {
+        Arena_local = (Arena*) calloc(1, sizeof(Arena));
+    }
+
+    return Arena_local;
+}
+
+/**
+ * Free the calling thread's arena, adding its counters to the process totals.
+ * Nothing allocated from it may be in use.
+ */
+static void
+Arena_retire() {
+    Arena* self = Arena_local;
+
+    unless (self) {
+        return;
+    }
+
+    pthread_mutex_lock(&Stats_lock);
+    Stats_total.directories += self->stats.directories;
+    Stats_total.entries     += self->stats.entries;
+    Stats_total.frameSlabs  += self->stats.frameSlabs;
+    Stats_total.frameReuses += self->stats.frameReuses;
+    Stats_total.bumpChunks  += self->stats.bumpChunks;
+    if (self->stats.bumpPeak > Stats_total.bumpPeak) {
+        Stats_total.bumpPeak = self->stats.bumpPeak;
+    }
+    pthread_mutex_unlock(&Stats_lock);
+
+    for (size_t index = 0; index < self->slabCount; ++index) {
+        dispose(self->slabs[index]);
+    }
+
+    while (self->chunk) {
+        ArenaChunk* previous = self->chunk->previous;
+        dispose(self->chunk);
+        self->chunk = previous;
+    }
+
+    dispose(self->spare);
+    dispose(self->slabs);
+    dispose(Arena_local);
+}
+
+static ArenaMark
+Arena_mark(Arena* self) {
+    return (ArenaMark) { self->chunk, self->chunk ? self->chunk->used : 0 };
+}
+
+/**
+ * Free everything allocated since `mark`
+ */
+static hot void
+Arena_release(Arena* self, ArenaMark mark) {
+    while (self->chunk != mark.chunk) {
+        ArenaChunk* chunk = self->chunk;
+
+        self->chunk  = chunk->previous;
+        self->live  -= chunk->used;
+
+        if (chunk->size == ARENA_CHUNK_SIZE && !self->spare) {
+            self->spare = chunk;
+        } else {
+            dispose(chunk);
+        }
+    }
+
+    if (self->chunk) {
+        self->live        -= self->chunk->used - mark.used;
+        self->chunk->used  = mark.used;
+    }
+}
+
+static hot void*
+Arena_alloc(Arena* self, size_t size) {
+    size = (size + 7) & ~(size_t) 7;
+
+    if (!self->chunk || self->chunk->size - self->chunk->used < size) {
+        ArenaChunk* chunk;
+
+        if (self->spare && size <= ARENA_CHUNK_SIZE) {
+            chunk       = self->spare;
+            self->spare = NULL;
+        } else {
+            size_t chunkSize = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+
+            chunk       = (ArenaChunk*) malloc(sizeof(ArenaChunk) + chunkSize);
+            chunk->size = chunkSize;
+            ++self->stats.bumpChunks;
+        }
+
+        chunk->used     = 0;
+        chunk->previous = self->chunk;
+        self->chunk     = chunk;
+    }
+
+    void* result = self->chunk->data + self->chunk->used;
+
+    self->chunk->used += size;
+    self->live        += size;
+
+    if (self->live > self->stats.bumpPeak) {
+        self->stats.bumpPeak = self->live;
+    }
+
+    return result;
+}
+
+/**
+ * Returns `directory/name`, allocated from the arena
+ */
+static hot char*
+Arena_path(Arena* self, const char* directory, const char* name) {
+    size_t  directoryLength = strlen(directory);
+    size_t  nameLength      = strlen(name);
+    char*   path            = (char*) Arena_alloc(self, directoryLength + nameLength + 2);
+
+    memcpy(path, directory, directoryLength);
+    path[directoryLength] = '/';
+    memcpy(path + directoryLength + 1, name, nameLength + 1);
+
+    return path;
+}
+
+/**
+ * Open a directory for reading
+ *
+ * @param self  arena of the calling thread
+ * @param path  directory path
+ * @return frame, or NULL with errno set
+ */
+static hot Frame*
+Frame_open(Arena* self, const char* path) {
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    if (fd == -1) {
+        return NULL;
+    }
+
+    unless (self->freeFrames) {
+        Frame* slab = (Frame*) malloc(FRAMES_PER_SLAB * sizeof(Frame));
+
+        self->slabs = (void**) realloc(self->slabs, (self->slabCount + 1) * sizeof(void*));
+        self->slabs[self->slabCount++] = slab;
+        ++self->stats.frameSlabs;
+
+        for (size_t index = 0; index < FRAMES_PER_SLAB; ++index) {
+            slab[index].next = self->freeFrames;
+            slab[index].fd   = -1;
+            self->freeFrames = slab + index;
+        }
+    }
+
+    Frame* frame = self->freeFrames;
+
+    // Frames that were closed before keep their (stale) descriptor number
+    if (frame->fd != -1) {
+        ++self->stats.frameReuses;
+    }
+
+    self->freeFrames = frame->next;
+    frame->fd        = fd;
+    frame->length    = 0;
+    frame->position  = 0;
+
+    ++self->stats.directories;
+
+    return frame;
+}
+
+/**
+ * Returns the next entry of a directory (including `.` and `..`), or NULL at the end.
+ * errno is left at zero at the end of the directory, and set if reading failed.
+ */
+static hot DirEntry*
+Frame_read(Arena* self, Frame* frame) {
+    if (frame->position >= frame->length) {
+        ssize_t length = getdents64(frame->fd, frame->buffer, FRAME_BUFFER_SIZE);
+
+        if (length <= 0) {
+            errno = (length == 0) ? 0 : errno;
+            return NULL;
+        }
+
+        frame->length   = length;
+        frame->position = 0;
+    }
+
+    DirEntry* entry = (DirEntry*) (frame->buffer + frame->position);
+
+    frame->position += entry->d_reclen;
+    ++self->stats.entries;
+
+    return entry;
+}
+
+/**
+ * Close a directory, returning its frame to the arena
+ */
+static hot void
+Frame_close(Arena* self, Frame* frame) {
+    close(frame->fd);
+
+    frame->next      = self->freeFrames;
+    self->freeFrames = frame;
+}
+
+static cold void
+Stats_print(FILE* stream) {
+    fprintf(stream,
+        "directories read       %llu\n"
+        "entries seen           %llu\n"
+        "frame slabs            %llu (%llu frames, %zu bytes each)\n"
+        "frames reused          %llu\n"
+        "bump chunks            %llu\n"
+        "bump peak bytes        %llu\n",
+        Stats_total.directories, Stats_total.entries,
+        Stats_total.frameSlabs, Stats_total.frameSlabs * FRAMES_PER_SLAB, sizeof(Frame),
+        Stats_total.frameReuses, Stats_total.bumpChunks, Stats_total.bumpPeak);
+}
+
+/*
+ * SECTION: External commands
+ * Hand matched files to another program in batches, as `find -exec command {} +` does
+ */
+
+/**
+ * Commands running at once when --jobs is not given
+ */
+static const u32        ExecBatchDefaultJobs = 4;
+
+/**
+ * Bytes of argument space left unused, for whatever the command adds to its own environment
+ */
+static const size_t     ExecBatchHeadroom    = 4096;
+
+typedef struct ExecBatch {
+    /*
+     * Command and arguments up to `{}`, followed by room for the paths and a NULL terminator
+     */
+    char**  argv;
+    size_t  prefixLen;
+
+    /*
+     * Paths accumulated for the next command
+     */
+    size_t  pathsLen;
+    size_t  pathsCapacity;
+    size_t  bytes;
+    size_t  limit;
+
+    /*
+     * Commands still running
+     */
+    pid_t*  children;
+    u32     childrenLen;
+    u32     jobs;
+
+    u64     commands;
+    u64     failures;
+} ExecBatch;
+
+/**
+ * Pull `--exec-batch command [argument...] {} +` out of the commandline, as it cannot be expressed to getopt
+ *
+ * @param argc  argument count, updated
+ * @param argv  arguments, compacted in place
+ * @param error set to true if the option is malformed
+ * @return the batch, or NULL if the option is absent or malformed
+ */
+static ExecBatch*
+ExecBatch_extract(int* argc, char** argv, bool* error) {
+    int start = 1;
+
+    *error = false;
+
+    while (start < *argc && strcmp(argv[start], "--exec-batch") != 0) {
+        // Everything after `--` is a root, even if it reads `--exec-batch`
+        if (strcmp(argv[start], "--") == 0) {
+            return NULL;
+        }
+
+        ++start;
+    }
+
+    if (start == *argc) {
+        return NULL;
+    }
+
+    int end = start + 1;
+
+    while (end < *argc && strcmp(argv[end], "+") != 0) {
+        ++end;
+    }
+
+    // Needs a command, and `{}` right before `+`
+    if (end == *argc || end - start < 3 || strcmp(argv[end - 1], "{}") != 0) {
+        Runtime_putError("--exec-batch must be followed by a command and end with `{} +`\n");
+        *error = true;
+        return NULL;
+    }
+
+    ExecBatch*  self     = (ExecBatch*) calloc(1, sizeof(ExecBatch));
+    size_t      envBytes = 0;
+
+    self->prefixLen     = end - 1 - (start + 1);
+    self->pathsCapacity = 64;
+    self->argv          = (char**) malloc((self->prefixLen + self->pathsCapacity + 1) * sizeof(char*));
+    memcpy(self->argv, argv + start + 1, self->prefixLen * sizeof(char*));
+
+    for (char** variable = environ; *variable; ++variable) {
+        envBytes += strlen(*variable) + 1 + sizeof(char*);
+    }
+
+    for (size_t index = 0; index < self->prefixLen; ++index) {
+        envBytes += strlen(self->argv[index]) + 1 + sizeof(char*);
+    }
+
+    long argMax = sysconf(_SC_ARG_MAX);
+
+    if (argMax <= 0) {
+        argMax = _POSIX_ARG_MAX;
+    }
+
+    self->limit = (size_t) argMax > envBytes + ExecBatchHeadroom * 2
+                ? (size_t) argMax - envBytes - ExecBatchHeadroom
+                : ExecBatchHeadroom;
+
+    // Drop the option and the command from argv
+    memmove(argv + start, argv + end + 1, (*argc - end) * sizeof(char*));
+    *argc -= end + 1 - start;
+
+    return self;
+}
+
+/**
+ * Wait for one command to finish, recording a failure if it did not exit with 0
+ *
+ * Only the commands of the batch are collected, so any other child of the process keeps its exit status for its owner.
+ */
+static void
+ExecBatch_reap(ExecBatch* self, Configuration* config) {
+    int     status;
+    pid_t   pid   = 0;
+    u32     found = 0;
+
+    // A command that finished already, or that is gone
+    while (found < self->childrenLen && (pid = waitpid(self->children[found], &status, WNOHANG)) == 0) {
+        ++found;
+    }
+
+    if (found == self->childrenLen) {
+        siginfo_t   info;
+        int         waitState;
+
+        // Sleep until any child exits, leaving it uncollected: if it is not a command, wait for the oldest command instead
+        memset(&info, 0, sizeof(info));
+        found = 0;
+
+        do {
+            waitState = waitid(P_ALL, 0, &info, WEXITED | WNOWAIT);
+        } while (waitState == -1 && errno == EINTR);
+
+        for (u32 index = 0; waitState == 0 && index < self->childrenLen; ++index) {
+            if (self->children[index] == info.si_pid) {
+                found = index;
+                break;
+            }
+        }
+
+        do {
+            pid = waitpid(self->children[found], &status, 0);
+        } while (pid == -1 && errno == EINTR);
+    }
+
+    self->children[found] = self->children[--self->childrenLen];
+
+    if (pid == -1) {
+        // Collected elsewhere, so its status is unknown
+        return;
+    }
+
+    unless (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+        Runtime_putError("%s (batch %d) failed with status %d\n", self->argv[0], pid,
+                         WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status));
+        ++self->failures;
+    } else {
+        Runtime_verbose(config, "%s (batch %d) finished\n", self->argv[0], pid);
+    }
+}
+
+/**
+ * Start the command on the paths accumulated so far, first waiting for a slot if all are busy
+ */
+static void
+ExecBatch_flush(ExecBatch* self, Configuration* config) {
+    if (self->pathsLen == 0) {
+        return;
+    }
+
+    char** paths = self->argv + self->prefixLen;
+
+    paths[self->pathsLen] = NULL;
+
+    if (config->simulate) {
+        if (config->simulateFormat == SIMULATE_LINES) {
+            for (size_t index = 0; index < self->prefixLen + self->pathsLen; ++index) {
+                Runtime_putError(index ? " %s" : "exec(%s", self->argv[index]);
+            }
+            Runtime_putError(")\n");
+        }
+    } else {
+        while (self->childrenLen >= self->jobs) {
+            ExecBatch_reap(self, config);
+        }
+
+        pid_t               pid;
+        posix_spawnattr_t   attributes;
+        sigset_t            noSignals;
+
+        // Commands should not inherit the signals blocked for --rules
+        sigemptyset(&noSignals);
+        posix_spawnattr_init(&attributes);
+        posix_spawnattr_setsigmask(&attributes, &noSignals);
+        posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETSIGMASK);
+
+        int     spawnState = posix_spawnp(&pid, self->argv[0], NULL, &attributes, self->argv, environ);
+
+        posix_spawnattr_destroy(&attributes);
+
+        if (spawnState == 0) {
+            self->children[self->childrenLen++] = pid;
+            Runtime_verbose(config, "%s (batch %d) started on %zu files\n", self->argv[0], pid, self->pathsLen);
+        } else {
+            Runtime_putError("Could not run %s: ERRNO %u\n", self->argv[0], spawnState);
+            ++self->failures;
+        }
+    }
+
+    ++self->commands;
+
+    for (size_t index = 0; index < self->pathsLen; ++index) {
+        dispose(paths[index]);
+    }
+
+    self->pathsLen = 0;
+    self->bytes    = 0;
+}
+
+/**
+ * Queue a file for the command, starting it if the batch is full
+ *
+ * @param self      batch
+ * @param config    configuration
+ * @param path      path to the file (copied)
+ */
+static void
+ExecBatch_add(ExecBatch* self, Configuration* config, const char* path) {
+    size_t cost = strlen(path) + 1 + sizeof(char*);
+
+    unless (self->children) {
+        self->jobs     = config->jobs ? config->jobs : ExecBatchDefaultJobs;
+        self->children = (pid_t*) calloc(self->jobs, sizeof(pid_t));
+    }
+
+    if (self->pathsLen > 0 && self->bytes + cost > self->limit) {
+        ExecBatch_flush(self, config);
+    }
+
+    if (self->pathsLen == self->pathsCapacity) {
+        self->pathsCapacity *= 2;
+        self->argv           = (char**) realloc(self->argv, (self->prefixLen + self->pathsCapacity + 1) * sizeof(char*));
+    }
+
+    self->argv[self->prefixLen + self->pathsLen++] = strdup(path);
+    self->bytes += cost;
+}
+
+/**
+ * Run the last batch and wait for every command
+ *
+ * @return number of commands that failed
+ */
+static u64
+ExecBatch_finish(ExecBatch* self, Configuration* config) {
+    ExecBatch_flush(self, config);
+
+    while (self->childrenLen > 0) {
+        ExecBatch_reap(self, config);
+    }
+
+    Runtime_verbose(config, "Ran %llu batches, %llu failed\n", self->commands, self->failures);
+
+    return self->failures;
+}
+
+/*
+ * SECTION: Content checks
+ * Find files that only hold zeros, asking the filesystem before reading anything
+ */
+
+/**
+ * Size of the buffer read into at a time when data has to be read
+ */
+#define ZERO_READ_SIZE      (64 << 10)
+
+/**
+ * Extents requested per FS_IOC_FIEMAP call
+ */
+#define ZERO_FIEMAP_EXTENTS 32
+
+static hot pure bool
+Memory_isZero(const char* data, size_t length) {
+    // Compare the buffer against itself shifted by one: all bytes equal, and the first is zero
+    return length == 0 || (data[0] == 0 && memcmp(data, data + 1, length - 1) == 0);
+}
+
+/**
+ * Returns 1 if FIEMAP shows that the file has no written extents (only unwritten preallocation, or nothing at all),
+ * 0 if it has written extents, and -1 if the filesystem does not support FIEMAP
+ */
+static int
+File_hasOnlyUnwrittenExtents(int fd) {
+    char            buffer[sizeof(struct fiemap) + ZERO_FIEMAP_EXTENTS * sizeof(struct fiemap_extent)];
+    struct fiemap*  map   = (struct fiemap*) buffer;
+    u64             start = 0;
+
+    for (;;) {
+        memset(map, 0, sizeof(struct fiemap));
+        map->fm_start        = start;
+        map->fm_length       = FIEMAP_MAX_OFFSET - start;
+        map->fm_extent_count = ZERO_FIEMAP_EXTENTS;
+        map->fm_flags        = FIEMAP_FLAG_SYNC;    // Dirty data still shows as unwritten until it is flushed
+
+        if (ioctl(fd, FS_IOC_FIEMAP, map) == -1) {
+            return -1;
+        }
+
+        if (map->fm_mapped_extents == 0) {
+            return 1;
+        }
+
+        for (u32 index = 0; index < map->fm_mapped_extents; ++index) {
+            struct fiemap_extent* extent = map->fm_extents + index;
+
+            unless (extent->fe_flags & FIEMAP_EXTENT_UNWRITTEN) {
+                return 0;
+            }
+
+            if (extent->fe_flags & FIEMAP_EXTENT_LAST) {
+                return 1;
+            }
+        }
+
+        struct fiemap_extent* last = map->fm_extents + map->fm_mapped_extents - 1;
+        start = last->fe_logical + last->fe_length;
+    }
+}
+
+/**
+ * Returns true if a byte range of a file only holds zeros, reading it through a small buffer
+ * and stopping at the first non-zero byte. A file that shrinks while it is read does not count as zero.
+ */
+static bool
+File_rangeIsZero(int fd, off_t start, off_t end) {
+    char buffer[ZERO_READ_SIZE];
+
+    while (start < end) {
+        size_t  length  = (end - start) < ZERO_READ_SIZE ? (size_t) (end - start) : ZERO_READ_SIZE;
+        ssize_t got     = pread(fd, buffer, length, start);
+
+        if (got <= 0) {
+            return false;
+        }
+
+        unless (Memory_isZero(buffer, got)) {
+            return false;
+        }
+
+        start += got;
+    }
+
+    return true;
+}
+
+/**
+ * Returns true if a file is a non-empty regular file holding nothing but zeros.
+ *
+ * The filesystem is asked first: SEEK_DATA failing with ENXIO means the file is all holes. Where SEEK_DATA is not
+ * supported, FIEMAP reporting only unwritten extents (after a sync) means it was preallocated and never written.
+ * Otherwise the data regions are read, and reading stops at the first non-zero byte, so real files cost one buffer.
+ * The block count is not trusted: filesystems that store small files inline report no blocks for them.
+ *
+ * @param path        path to the file
+ * @param statBuffer    lstat() of the file
+ */
+static bool
+File_isAllZero(char* path, struct stat* statBuffer) {
+    unless (S_ISREG(statBuffer->st_mode) && statBuffer->st_size > 0) {
+        return false;
+    }
+
+    int fd = open(path, O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC);
+
+    if (fd == -1) {
+        return false;
+    }
+
+    bool    result = false;
+    off_t   data   = lseek(fd, 0, SEEK_DATA);
+
+    if (data == -1 && errno == ENXIO) {
+        result = true;
+    } else if (data == -1) {
+        // No SEEK_DATA support: unless FIEMAP settles it, all of it has to be read
+        result = File_hasOnlyUnwrittenExtents(fd) == 1 || File_rangeIsZero(fd, 0, statBuffer->st_size);
+    } else {
+        // Data that SEEK_DATA found is read, whatever FIEMAP would say about it
+        result = true;
+
+        while (result && data != -1 && data < statBuffer->st_size) {
+            off_t hole = lseek(fd, data, SEEK_HOLE);
+
+            if (hole == -1) {
+                hole = statBuffer->st_size;
+            }
+
+            result = File_rangeIsZero(fd, data, hole);
+            data   = lseek(fd, hole, SEEK_DATA);
+        }
+    }
+
+    close(fd);
+    return result;
+}
+
+/*
+ * SECTION: Blocklist
+ * Known junk, identified by content: a sorted, mmapped table of (size, hash) pairs
+ */
+
+/**
+ * Files are hashed in chunks of this size, which can be hashed on different threads
+ */
+#define HASH_CHUNK_SIZE     (4 << 20)
+
+static const char       BlocklistMagic[8] = { 'S', 'C', 'R', 'U', 'B', 'B', 'L', '1' };
+
+typedef struct {
+    u64 size;
+    u64 hash;
+} BlocklistEntry;
+
+/**
+ * On-disk layout: magic, entry count, then entries sorted by size and hash, all in host byte order
+ */
+typedef struct {
+    char            magic[8];
+    u64             count;
+    BlocklistEntry  entries[];
+} BlocklistFile;
+
+typedef struct Blocklist {
+    BlocklistFile*      file;
+    size_t              mappedLength;
+    struct HashPool*    pool;       // hashes files of a listed size, once started
+} Blocklist;
+
+static const u64 Hash_prime1 = 11400714785074694791ULL;
+static const u64 Hash_prime2 = 14029467366897019727ULL;
+static const u64 Hash_prime3 =  1609587929392839161ULL;
+static const u64 Hash_prime4 =  9650029242287828579ULL;
+static const u64 Hash_prime5 =  2870177450012600261ULL;
+
+static inline u64
+Hash_rotate(u64 value, int bits) {
+    return (value << bits) | (value >> (64 - bits));
+}
+
+static inline u64
+Hash_round(u64 accumulator, u64 input) {
+    accumulator += input * Hash_prime2;
+    accumulator  = Hash_rotate(accumulator, 31);
+    return accumulator * Hash_prime1;
+}
+
+static inline u64
+Hash_load(const unsigned char* data) {
+    u64 value;
+    memcpy(&value, data, sizeof(u64));
+    return value;
+}
+
+/**
+ * 64-bit hash of a buffer (the XXH64 algorithm).
+ * The four lanes are independent, so their rounds can overlap in the pipeline.
+ *
+ * @param data      buffer
+ * @param length    buffer length
+ * @param seed      seed
+ */
+static hot u64
+Hash_buffer(const unsigned char* data, size_t length, u64 seed) {
+    const unsigned char*    end = data + length;
+    u64                     hash;
+
+    if (length >= 32) {
+        u64 lanes[4] = {
+            seed + Hash_prime1 + Hash_prime2,
+            seed + Hash_prime2,
+            seed,
+            seed - Hash_prime1
+        };
+
+        for (; data + 32 <= end; data += 32) {
+            for (int lane = 0; lane < 4; ++lane) {
+                lanes[lane] = Hash_round(lanes[lane], Hash_load(data + lane * 8));
+            }
+        }
+
+        hash = Hash_rotate(lanes[0], 1) + Hash_rotate(lanes[1], 7) + Hash_rotate(lanes[2], 12) + Hash_rotate(lanes[3], 18);
+
+        for (int lane = 0; lane < 4; ++lane) {
+            hash ^= Hash_round(0, lanes[lane]);
+            hash  = hash * Hash_prime1 + Hash_prime4;
+        }
+    } else {
+        hash = seed + Hash_prime5;
+    }
+
+    hash += (u64) length;
+
+    for (; data + 8 <= end; data += 8) {
+        hash ^= Hash_round(0, Hash_load(data));
+        hash  = Hash_rotate(hash, 27) * Hash_prime1 + Hash_prime4;
+    }
+
+    if (data + 4 <= end) {
+        unsigned int word;
+        memcpy(&word, data, sizeof(word));
+        hash ^= (u64) word * Hash_prime1;
+        hash  = Hash_rotate(hash, 23) * Hash_prime2 + Hash_prime3;
+        data += 4;
+    }
+
+    for (; data < end; ++data) {
+        hash ^= (*data) * Hash_prime5;
+        hash  = Hash_rotate(hash, 11) * Hash_prime1;
+    }
+
+    hash ^= hash >> 33;
+    hash *= Hash_prime2;
+    hash ^= hash >> 29;
+    hash *= Hash_prime3;
+    hash ^= hash >> 32;
+
+    return hash;
+}
+
+typedef struct {
+    int     fd;
+    size_t  length;
+    u64*    chunkHashes;
+    size_t  chunks;
+    size_t  first;
+    size_t  stride;
+    int     error;
+} HashJob;
+
+/**
+ * Read and hash every `stride`th chunk, from `first` on, into `buffer` (HASH_CHUNK_SIZE bytes).
+ * A file that got shorter meanwhile fails with ESTALE.
+ */
+static void
+Hash_chunks(HashJob* job, unsigned char* buffer) {
+    for (size_t chunk = job->first; chunk < job->chunks && job->error == ENONE; chunk += job->stride) {
+        size_t offset = chunk * HASH_CHUNK_SIZE;
+        size_t length = (job->length - offset) < HASH_CHUNK_SIZE ? job->length - offset : HASH_CHUNK_SIZE;
+
+        for (size_t done = 0; done < length;) {
+            ssize_t count = pread(job->fd, buffer + done, length - done, offset + done);
+
+            if (count <= 0) {
+                job->error = count ? errno : ESTALE;
+                break;
+            }
+
+            done += count;
+        }
+
+        job->chunkHashes[chunk] = Hash_buffer(buffer, length, chunk);
+    }
+}
+
+/**
+ * Threads that hash the chunks of large files, started once and kept until the end of the run.
+ * The thread hashing a file takes a share of it too, and any share that no worker took yet.
+ */
+typedef struct HashPool {
+    pthread_mutex_t lock;
+    pthread_cond_t  posted;     // shares to take, or closing
+    pthread_cond_t  finished;   // the last share taken was hashed
+    pthread_mutex_t callerLock; // one file at a time
+
+    /*
+     * Shares of the file being hashed: `sharesLen` of them, `taken` handed out, `running` being hashed
+     */
+    HashJob*        shares;
+    size_t          sharesLen;
+    size_t          taken;
+    size_t          running;
+
+    unsigned char*  buffer;     // the calling thread's
+    pthread_t*      workers;
+    size_t          workersLen;
+    bool            closing;
+} HashPool;
+
+static void*
+HashPool_run(void* context) {
+    HashPool*       self    = (HashPool*) context;
+    unsigned char*  buffer  = (unsigned char*) malloc(HASH_CHUNK_SIZE);
+
+    pthread_mutex_lock(&self->lock);
+
+    // Without a buffer, this worker takes no shares, and the calling thread hashes them instead
+    while (buffer && !self->closing) {
+        if (self->taken < self->sharesLen) {
+            HashJob* share = self->shares + self->taken++;
+
+            ++self->running;
+            pthread_mutex_unlock(&self->lock);
+
+            Hash_chunks(share, buffer);
+
+            pthread_mutex_lock(&self->lock);
+
+            if (--self->running == 0 && self->taken == self->sharesLen) {
+                pthread_cond_signal(&self->finished);
+            }
+        } else {
+            pthread_cond_wait(&self->posted, &self->lock);
+        }
+    }
+
+    pthread_mutex_unlock(&self->lock);
+    dispose(buffer);
+    return NULL;
+}
+
+/**
+ * Start hashing threads: `jobs` in all, counting the thread that hashes a file
+ *
+ * @return pool, or NULL with errno set
+ */
+static HashPool*
+HashPool_new(u32 jobs) {
+    HashPool* self = (HashPool*) calloc(1, sizeof(HashPool));
+
+    unless (self) {
+        return NULL;
+    }
+
+    jobs            = jobs ? jobs : 1;
+    self->shares    = (HashJob*) malloc(jobs * sizeof(HashJob));
+    self->workers   = (pthread_t*) malloc(jobs * sizeof(pthread_t));
+    self->buffer    = (unsigned char*) malloc(HASH_CHUNK_SIZE);
+
+    unless (self->shares && self->workers && self->buffer) {
+        dispose(self->shares);
+        dispose(self->workers);
+        dispose(self->buffer);
+        dispose(self);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    pthread_mutex_init(&self->lock, NULL);
+    pthread_mutex_init(&self->callerLock, NULL);
+    pthread_cond_init(&self->posted, NULL);
+    pthread_cond_init(&self->finished, NULL);
+
+    // Workers that could not be started only leave more for the calling thread
+    for (u32 index = 1; index < jobs; ++index) {
+        if (pthread_create(self->workers + self->workersLen, NULL, HashPool_run, self) != 0) {
+            break;
+        }
+        ++self->workersLen;
+    }
+
+    return self;
+}
+
+/**
+ * Stop the workers and free the pool
+ */
+static void
+HashPool_free(HashPool* self) {
+    pthread_mutex_lock(&self->lock);
+    self->closing = true;
+    pthread_cond_broadcast(&self->posted);
+    pthread_mutex_unlock(&self->lock);
+
+    for (size_t index = 0; index < self->workersLen; ++index) {
+        pthread_join(self->workers[index], NULL);
+    }
+
+    pthread_mutex_destroy(&self->lock);
+    pthread_mutex_destroy(&self->callerLock);
+    pthread_cond_destroy(&self->posted);
+    pthread_cond_destroy(&self->finished);
+
+    dispose(self->shares);
+    dispose(self->workers);
+    dispose(self->buffer);
+    dispose(self);
+}
+
+/**
+ * Hash the chunks of a file in `sharesLen` shares, set up by the caller, on the pool and the calling thread
+ */
+static void
+HashPool_hash(HashPool* self, size_t sharesLen) {
+    pthread_mutex_lock(&self->lock);
+
+    self->sharesLen = sharesLen;
+    self->taken     = 0;
+
+    pthread_cond_broadcast(&self->posted);
+
+    while (self->taken < self->sharesLen) {
+        HashJob* share = self->shares + self->taken++;
+
+        ++self->running;
+        pthread_mutex_unlock(&self->lock);
+
+        Hash_chunks(share, self->buffer);
+
+        pthread_mutex_lock(&self->lock);
+        --self->running;
+    }
+
+    while (self->running > 0) {
+        pthread_cond_wait(&self->finished, &self->lock);
+    }
+
+    self->sharesLen = 0;
+    self->taken     = 0;
+
+    pthread_mutex_unlock(&self->lock);
+}
+
+/**
+ * Content hash of a file: each HASH_CHUNK_SIZE chunk is read and hashed (on the threads of `pool`, if any),
+ * then the list of chunk hashes is hashed, seeded with the file size.
+ * The file is read rather than mapped, so one truncated meanwhile is an error instead of a SIGBUS.
+ *
+ * @param path      path to the file
+ * @param pool      hashing threads, or NULL to hash on the calling thread alone
+ * @param hash      receives the hash
+ * @return errno
+ */
+static int
+File_hashContent(const char* path, HashPool* pool, u64* hash) {
+    int fd = open(path, O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC);
+
+    if (fd == -1) {
+        return errno;
+    }
+
+    struct stat statBuffer;
+
+    if (fstat(fd, &statBuffer) != 0 || !S_ISREG(statBuffer.st_mode) || statBuffer.st_size == 0) {
+        close(fd);
+        return EINVAL;
+    }
+
+    size_t  length      = statBuffer.st_size;
+
+    posix_fadvise(fd, 0, length, POSIX_FADV_SEQUENTIAL);
+
+    size_t  chunks      = (length + HASH_CHUNK_SIZE - 1) / HASH_CHUNK_SIZE;
+    u64*    chunkHashes = (u64*) malloc(chunks * sizeof(u64));
+    int     error       = ENONE;
+
+    unless (chunkHashes) {
+        close(fd);
+        return ENOMEM;
+    }
+
+    if (pool) {
+        pthread_mutex_lock(&pool->callerLock);
+
+        size_t threads = pool->workersLen + 1 < chunks ? pool->workersLen + 1 : chunks;
+
+        for (size_t index = 0; index < threads; ++index) {
+            pool->shares[index] = (HashJob) { fd, length, chunkHashes, chunks, index, threads, ENONE };
+        }
+
+        HashPool_hash(pool, threads);
+
+        for (size_t index = 0; index < threads && error == ENONE; ++index) {
+            error = pool->shares[index].error;
+        }
+
+        pthread_mutex_unlock(&pool->callerLock);
+    } else {
+        HashJob         job     = { fd, length, chunkHashes, chunks, 0, 1, ENONE };
+        unsigned char*  buffer  = (unsigned char*) malloc(HASH_CHUNK_SIZE);
+
+        if (buffer) {
+            Hash_chunks(&job, buffer);
+            error = job.error;
+        } else {
+            error = ENOMEM;
+        }
+
+        dispose(buffer);
+    }
+
+    if (error == ENONE) {
+        *hash = Hash_buffer((const unsigned char*) chunkHashes, chunks * sizeof(u64), length);
+    }
+
+    close(fd);
+    dispose(chunkHashes);
+
+    return error;
+}
+
+/**
+ * Map a blocklist
+ *
+ * @param path  blocklist file
+ * @return blocklist, or NULL with errno set
+ */
+static Blocklist*
+Blocklist_open(const char* path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (fd == -1) {
+        return NULL;
+    }
+
+    struct stat statBuffer;
+
+    if (fstat(fd, &statBuffer) != 0 || (size_t) statBuffer.st_size < sizeof(BlocklistFile)) {
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    BlocklistFile* file = (BlocklistFile*) mmap(NULL, statBuffer.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+    close(fd);
+
+    if (file == MAP_FAILED) {
+        return NULL;
+    }
+
+    if (memcmp(file->magic, BlocklistMagic, sizeof(BlocklistMagic)) != 0
+        || file->count > (statBuffer.st_size - sizeof(BlocklistFile)) / sizeof(BlocklistEntry)) {
+        munmap(file, statBuffer.st_size);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    Blocklist* self = (Blocklist*) malloc(sizeof(Blocklist));
+
+    self->file         = file;
+    self->mappedLength = statBuffer.st_size;
+    self->pool         = NULL;
+
+    // Lookups jump around the table
+    madvise(file, statBuffer.st_size, MADV_RANDOM);
+
+    return self;
+}
+
+/**
+ * Returns the position of the first entry with a size of at least `size`
+ */
+static hot size_t
+Blocklist_lowerBound(Blocklist* self, u64 size, u64 hash) {
+    size_t low  = 0;
+    size_t high = self->file->count;
+
+    while (low < high) {
+        size_t          middle = low + (high - low) / 2;
+        BlocklistEntry* entry  = self->file->entries + middle;
+
+        if (entry->size < size || (entry->size == size && entry->hash < hash)) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    return low;
+}
+
+/**
+ * Returns true if any listed file has this size. No I/O: only the mapped table is searched.
+ */
+static hot bool
+Blocklist_hasSize(Blocklist* self, u64 size) {
+    size_t index = Blocklist_lowerBound(self, size, 0);
+
+    return index < self->file->count && self->file->entries[index].size == size;
+}
+
+static hot bool
+Blocklist_contains(Blocklist* self, u64 size, u64 hash) {
+    size_t index = Blocklist_lowerBound(self, size, hash);
+
+    return index < self->file->count
+        && self->file->entries[index].size == size
+        && self->file->entries[index].hash == hash;
+}
+
+/**
+ * Returns true if a file's content is listed. Only files of a listed size are read.
+ *
+ * @param self          blocklist
+ * @param path          path to the file
+ * @param statBuffer    lstat() of the file
+ */
+static bool
+Blocklist_matches(Blocklist* self, char* path, struct stat* statBuffer) {
+    unless (S_ISREG(statBuffer->st_mode) && statBuffer->st_size > 0 && Blocklist_hasSize(self, statBuffer->st_size)) {
+        return false;
+    }
+
+    u64 hash;
+
+    if (File_hashContent(path, self->pool, &hash) != ENONE) {
+        return false;
+    }
+
+    return Blocklist_contains(self, statBuffer->st_size, hash);
+}
+
+/*
+ * SECTION: Sidecars
+ * Per-directory index of primary file stems, to find sidecars whose primary file is gone
+ */
+
+/**
+ * A sidecar seen in the directory being read, decided on once the whole listing is known
+ */
+typedef struct {
+    size_t      offset;     // into SidecarIndex.names
+    RuleIndex   rule;
+} PendingSidecar;
+
+typedef struct {
+    /*
+     * Names of pending sidecars, NUL-separated
+     */
+    char*           names;
+    size_t          namesLen;
+    size_t          namesCapacity;
+
+    PendingSidecar* pending;
+    size_t          pendingLen;
+    size_t          pendingCapacity;
+
+    /*
+     * Primary file stems
+     */
+    StringSet       stems;
+} SidecarIndex;
+
+static void
+SidecarIndex_free(SidecarIndex* self) {
+    StringSet_free(&self->stems);
+    dispose(self->names);
+    dispose(self->pending);
+}
+
+/**
+ * Record a primary file
+ *
+ * @param self      index
+ * @param stem      file name
+ * @param length    length of the stem (the name without its extension)
+ */
+static void
+SidecarIndex_addPrimary(SidecarIndex* self, const char* stem, size_t length) {
+    StringSet_add(&self->stems, stem, length);
+}
+
+/**
+ * Returns true if a sidecar has a primary file: one whose stem is the sidecar's name up to any of its dots
+ * (so that `movie.en.srt` belongs to `movie.mkv`)
+ *
+ * @param self  index
+ * @param name  sidecar file name
+ */
+static bool
+SidecarIndex_hasPrimary(SidecarIndex* self, const char* name) {
+    if (self->stems.length == 0) {
+        return false;
+    }
+
+    for (const char* dot = strchr(name + 1, '.'); dot; dot = strchr(dot + 1, '.')) {
+        if (StringSet_contains(&self->stems, name, dot - name)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Remember a sidecar until the whole directory has been read
+ */
+static void
+SidecarIndex_defer(SidecarIndex* self, const char* name, RuleIndex rule) {
+    size_t length = strlen(name) + 1;
+
+    if (self->namesLen + length > self->namesCapacity) {
+        self->namesCapacity = (self->namesLen + length) * 2;
+        self->names         = (char*) realloc(self->names, self->namesCapacity);
+    }
+
+    if (self->pendingLen == self->pendingCapacity) {
+        self->pendingCapacity = self->pendingCapacity ? self->pendingCapacity * 2 : 16;
+        self->pending         = (PendingSidecar*) realloc(self->pending, self->pendingCapacity * sizeof(PendingSidecar));
+    }
+
+    memcpy(self->names + self->namesLen, name, length);
+    self->pending[self->pendingLen++] = (PendingSidecar) { self->namesLen, rule };
+    self->namesLen += length;
+}
+
+/*
+ * SECTION: Sorted deletes
+ * Per-directory list of files to delete once the listing is read, in inode order, spilled to disk in sorted runs
+ */
+
+/**
+ * A file to delete, noted while its directory is being read
+ */
+typedef struct {
+    u64         inode;
+    u32         offset;     // into DeleteBatch.names
+    RuleIndex   rule;
+} PendingDelete;
+
+typedef struct {
+    /*
+     * Names of pending deletes, NUL-separated
+     */
+    char*           names;
+    size_t          namesLen;
+    size_t          namesCapacity;
+
+    PendingDelete*  pending;
+    size_t          pendingLen;
+    size_t          pendingCapacity;
+
+    /*
+     * Runs spilled past the limit, each sorted by inode, and how many are left to read back
+     */
+    FILE*           spill;
+    size_t          runs;
+    bool            reading;
+    bool            spillFailed;
+} DeleteBatch;
+
+static void
+DeleteBatch_free(DeleteBatch* self) {
+    if (self->spill) {
+        fclose(self->spill);
+        self->spill = NULL;
+    }
+
+    dispose(self->names);
+    dispose(self->pending);
+}
+
+static int
+DeleteBatch_compare(const void* left, const void* right) {
+    u64 a = ((const PendingDelete*) left)->inode;
+    u64 b = ((const PendingDelete*) right)->inode;
+
+    return (a > b) - (a < b);
+}
+
+/**
+ * Sort the deletes held in memory by inode, so that inode tables and directory blocks are visited in order
+ */
+static void
+DeleteBatch_sort(DeleteBatch* self) {
+    qsort(self->pending, self->pendingLen, sizeof(PendingDelete), DeleteBatch_compare);
+}
+
+/**
+ * Write the deletes held in memory to the spill file as one sorted run, and forget them.
+ * If there is no spill file and none can be made, they are kept in memory instead.
+ */
+static void
+DeleteBatch_spill(DeleteBatch* self) {
+    unless (self->spill) {
+        self->spill = tmpfile();
+
+        unless (self->spill) {
+            Runtime_putError("Could not create a file to spill pending deletes to: ERRNO %u\n", errno);
+            self->spillFailed = true;
+            return;
+        }
+    }
+
+    u64 header[2] = { self->pendingLen, self->namesLen };
+
+    DeleteBatch_sort(self);
+
+    if (fwrite(header, sizeof(header), 1, self->spill) != 1
+        || fwrite(self->pending, sizeof(PendingDelete), self->pendingLen, self->spill) != self->pendingLen
+        || fwrite(self->names, 1, self->namesLen, self->spill) != self->namesLen) {
+        // A partial run would be misread: keep this one in memory, and go on without spilling
+        Runtime_putError("Could not spill pending deletes: ERRNO %u\n", errno);
+        self->spillFailed = true;
+        return;
+    }
+
+    ++self->runs;
+    self->pendingLen = 0;
+    self->namesLen   = 0;
+}
+
+/**
+ * Note a file to delete once the directory has been read
+ *
+ * @param self  batch
+ * @param name  file name
+ * @param inode inode number from the directory entry
+ * @param rule  rule that matched the file
+ * @param limit bytes to hold in memory before spilling
+ * @return false if the batch is full and cannot be spilled, in which case the file should be deleted right away
+ */
+static bool
+DeleteBatch_defer(DeleteBatch* self, const char* name, u64 inode, RuleIndex rule, size_t limit) {
+    size_t length = strlen(name) + 1;
+    bool   full   = self->namesLen + length + (self->pendingLen + 1) * sizeof(PendingDelete) > limit;
+
+    if (self->pendingLen > 0 && full && !self->spillFailed) {
+        DeleteBatch_spill(self);
+        full = self->spillFailed;
+    }
+
+    // Offsets into the names are 32-bit
+    if ((self->pendingLen > 0 && full) || self->namesLen + length > (u32) -1) {
+        return false;
+    }
+
+    if (self->namesLen + length > self->namesCapacity) {
+        self->namesCapacity = (self->namesLen + length) * 2;
+        self->names         = (char*) realloc(self->names, self->namesCapacity);
+    }
+
+    if (self->pendingLen == self->pendingCapacity) {
+        self->pendingCapacity = self->pendingCapacity ? self->pendingCapacity * 2 : 16;
+        self->pending         = (PendingDelete*) realloc(self->pending, self->pendingCapacity * sizeof(PendingDelete));
+    }
+
+    memcpy(self->names + self->namesLen, name, length);
+    self->pending[self->pendingLen++] = (PendingDelete) { inode, (u32) self->namesLen, rule };
+    self->namesLen += length;
+    return true;
+}
+
+/**
+ * Replace the deletes held in memory with the next spilled run.
+ * Returns false once every run has been read back, or if one cannot be.
+ */
+static bool
+DeleteBatch_load(DeleteBatch* self) {
+    u64 header[2];
+
+    if (self->runs == 0) {
+        return false;
+    }
+
+    unless (self->reading) {
+        rewind(self->spill);
+        self->reading = true;
+    }
+
+    unless (fread(header, sizeof(header), 1, self->spill) == 1) {
+        self->runs = 0;
+        return false;
+    }
+
+    if (header[0] > self->pendingCapacity) {
+        self->pendingCapacity = header[0];
+        self->pending         = (PendingDelete*) realloc(self->pending, self->pendingCapacity * sizeof(PendingDelete));
+    }
+
+    if (header[1] > self->namesCapacity) {
+        self->namesCapacity = header[1];
+        self->names         = (char*) realloc(self->names, self->namesCapacity);
+    }
+
+    unless (fread(self->pending, sizeof(PendingDelete), header[0], self->spill) == header[0]
+            && fread(self->names, 1, header[1], self->spill) == header[1]) {
+        self->runs = 0;
+        return false;
+    }
+
+    --self->runs;
+    self->pendingLen = header[0];
+    self->namesLen   = header[1];
+    return true;
+}
+
+/*
+ * SECTION: Plans
+ * --plan writes what a walk would delete; --apply deletes exactly that, after checking each entry is still the same file
+ */
+
+static const char PlanHeader[] = "scrub-plan 1\n";
+
+/**
+ * Identity of a file: inode plus, where the filesystem supports it, its file handle (which carries the generation)
+ */
+typedef struct {
+    u64             inode;
+    bool            isDirectory;
+    u32             handleType;
+    u32             handleLength;
+    unsigned char   handle[MAX_HANDLE_SZ];
+} PlanIdentity;
+
+typedef struct Plan {
+    FILE*   output;
+
+    /*
+     * Parent of the last entry as the walk gave it, and as written: absolute, so --apply can run from anywhere
+     */
+    char*   given;
+    char*   directory;
+    u64     entries;
+} Plan;
+
+/**
+ * Look up the identity of `name` in `dirFd` without following symlinks
+ *
+ * @param dirFd     directory, or AT_FDCWD
+ * @param name      entry name or path
+ * @param identity  receives the identity
+ * @return errno
+ */
+static int // errno
+PlanIdentity_get(int dirFd, const char* name, PlanIdentity* identity) {
+    struct stat statBuffer;
+
+    if (fstatat(dirFd, name, &statBuffer, AT_SYMLINK_NOFOLLOW) != 0) {
+        return errno;
+    }
+
+    identity->inode         = statBuffer.st_ino;
+    identity->isDirectory   = S_ISDIR(statBuffer.st_mode);
+    identity->handleType    = 0;
+    identity->handleLength  = 0;
+
+    struct {
+        struct file_handle  header;
+        unsigned char       bytes[MAX_HANDLE_SZ];
+    } handle;
+    int mountId;
+
+    handle.header.handle_bytes = MAX_HANDLE_SZ;
+
+    // Not every filesystem has handles; the inode alone is then all there is to check
+    if (name_to_handle_at(dirFd, name, &handle.header, &mountId, 0) == 0) {
+        identity->handleType   = handle.header.handle_type;
+        identity->handleLength = handle.header.handle_bytes;
+        memcpy(identity->handle, handle.header.f_handle, handle.header.handle_bytes);
+    }
+
+    return ENONE;
+}
+
+static bool
+PlanIdentity_equal(PlanIdentity* left, PlanIdentity* right) {
+    return left->inode == right->inode
+        && left->isDirectory == right->isDirectory
+        && left->handleType == right->handleType
+        && left->handleLength == right->handleLength
+        && memcmp(left->handle, right->handle, left->handleLength) == 0;
+}
+
+/**
+ * Write a path or name, escaping backslashes and newlines so that every record stays on one line
+ */
+static void
+Plan_writeEscaped(FILE* output, const char* text, size_t length) {
+    for (size_t index = 0; index < length; ++index) {
+        if (text[index] == '\\') {
+            fputs("\\\\", output);
+        } else if (text[index] == '\n') {
+            fputs("\\n", output);
+        } else {
+            fputc(text[index], output);
+        }
+    }
+}
+
+/**
+ * Undo Plan_writeEscaped in place
+ */
+static void
+Plan_unescape(char* text) {
+    char* out = text;
+
+    for (; *text; ++text) {
+        if (*text == '\\' && *(text + 1)) {
+            ++text;
+            *out++ = (*text == 'n') ? '\n' : *text;
+        } else {
+            *out++ = *text;
+        }
+    }
+
+    *out = '\0';
+}
+
+/**
+ * Create a plan file
+ *
+ * @param path  where to write it
+ * @return plan, or NULL with errno set
+ */
+static Plan*
+Plan_create(const char* path) {
+    FILE* output = fopen(path, "w");
+
+    unless (output) {
+        return NULL;
+    }
+
+    fputs(PlanHeader, output);
+
+    Plan* self = (Plan*) malloc(sizeof(Plan));
+
+    self->output    = output;
+    self->given     = NULL;
+    self->directory = NULL;
+    self->entries   = 0;
+
+    return self;
+}
+
+/**
+ * Add an entry to the plan. Entries are written in the order the walk would delete them, so a directory
+ * follows its contents; consecutive entries in the same directory share one `dir` record, which holds the
+ * realpath() of the directory rather than the path the walk took to it.
+ *
+ * @param self  plan
+ * @param path  entry to delete
+ * @return errno
+ */
+static int // errno
+Plan_add(Plan* self, const char* path) {
+    PlanIdentity identity;
+    int          result = PlanIdentity_get(AT_FDCWD, path, &identity);
+
+    unless (result == ENONE) {
+        return result;
+    }
+
+    size_t length = strlen(path);
+
+    while (length > 1 && path[length - 1] == '/') {
+        --length;
+    }
+
+    const char* name          = path + length;
+    size_t      nameLength    = 0;
+
+    while (name > path && *(name - 1) != '/') {
+        --name;
+        ++nameLength;
+    }
+
+    // Everything before the name, less the separator; "." for bare names, "/" for entries of the root
+    size_t      parentLength = (name > path) ? (size_t) (name - path - 1) : 0;
+    char*       parent       = (name == path) ? strdup(".")
+                             : (parentLength == 0) ? strdup("/")
+                             : strndup(path, parentLength);
+
+    if (self->given && strcmp(self->given, parent) == 0) {
+        dispose(parent);
+    } else {
+        char* directory = realpath(parent, NULL);
+
+        unless (directory) {
+            result = errno;
+            dispose(parent);
+            return result;
+        }
+
+        dispose(self->given);
+        self->given = parent;
+
+        // Two paths can lead to the same directory, which then needs no new record
+        if (self->directory && strcmp(self->directory, directory) == 0) {
+            dispose(directory);
+        } else {
+            dispose(self->directory);
+            self->directory = directory;
+
+            fputs("dir ", self->output);
+            Plan_writeEscaped(self->output, directory, strlen(directory));
+            fputc('\n', self->output);
+        }
+    }
+
+    fprintf(self->output, "%c %llu %u:", identity.isDirectory ? 'd' : 'f', (unsigned long long) identity.inode, identity.handleType);
+
+    if (identity.handleLength == 0) {
+        fputc('-', self->output);
+    }
+
+    for (u32 index = 0; index < identity.handleLength; ++index) {
+        fprintf(self->output, "%02x", identity.handle[index]);
+    }
+
+    fputc(' ', self->output);
+    Plan_writeEscaped(self->output, name, nameLength);
+    fputc('\n', self->output);
+
+    ++self->entries;
+    return ENONE;
+}
+
+/**
+ * Finish writing a plan
+ *
+ * @param self  plan
+ * @param path  where it was written
+ * @return errno
+ */
+static int // errno
+Plan_close(Plan* self, const char* path) {
+    int result = (fclose(self->output) == 0) ? ENONE : errno;
+
+    if (result == ENONE) {
+        Runtime_putError("Wrote %llu entries to %s\n", (unsigned long long) self->entries, path);
+    } else {
+        Runtime_putError("Could not write %s: ERRNO %u\n", path, result);
+    }
+
+    dispose(self->given);
+    dispose(self->directory);
+    dispose(self);
+    return result;
+}
+
+/**
+ * Parse an entry record: `f|d inode type:hex name`
+ *
+ * @return true if the record is well formed; `*name` then points into `line`
+ */
+static bool
+Plan_parseEntry(char* line, PlanIdentity* identity, char** name) {
+    char*               cursor = line + 2;
+    unsigned long long  inode;
+    unsigned int        handleType;
+    int                 consumed;
+
+    unless ((line[0] == 'f' || line[0] == 'd') && line[1] == ' ') {
+        return false;
+    }
+
+    unless (sscanf(cursor, "%llu %u:%n", &inode, &handleType, &consumed) == 2) {
+        return false;
+    }
+
+    cursor += consumed;
+
+    identity->inode        = inode;
+    identity->isDirectory  = (line[0] == 'd');
+    identity->handleType   = handleType;
+    identity->handleLength = 0;
+
+    if (*cursor == '-') {
+        ++cursor;
+    } else {
+        unsigned int byte;
+
+        while (*cursor != ' ' && *cursor && identity->handleLength < MAX_HANDLE_SZ && sscanf(cursor, "%2x", &byte) == 1) {
+            identity->handle[identity->handleLength++] = byte;
+            cursor += 2;
+        }
+    }
+
+    unless (*cursor == ' ') {
+        return false;
+    }
+
+    *name = cursor + 1;
+    Plan_unescape(*name);
+    return **name != '\0';
+}
+
+/**
+ * Execute a plan: open each directory (through the directory cache) and unlinkat() its entries through that descriptor,
+ * skipping any entry whose identity no longer matches the plan
+ *
+ * @param config    configuration
+ * @param path      plan file
+ * @return errno; ENOTEMPTY if any entry was skipped or could not be deleted
+ */
+static int // errno
+Plan_apply(Configuration* config, const char* path) {
+    FILE* input = fopen(path, "r");
+
+    unless (input) {
+        Runtime_putError("Could not open plan %s: ERRNO %u\n", path, errno);
+        return errno;
+    }
+
+    char*   line        = NULL;
+    size_t  capacity    = 0;
+    ssize_t length;
+    int     dirFd       = -1;
+    dev_t   dirDevice   = 0;
+    bool    dirFailed   = false;
+    char*   directory   = NULL;
+    u64     lineNumber  = 0;
+    u64     removed     = 0;
+    u64     changed     = 0;
+    u64     failed      = 0;
+
+    unless ((length = getline(&line, &capacity, input)) > 0 && strcmp(line, PlanHeader) == 0) {
+        Runtime_putError("%s is not a plan\n", path);
+        dispose(line);
+        fclose(input);
+        return EINVAL;
+    }
+
+    ++lineNumber;
+
+    while ((length = getline(&line, &capacity, input)) > 0) {
+        PlanIdentity planned, current;
+        char*        name;
+
+        ++lineNumber;
+
+        if (line[length - 1] == '\n') {
+            line[--length] = '\0';
+        }
+
+        if (strncmp(line, "dir ", 4) == 0) {
+            dispose(directory);
+            directory = strdup(line + 4);
+            Plan_unescape(directory);
+
+            // Plans come back to the same directories (a parent after each of its children), so they stay open
+            dirFd     = DirCache_open(config->dirCache, directory);
+            dirFailed = (dirFd == -1);
+
+            if (dirFailed) {
+                Runtime_putError("Could not open directory %s: ERRNO %u\n", directory, errno);
+            } else {
+                struct stat statBuffer;
+                dirDevice = (fstat(dirFd, &statBuffer) == 0) ? statBuffer.st_dev : 0;
+            }
+            continue;
+        }
+
+        unless (directory && Plan_parseEntry(line, &planned, &name)) {
+            Runtime_putError("%s:%llu: malformed record\n", path, (unsigned long long) lineNumber);
+            ++failed;
+            continue;
+        }
+
+        if (dirFailed) {
+            ++failed;
+            continue;
+        }
+
+        int identityState = PlanIdentity_get(dirFd, name, &current);
+
+        unless (identityState == ENONE && PlanIdentity_equal(&planned, &current)) {
+            Runtime_verbose(config, "Skipping %s/%s: %s\n", directory, name, (identityState == ENOENT) ? "gone" : "changed since planned");
+            ++changed;
+            continue;
+        }
+
+        if (config->simulate) {
+            Runtime_putError("unlinkat(%s, %s)\n", directory, name);
+            ++removed;
+        } else if (unlinkat(dirFd, name, planned.isDirectory ? AT_REMOVEDIR : 0) == 0) {
+            ++removed;
+
+            if (config->durability) {
+                Durability_touch(config->durability, directory, dirDevice, true);
+            }
+        } else {
+            int         error     = errno;
+            Arena*      arena     = Arena_get();
+            ArenaMark   mark      = Arena_mark(arena);
+
+            ErrorLog_report(config, "remove", Arena_path(arena, directory, name), error);
+            Arena_release(arena, mark);
+            ++failed;
+        }
+    }
+
+    dispose(directory);
+    dispose(line);
+    fclose(input);
+
+    Runtime_verbose(config, "Directory cache: %llu reused, %llu opened\n",
+                    (unsigned long long) config->dirCache->hits, (unsigned long long) config->dirCache->opens);
+
+    Runtime_putError("Applied %s: %llu removed, %llu skipped as changed, %llu failed\n", path,
+                     (unsigned long long) removed, (unsigned long long) changed, (unsigned long long) failed);
+
+    return (changed == 0 && failed == 0) ? ENONE : ENOTEMPTY;
+}
+
+/*
+ * SECTION: Survivor report
+ * --why-dirty: what kept a root, recorded as the walk goes. Only entries that stayed for their own sake count,
+ * not directories that stayed because of their contents.
+ */
+
+#define WHY_DIRTY_SAMPLES       10
+
+/**
+ * Extensions counted separately (a power of two); the rest are counted together
+ */
+#define WHY_DIRTY_EXTENSIONS    64
+#define WHY_DIRTY_EXTENSION_MAX 16
+
+typedef struct {
+    char    name[WHY_DIRTY_EXTENSION_MAX];
+    u64     count;
+} WhyDirtyExtension;
+
+typedef struct WhyDirty {
+    u64                 survivors;
+    u64                 byType[16];
+    WhyDirtyExtension   extensions[WHY_DIRTY_EXTENSIONS];
+    u64                 extensionsLen;
+    u64                 noExtension;
+    u64                 otherExtension;
+    char*               samples[WHY_DIRTY_SAMPLES];
+    u64                 state;
+} WhyDirty;
+
+static const char* WhyDirtyTypeNames[16] = {
+    [DT_UNKNOWN] = "unknown",   [DT_FIFO] = "fifo",         [DT_CHR] = "char device",   [DT_DIR] = "directory",
+    [DT_BLK] = "block device",  [DT_REG] = "file",          [DT_LNK] = "symlink",       [DT_SOCK] = "socket"
+};
+
+static WhyDirty*
+WhyDirty_new() {
+    WhyDirty* self = (WhyDirty*) calloc(1, sizeof(WhyDirty));
+
+    self->state = 0x9E3779B97F4A7C15ULL;
+    return self;
+}
+
+/**
+ * Forget the previous root
+ */
+static void
+WhyDirty_reset(WhyDirty* self) {
+    for (size_t index = 0; index < WHY_DIRTY_SAMPLES; ++index) {
+        dispose(self->samples[index]);
+    }
+
+    u64 state = self->state;
+
+    memset(self, 0, sizeof(WhyDirty));
+    self->state = state;
+}
+
+static void
+WhyDirty_countExtension(WhyDirty* self, const char* name) {
+    const char* extension = strrchr(name, '.');
+
+    unless (extension && extension != name) {
+        ++self->noExtension;
+        return;
+    }
+
+    ++extension;
+
+    if (strlen(extension) >= WHY_DIRTY_EXTENSION_MAX) {
+        ++self->otherExtension;
+        return;
+    }
+
+    for (size_t index = String_hash(extension, strlen(extension)) & (WHY_DIRTY_EXTENSIONS - 1);; index = (index + 1) & (WHY_DIRTY_EXTENSIONS - 1)) {
+        WhyDirtyExtension* slot = self->extensions + index;
+
+        if (slot->count == 0) {
+            // Keep a free slot so that probing always ends
+            if (self->extensionsLen == WHY_DIRTY_EXTENSIONS - 1) {
+                ++self->otherExtension;
+                return;
+            }
+
+            strcpy(slot->name, extension);
+            ++self->extensionsLen;
+        }
+
+        if (strcmp(slot->name, extension) == 0) {
+            ++slot->count;
+            return;
+        }
+    }
+}
+
+/**
+ * Record an entry that stayed. Paths are sampled uniformly (reservoir sampling), so the sample is not just
+ * the first directory the walk went through.
+ *
+ * @param self      report
+ * @param directory directory of the entry
+ * @param name      entry name, or "" for the directory itself
+ * @param type      entry type (DT_*)
+ */
+static void
+WhyDirty_note(WhyDirty* self, const char* directory, const char* name, unsigned char type) {
+    u64 slot = self->survivors++;
+
+    ++self->byType[type & 15];
+
+    unless (type == DT_DIR) {
+        WhyDirty_countExtension(self, name);
+    }
+
+    unless (slot < WHY_DIRTY_SAMPLES) {
+        self->state ^= self->state >> 12;
+        self->state ^= self->state << 25;
+        self->state ^= self->state >> 27;
+        slot = (self->state * 2685821657736338717ULL) % self->survivors;
+    }
+
+    if (slot < WHY_DIRTY_SAMPLES) {
+        size_t directoryLength = strlen(directory);
+
+        // An empty name stands for the directory itself
+        if (*name == '\0') {
+            dispose(self->samples[slot]);
+            self->samples[slot] = strdup(directory);
+            return;
+        }
+
+        size_t nameLength      = strlen(name);
+
+        dispose(self->samples[slot]);
+        self->samples[slot] = (char*) malloc(directoryLength + nameLength + 2);
+
+        memcpy(self->samples[slot], directory, directoryLength);
+        self->samples[slot][directoryLength] = '/';
+        memcpy(self->samples[slot] + directoryLength + 1, name, nameLength + 1);
+    }
+}
+
+static int
+WhyDirty_compareExtensions(const void* left, const void* right) {
+    const WhyDirtyExtension* a = (const WhyDirtyExtension*) left;
+    const WhyDirtyExtension* b = (const WhyDirtyExtension*) right;
+
+    return (a->count < b->count) - (a->count > b->count);
+}
+
+/**
+ * Print why a root stayed
+ *
+ * @param self      report
+ * @param root      the root
+ * @param stream    output
+ */
+static cold void
+WhyDirty_print(WhyDirty* self, const char* root, FILE* stream) {
+    fprintf(stream, "%s stayed: %llu entries kept\n", root, (unsigned long long) self->survivors);
+
+    fputs("  by type:", stream);
+
+    for (int type = 0; type < 16; ++type) {
+        if (self->byType[type]) {
+            fprintf(stream, " %s %llu", WhyDirtyTypeNames[type] ? WhyDirtyTypeNames[type] : "other", (unsigned long long) self->byType[type]);
+        }
+    }
+
+    fputs("\n  by extension:", stream);
+
+    WhyDirtyExtension sorted[WHY_DIRTY_EXTENSIONS];
+
+    memcpy(sorted, self->extensions, sizeof(sorted));
+    qsort(sorted, WHY_DIRTY_EXTENSIONS, sizeof(WhyDirtyExtension), WhyDirty_compareExtensions);
+
+    for (size_t index = 0; index < WHY_DIRTY_EXTENSIONS && sorted[index].count; ++index) {
+        fprintf(stream, " %s %llu", sorted[index].name, (unsigned long long) sorted[index].count);
+    }
+
+    if (self->noExtension) {
+        fprintf(stream, " (none) %llu", (unsigned long long) self->noExtension);
+    }
+
+    if (self->otherExtension) {
+        fprintf(stream, " (other) %llu", (unsigned long long) self->otherExtension);
+    }
+
+    fputc('\n', stream);
+
+    for (size_t index = 0; index < WHY_DIRTY_SAMPLES && self->samples[index]; ++index) {
+        fprintf(stream, "  e.g. %s\n", self->samples[index]);
+    }
+}
+
+/*
+ * SECTION: Tombstones
+ * Directories renamed out of sight, deleted by a background thread while the walk goes on
+ */
+
+static const char TombstonePrefix[] = ".scrub-tombstone";
+
+typedef struct Tombstones {
+    pthread_mutex_t lock;
+    pthread_cond_t  wake;
+    pthread_cond_t  idle;
+    pthread_t       reaper;
+    bool            started;
+    bool            busy;
+    bool            closing;
+    char**          pending;
+    size_t          pendingLen;
+    size_t          pendingSize;
+    u64             made;
+    u64             failures;
+} Tombstones;
+
+static Tombstones*
+Tombstones_new() {
+    Tombstones* self = (Tombstones*) calloc(1, sizeof(Tombstones));
+
+    pthread_mutex_init(&self->lock, NULL);
+    pthread_cond_init(&self->wake, NULL);
+    pthread_cond_init(&self->idle, NULL);
+
+    return self;
+}
+
+/**
+ * Delete a tombstone and everything in it. Nothing is matched: the subtree was classified before it was renamed.
+ *
+ * @param path  tombstone, or a directory inside of one
+ * @return errno of the first failure
+ */
+static int // errno
+Tombstone_remove(const char* path) {
+    Arena*      arena   = Arena_get();
+    Frame*      dir     = Frame_open(arena, path);
+    DirEntry*   entry;
+    int         result  = ENONE;
+
+    unless (dir) {
+        return errno;
+    }
+
+    while ((entry = Frame_read(arena, dir))) {
+        if ((strcmp(entry->d_name, ".") == 0) || (strcmp(entry->d_name, "..") == 0)) {
+            continue;
+        }
+
+        unsigned char   type = entry->d_type;
+        struct stat     statBuffer;
+
+        if (type == DT_UNKNOWN && fstatat(dir->fd, entry->d_name, &statBuffer, AT_SYMLINK_NOFOLLOW) == 0) {
+            type = IFTODT(statBuffer.st_mode);
+        }
+
+        int state = ENONE;
+
+        if (type == DT_DIR) {
+            ArenaMark mark = Arena_mark(arena);
+
+            state = Tombstone_remove(Arena_path(arena, path, entry->d_name));
+            Arena_release(arena, mark);
+
+            if (state == ENONE && unlinkat(dir->fd, entry->d_name, AT_REMOVEDIR) != 0) {
+                state = errno;
+            }
+        } else if (unlinkat(dir->fd, entry->d_name, 0) != 0) {
+            state = errno;
+        }
+
+        if (result == ENONE) {
+            result = state;
+        }
+    }
+
+    if (result == ENONE && errno != ENONE) {
+        result = errno;
+    }
+
+    Frame_close(arena, dir);
+    return result;
+}
+
+/**
+ * Delete one tombstone
+ *
+ * @return errno
+ */
+static int // errno
+Tombstones_reap(char* path) {
+    int state = Tombstone_remove(path);
+
+    if (state == ENONE && rmdir(path) != 0) {
+        state = errno;
+    }
+
+    unless (state == ENONE) {
+        Runtime_putError("Could not delete tombstone %s: ERRNO %u\n", path, state);
+    }
+
+    dispose(path);
+    return state;
+}
+
+static void*
+Tombstones_reaper(void* context) {
+    Tombstones* self = (Tombstones*) context;
+
+    pthread_mutex_lock(&self->lock);
+
+    for (;;) {
+        while (self->pendingLen == 0 && !self->closing) {
+            pthread_cond_wait(&self->wake, &self->lock);
+        }
+
+        if (self->pendingLen == 0) {
+            break;
+        }
+
+        char* path = self->pending[--self->pendingLen];
+        self->busy = true;
+
+        pthread_mutex_unlock(&self->lock);
+
+        int state = Tombstones_reap(path);
+
+        pthread_mutex_lock(&self->lock);
+
+        self->busy      = false;
+        self->failures += (state != ENONE);
+
+        if (self->pendingLen == 0) {
+            pthread_cond_broadcast(&self->idle);
+        }
+    }
+
+    pthread_mutex_unlock(&self->lock);
+
+    Arena_retire();
+
+    return NULL;
+}
+
+/**
+ * Hand a tombstone to the reaper, starting it if need be
+ *
+ * @param self  tombstones
+ * @param path  tombstone path, from malloc(); the reaper frees it
+ */
+static void
+Tombstones_add(Tombstones* self, char* path) {
+    pthread_mutex_lock(&self->lock);
+
+    unless (self->started) {
+        self->started = (pthread_create(&self->reaper, NULL, Tombstones_reaper, self) == 0);
+    }
+
+    // Without a reaper, the tombstone is deleted right away
+    unless (self->started) {
+        pthread_mutex_unlock(&self->lock);
+        self->failures += (Tombstones_reap(path) != ENONE);
+        return;
+    }
+
+    if (self->pendingLen == self->pendingSize) {
+        self->pendingSize = self->pendingSize ? self->pendingSize * 2 : 16;
+        self->pending     = (char**) realloc(self->pending, self->pendingSize * sizeof(char*));
+    }
+
+    self->pending[self->pendingLen++] = path;
+
+    pthread_cond_signal(&self->wake);
+    pthread_mutex_unlock(&self->lock);
+}
+
+/**
+ * Wait until every tombstone so far is deleted (or failed to be)
+ */
+static void
+Tombstones_wait(Tombstones* self) {
+    pthread_mutex_lock(&self->lock);
+
+    while (self->pendingLen > 0 || self->busy) {
+        pthread_cond_wait(&self->idle, &self->lock);
+    }
+
+    pthread_mutex_unlock(&self->lock);
+}
+
+/**
+ * Wait for the reaper to delete every tombstone, and stop it
+ *
+ * @return number of tombstones that could not be deleted
+ */
+static u64
+Tombstones_finish(Tombstones* self) {
+    pthread_mutex_lock(&self->lock);
+    self->closing = true;
+    pthread_cond_signal(&self->wake);
+    pthread_mutex_unlock(&self->lock);
+
+    if (self->started) {
+        pthread_join(self->reaper, NULL);
+        self->started = false;
+    }
+
+    return self->failures;
+}
+
+/*
+ * SECTION: Notifications
+ * --notify: the top-level directories that changed, collected in a set and sent in batches by a flusher thread
+ */
+
+typedef struct Notifier {
+    pthread_mutex_t lock;
+    pthread_cond_t  wake;
+
+    /*
+     * Held while a batch is sent, so that the walk only waits on `lock` for as long as a batch takes to collect
+     */
+    pthread_mutex_t sendLock;
+
+    pthread_t       flusher;
+    bool            started;
+    bool            closing;
+    const char*     target;
+    int             fd;
+    bool            isSocket;
+    u32             interval;
+    const char*     root;
+    const char*     realRoot;
+
+    /*
+     * Paths changed since the last batch
+     */
+    StringSet       changed;
+    u64             batches;
+} Notifier;
+
+/**
+ * Connect to the target: a Unix socket (stream or datagram), a FIFO with a reader, or a file to append to.
+ * A target that does not exist is not created, since it may be a FIFO or socket that its reader has yet to make:
+ * that fails with ENOENT, and the batch is tried again later.
+ *
+ * @param self  notifier
+ * @return errno
+ */
+static int // errno
+Notifier_connect(Notifier* self) {
+    struct stat statBuffer;
+
+    if (stat(self->target, &statBuffer) == 0 && S_ISSOCK(statBuffer.st_mode)) {
+        struct sockaddr_un address = { .sun_family = AF_UNIX };
+
+        if (strlen(self->target) >= sizeof(address.sun_path)) {
+            return ENAMETOOLONG;
+        }
+
+        strcpy(address.sun_path, self->target);
+
+        int types[] = { SOCK_STREAM, SOCK_DGRAM };
+
+        for (size_t index = 0; index < 2; ++index) {
+            int fd = socket(AF_UNIX, types[index] | SOCK_CLOEXEC, 0);
+
+            if (fd != -1 && connect(fd, (struct sockaddr*) &address, sizeof(address)) == 0) {
+                self->fd       = fd;
+                self->isSocket = true;
+                return ENONE;
+            }
+
+            int error = errno;
+
+            if (fd != -1) {
+                close(fd);
+            }
+
+            unless (error == EPROTOTYPE) {
+                return error;
+            }
+        }
+
+        return EPROTOTYPE;
+    }
+
+    // A FIFO without a reader is not waited for; the batch is tried again later
+    int fd = open(self->target, O_WRONLY | O_APPEND | O_NONBLOCK | O_CLOEXEC);
+
+    if (fd == -1) {
+        return errno;
+    }
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    self->fd       = fd;
+    self->isSocket = false;
+    return ENONE;
+}
+
+/**
+ * Write part of a batch. A reader that went away fails with EPIPE rather than raising SIGPIPE: sockets are sent
+ * to with MSG_NOSIGNAL, and for FIFOs the signal is blocked in this thread and taken back if it was raised.
+ *
+ * @return bytes written, or -1 with errno set
+ */
+static ssize_t
+Notifier_write(Notifier* self, const char* data, size_t length) {
+    if (self->isSocket) {
+        return send(self->fd, data, length, MSG_NOSIGNAL);
+    }
+
+    sigset_t signals;
+    sigset_t previous;
+    sigset_t pending;
+
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &signals, &previous);
+    sigpending(&pending);
+
+    ssize_t count = write(self->fd, data, length);
+    int     error = errno;
+
+    // Unless SIGPIPE was pending already, in which case it was not ours to take
+    if (count == -1 && error == EPIPE && !sigismember(&pending, SIGPIPE)) {
+        struct timespec none = { 0, 0 };
+
+        sigtimedwait(&signals, NULL, &none);
+    }
+
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    errno = error;
+    return count;
+}
+
+/**
+ * Returns true if a directory above `path` is in a set, which makes `path` redundant
+ */
+static bool
+Notifier_isCovered(StringSet* changed, const char* path) {
+    for (const char* slash = strchr(path + 1, '/'); slash; slash = strchr(slash + 1, '/')) {
+        if (StringSet_contains(changed, path, slash - path)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Send the changed paths as one batch. The set is taken under the lock and replaced by an empty one, and the
+ * batch is written without holding it, so a slow reader does not hold up the walk. If the batch cannot be sent,
+ * its paths go back into the set for the next one.
+ * Paths below another path of the batch (such as everything under a root that went) are left out.
+ */
+static void
+Notifier_flush(Notifier* self) {
+    pthread_mutex_lock(&self->sendLock);
+    pthread_mutex_lock(&self->lock);
+
+    StringSet changed = self->changed;
+
+    if (changed.length == 0) {
+        pthread_mutex_unlock(&self->lock);
+        pthread_mutex_unlock(&self->sendLock);
+        return;
+    }
+
+    self->changed = (StringSet) {0};
+
+    pthread_mutex_unlock(&self->lock);
+
+    int state = ENONE;
+
+    if (self->fd == -1) {
+        state = Notifier_connect(self);
+    }
+
+    if (state == ENONE) {
+        size_t  length = 1;
+        char*   batch;
+
+        for (size_t index = 0; index < changed.capacity; ++index) {
+            if (changed.slots[index]) {
+                length += strlen(changed.slots[index]) + 1;
+            }
+        }
+
+        char* cursor = batch = (char*) malloc(length);
+
+        for (size_t index = 0; index < changed.capacity; ++index) {
+            if (changed.slots[index] && !Notifier_isCovered(&changed, changed.slots[index])) {
+                cursor  = stpcpy(cursor, changed.slots[index]);
+                *cursor++ = '\n';
+            }
+        }
+
+        length = cursor - batch + 1;
+
+        *cursor = '\n';
+
+        // One write per batch, so that datagram sockets get the batch as one message
+        for (size_t written = 0; written < length && state == ENONE;) {
+            ssize_t count = Notifier_write(self, batch + written, length - written);
+
+            if (count <= 0) {
+                state = count ? errno : EIO;
+                close(self->fd);
+                self->fd = -1;
+            } else {
+                written += count;
+            }
+        }
+
+        dispose(batch);
+    }
+
+    if (state == ENONE) {
+        StringSet_free(&changed);
+        ++self->batches;
+    } else {
+        Runtime_putError("Could not notify %s: ERRNO %u\n", self->target, state);
+
+        // Whatever changed meanwhile is in the new set; the rest joins it for the next batch
+        pthread_mutex_lock(&self->lock);
+
+        for (size_t index = 0; index < changed.capacity; ++index) {
+            if (changed.slots[index]) {
+                StringSet_adopt(&self->changed, changed.slots[index]);
+            }
+        }
+
+        pthread_mutex_unlock(&self->lock);
+        dispose(changed.slots);
+    }
+
+    pthread_mutex_unlock(&self->sendLock);
+}
+
+static void*
+Notifier_run(void* context) {
+    Notifier* self = (Notifier*) context;
+
+    pthread_mutex_lock(&self->lock);
+
+    until (self->closing) {
+        struct timespec deadline;
+
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += self->interval;
+
+        while (!self->closing && pthread_cond_timedwait(&self->wake, &self->lock, &deadline) != ETIMEDOUT);
+
+        pthread_mutex_unlock(&self->lock);
+        Notifier_flush(self);
+        pthread_mutex_lock(&self->lock);
+    }
+
+    pthread_mutex_unlock(&self->lock);
+    return NULL;
+}
+
+/**
+ * Start notifying
+ *
+ * @param target    file, FIFO or socket
+ * @param interval  seconds between batches
+ */
+static Notifier*
+Notifier_new(const char* target, u32 interval) {
+    Notifier* self = (Notifier*) calloc(1, sizeof(Notifier));
+
+    pthread_mutex_init(&self->lock, NULL);
+    pthread_mutex_init(&self->sendLock, NULL);
+    pthread_cond_init(&self->wake, NULL);
+
+    self->target   = target;
+    self->interval = interval;
+    self->fd       = -1;
+
+    self->started = (pthread_create(&self->flusher, NULL, Notifier_run, self) == 0);
+
+    return self;
+}
+
+/**
+ * Set the root that following changes are under
+ *
+ * @param self      notifier
+ * @param root      root, as given
+ * @param realRoot  root, as an absolute path
+ */
+static void
+Notifier_enterRoot(Notifier* self, const char* root, const char* realRoot) {
+    pthread_mutex_lock(&self->lock);
+    self->root     = root;
+    self->realRoot = realRoot;
+    pthread_mutex_unlock(&self->lock);
+}
+
+/**
+ * Note that a path was removed or renamed. What gets reported is the top-level directory it was in: the first
+ * component below its root, or the root itself when that is what went.
+ *
+ * @param self  notifier
+ * @param path  path that changed
+ */
+static void
+Notifier_changed(Notifier* self, const char* path) {
+    size_t  rootLength  = self->root ? strlen(self->root) : 0;
+    char*   changed;
+
+    if (self->root && strncmp(path, self->root, rootLength) == 0 && path[rootLength] == '/') {
+        const char* end = strchrnul(path + rootLength + 1, '/');
+        size_t      realLength = strlen(self->realRoot);
+
+        changed = (char*) malloc(realLength + (end - path - rootLength) + 1);
+        memcpy(changed, self->realRoot, realLength);
+        memcpy(changed + realLength, path + rootLength, end - path - rootLength);
+        changed[realLength + (end - path - rootLength)] = '\0';
+    } else if (self->root && strcmp(path, self->root) == 0) {
+        changed = strdup(self->realRoot);
+    } else {
+        changed = realpath(path, NULL);
+
+        unless (changed) {
+            return;
+        }
+    }
+
+    pthread_mutex_lock(&self->lock);
+    StringSet_adopt(&self->changed, changed);
+    pthread_mutex_unlock(&self->lock);
+
+    unless (self->started) {
+        Notifier_flush(self);
+    }
+}
+
+/**
+ * Send what is left and stop
+ */
+static void
+Notifier_finish(Notifier* self) {
+    pthread_mutex_lock(&self->lock);
+    self->closing = true;
+    pthread_cond_signal(&self->wake);
+    pthread_mutex_unlock(&self->lock);
+
+    if (self->started) {
+        pthread_join(self->flusher, NULL);
+    }
+
+    // In case the flusher never ran
+    Notifier_flush(self);
+
+    if (self->fd != -1) {
+        close(self->fd);
+    }
+}
+
+/*
+ * SECTION: Walk history
+ * --history: sizes and durations of the subtrees near each root, kept from one run to the next to schedule the
+ * next walk (biggest roots first, biggest subtrees handed out to workers up front)
+ */
+
+/**
+ * Levels below a root for which subtrees are recorded
+ */
+static const u32    HistoryDepth        = 2;
+
+/**
+ * Directory bytes per entry, to rank roots with a history against those without one (see Root_estimate())
+ */
+static const u64    HistoryEntryBytes   = 32;
+
+/**
+ * Subtrees that took at least 1 / (HistorySplitShare * jobs) of the last walk are queued up front by --survey
+ */
+static const u64    HistorySplitShare   = 4;
+
+typedef struct {
+    char*   path;       // absolute, NULL for an unused slot
+    u64     entries;    // entries in the subtree
+    u64     micros;     // time spent reading it
+    bool    seen;       // recorded during this run
+} HistoryEntry;
+
+typedef struct History {
+    pthread_mutex_t lock;
+
+    /*
+     * Subtrees by path, open-addressed
+     */
+    HistoryEntry*   entries;
+    size_t          capacity;
+    size_t          used;
+
+    /*
+     * Roots walked during this run (whose unseen subtrees are gone), and the one being walked
+     */
+    char**          roots;
+    size_t          rootsLen;
+    const char*     root;
+    const char*     realRoot;
+} History;
+
+static u64
+History_now() {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (u64) now.tv_sec * 1000000 + (u64) now.tv_nsec / 1000;
+}
+
+static HistoryEntry*
+History_slot(HistoryEntry* entries, size_t capacity, const char* path) {
+    size_t index = String_hash(path, strlen(path)) & (capacity - 1);
+
+    while (entries[index].path && strcmp(entries[index].path, path) != 0) {
+        index = (index + 1) & (capacity - 1);
+    }
+
+    return entries + index;
+}
+
+/**
+ * Returns the entry for a path, created empty if needed. The lock must be held.
+ */
+static HistoryEntry*
+History_entry(History* self, const char* path) {
+    if ((self->used + 1) * 2 > self->capacity) {
+        size_t          capacity = self->capacity * 2;
+        HistoryEntry*   entries  = (HistoryEntry*) calloc(capacity, sizeof(HistoryEntry));
+
+        for (size_t index = 0; index < self->capacity; ++index) {
+            if (self->entries[index].path) {
+                *History_slot(entries, capacity, self->entries[index].path) = self->entries[index];
+            }
+        }
+
+        dispose(self->entries);
+        self->entries  = entries;
+        self->capacity = capacity;
+    }
+
+    HistoryEntry* entry = History_slot(self->entries, self->capacity, path);
+
+    unless (entry->path) {
+        entry->path = strdup(path);
+        ++self->used;
+    }
+
+    return entry;
+}
+
+/**
+ * Load the history left by previous runs. A missing file is an empty history.
+ *
+ * @param path  history file
+ * @return history, or NULL with errno set
+ */
+static History*
+History_load(const char* path) {
+    History*    self    = (History*) calloc(1, sizeof(History));
+    FILE*       input   = fopen(path, "r");
+
+    pthread_mutex_init(&self->lock, NULL);
+    self->capacity = 64;
+    self->entries  = (HistoryEntry*) calloc(self->capacity, sizeof(HistoryEntry));
+
+    unless (input) {
+        int error = errno;
+
+        if (error == ENOENT) {
+            return self;
+        }
+
+        dispose(self->entries);
+        dispose(self);
+        errno = error;
+        return NULL;
+    }
+
+    char*   line        = NULL;
+    size_t  capacity    = 0;
+    ssize_t length;
+    bool    valid       = (getline(&line, &capacity, input) > 0 && strcmp(line, "scrub-history 1\n") == 0);
+
+    while (valid && (length = getline(&line, &capacity, input)) > 0) {
+        unsigned long long  entries;
+        unsigned long long  micros;
+        int                 offset;
+
+        if (line[length - 1] == '\n') {
+            line[length - 1] = '\0';
+        }
+
+        unless (sscanf(line, "%llu %llu %n", &entries, &micros, &offset) == 2 && line[offset] == '/') {
+            continue;
+        }
+
+        Plan_unescape(line + offset);
+
+        HistoryEntry* entry = History_entry(self, line + offset);
+
+        entry->entries = entries;
+        entry->micros  = micros;
+    }
+
+    dispose(line);
+    fclose(input);
+
+    unless (valid) {
+        Runtime_putError("%s is not a history file, starting a new one\n", path);
+    }
+
+    return self;
+}
+
+/**
+ * Note that a root is walked during this run, and make it the root of paths given to History_record()
+ *
+ * @param self      history
+ * @param root      root, as given
+ * @param realRoot  root, as an absolute path
+ */
+static void
+History_enterRoot(History* self, const char* root, const char* realRoot) {
+    pthread_mutex_lock(&self->lock);
+
+    self->roots                   = (char**) realloc(self->roots, (self->rootsLen + 1) * sizeof(char*));
+    self->roots[self->rootsLen++] = strdup(realRoot);
+    self->root                    = root;
+    self->realRoot                = realRoot;
+
+    pthread_mutex_unlock(&self->lock);
+}
+
+/**
+ * Returns the absolute path of a subtree, given its root and its path as walked from the root as given
+ */
+static char*
+History_key(const char* root, const char* realRoot, const char* path) {
+    const char* relative    = path + strlen(root);
+    size_t      rootLength  = strlen(realRoot);
+    char*       key;
+
+    while (*relative == '/') {
+        ++relative;
+    }
+
+    if (*relative == '\0') {
+        return strdup(realRoot);
+    }
+
+    key = (char*) malloc(rootLength + strlen(relative) + 2);
+    sprintf(key, (rootLength > 0 && realRoot[rootLength - 1] == '/') ? "%s%s" : "%s/%s", realRoot, relative);
+
+    return key;
+}
+
+/**
+ * Returns how many levels below its root a path is
+ */
+static pure u32
+History_depth(const char* root, const char* path) {
+    u32 depth = 0;
+
+    for (const char* cursor = path + strlen(root); *cursor; ++cursor) {
+        if (*cursor == '/' && cursor[1] != '/' && cursor[1] != '\0') {
+            ++depth;
+        }
+    }
+
+    return depth;
+}
+
+/**
+ * Record the totals of a whole subtree below the current root, replacing what earlier runs saw
+ *
+ * @param self      history
+ * @param path      subtree, as walked
+ * @param entries   entries in the subtree
+ * @param micros    time spent walking it
+ */
+static void
+History_record(History* self, const char* path, u64 entries, u64 micros) {
+    char* key = History_key(self->root, self->realRoot, path);
+
+    pthread_mutex_lock(&self->lock);
+
+    HistoryEntry* entry = History_entry(self, key);
+
+    entry->entries = entries;
+    entry->micros  = micros;
+    entry->seen    = true;
+
+    pthread_mutex_unlock(&self->lock);
+    dispose(key);
+}
+
+/**
+ * Add one directory read by --survey to the subtrees holding it, up to HistoryDepth levels below its root.
+ * Directories are read in any order, so their subtrees are summed up as they come.
+ *
+ * @param self      history
+ * @param root      root, as given
+ * @param realRoot  root, as an absolute path
+ * @param path      directory, as walked
+ * @param entries   entries in the directory
+ * @param micros    time spent reading it
+ */
+static void
+History_add(History* self, const char* root, const char* realRoot, const char* path, u64 entries, u64 micros) {
+    char*   key     = History_key(root, realRoot, path);
+    size_t  keep    = strlen(realRoot);
+    u32     depth   = 0;
+
+    pthread_mutex_lock(&self->lock);
+
+    // The subtrees are the prefixes of the key that end after each of its first HistoryDepth components
+    for (;;) {
+        char saved = key[keep];
+
+        key[keep] = '\0';
+
+        HistoryEntry* entry = History_entry(self, key);
+
+        unless (entry->seen) {
+            entry->entries = 0;
+            entry->micros  = 0;
+            entry->seen    = true;
+        }
+
+        entry->entries += entries;
+        entry->micros  += micros;
+        key[keep]       = saved;
+
+        if (saved == '\0' || depth++ == HistoryDepth) {
+            break;
+        }
+
+        keep = strchrnul(key + keep + 1, '/') - key;
+    }
+
+    pthread_mutex_unlock(&self->lock);
+    dispose(key);
+}
+
+/**
+ * Returns what the last walk of a subtree saw, or NULL if it was never walked
+ */
+static HistoryEntry*
+History_find(History* self, const char* path) {
+    HistoryEntry* entry = History_slot(self->entries, self->capacity, path);
+
+    return entry->path ? entry : NULL;
+}
+
+static int
+History_compareEntries(const void* left, const void* right) {
+    return strcmp(((const HistoryEntry*) left)->path, ((const HistoryEntry*) right)->path);
+}
+
+/**
+ * Write the history back for the next run. Subtrees of the roots walked during this run that were not seen again
+ * are gone, and are dropped; everything under other roots is kept as it was.
+ *
+ * @param self  history
+ * @param path  history file
+ * @return errno
+ */
+static int // errno
+History_save(History* self, const char* path) {
+    char*   temporary   = NULL;
+    FILE*   output;
+
+    asprintf(&temporary, "%s.tmp", path);
+    output = fopen(temporary, "w");
+
+    unless (output) {
+        int error = errno;
+
+        dispose(temporary);
+        return error;
+    }
+
+    HistoryEntry*   entries = (HistoryEntry*) malloc((self->used + 1) * sizeof(HistoryEntry));
+    size_t          kept    = 0;
+
+    for (size_t index = 0; index < self->capacity; ++index) {
+        HistoryEntry* entry = self->entries + index;
+        bool          gone  = false;
+
+        unless (entry->path) {
+            continue;
+        }
+
+        for (size_t root = 0; root < self->rootsLen && !entry->seen && !gone; ++root) {
+            gone = strcmp(self->roots[root], entry->path) == 0 || Summary_isAncestor(self->roots[root], entry->path);
+        }
+
+        unless (gone) {
+            entries[kept++] = *entry;
+        }
+    }
+
+    qsort(entries, kept, sizeof(HistoryEntry), History_compareEntries);
+
+    fputs("scrub-history 1\n", output);
+
+    for (size_t index = 0; index < kept; ++index) {
+        fprintf(output, "%llu %llu ", (unsigned long long) entries[index].entries, (unsigned long long) entries[index].micros);
+        Plan_writeEscaped(output, entries[index].path, strlen(entries[index].path));
+        fputc('\n', output);
+    }
+
+    dispose(entries);
+
+    int result = (fclose(output) == 0 && rename(temporary, path) == 0) ? ENONE : errno;
+
+    unless (result == ENONE) {
+        unlink(temporary);
+    }
+
+    dispose(temporary);
+    return result;
+}
+
+/*
+ * SECTION: Implementation
+ * Routines relating to deleting things
+ */
+
+static pure u32 
+File_unlink(Configuration* config, char* path) {
+    if (config->simulate) {
+        if (config->plan) {
+            int planState = Plan_add(config->plan, path);
+
+            unless (planState == ENONE) {
+                Runtime_putError("Could not add %s to the plan: ERRNO %u\n", path, planState);
+                errno = planState;
+                return -1;
+            }
+        } else if (config->simulateFormat == SIMULATE_LINES) {
+            Runtime_putError("unlink(%s)\n", path);
+        }
+        return 0;
+    } else {
+        // pick RMDIR or UNLINK
+        struct stat statBuffer;
+        stat(path, &statBuffer);
+
+        u32 result = S_ISDIR(statBuffer.st_mode) ? rmdir(path) : unlink(path);
+
+        if (result == 0 && config->notifier) {
+            Notifier_changed(config->notifier, path);
+        }
+
+        return result;
+    }
+}
+
+/**
+ * Returns the rule that a file matches according to the configuration, or NO_RULE if it should not be clobbered
+ *
+ * @param config    configuration
+ * @param basename  file name
+ */
+static hot pure RuleIndex
+File_matchRule(Configuration* config, char* basename) {
+    RuleIndex rule = Configuration_findName(config, basename);
+
+    if (rule != NO_RULE) {
+        return rule;
+    }
+
+    // Get the file's extension, if present.
+    char* extensionStart = strrchr(basename, '.');
+
+    if (extensionStart) {
+        rule = Configuration_findExtension(config, extensionStart + 1);
+
+        if (rule != NO_RULE) {
+            return (RuleIndex) config->clobberNamesLen + rule;
+        }
+    }
+
+    if (config->rulesPath) {
+        rule = RuleSet_match(RuleSet_current(config), basename);
+
+        if (rule != NO_RULE) {
+            return Configuration_rulesFileRule(config) + rule;
+        }
+    }
+
+    return NO_RULE;
+}
+
+/**
+ * Returns true if a file is hidden (name begins with `.`)
+ *
+ * @param basename  file name 
+ */
+static pure bool 
+File_isHidden(char* basename) {
+    return (basename - strchrnul(basename, '.')) == 0;
+}
+
+/**
+ * Returns true if an entry may be deleted as far as --owner and --group are concerned.
+ * Only the owner and group are asked for, and only when one of them is set, so the common case costs nothing.
+ * An entry that cannot be looked up is kept.
+ *
+ * @param config    configuration
+ * @param dirFd     directory holding the entry, or AT_FDCWD
+ * @param name      entry name or path relative to `dirFd`, or "" for `dirFd` itself
+ */
+static hot bool
+File_isOwned(Configuration* config, int dirFd, const char* name) {
+    if (config->owner == (uid_t) -1 && config->group == (gid_t) -1) {
+        return true;
+    }
+
+    struct statx    statBuffer;
+    int             flags = AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT | AT_STATX_DONT_SYNC | (*name ? 0 : AT_EMPTY_PATH);
+
+    unless (statx(dirFd, name, flags, STATX_UID | STATX_GID, &statBuffer) == 0
+            && (statBuffer.stx_mask & (STATX_UID | STATX_GID)) == (STATX_UID | STATX_GID)) {
+        return false;
+    }
+
+    return (config->owner == (uid_t) -1 || statBuffer.stx_uid == config->owner)
+        && (config->group == (gid_t) -1 || statBuffer.stx_gid == config->group);
+}
+
+/**
+ * Returns the rule that a file matches, by name or by content, or NO_RULE if it should not be clobbered.
+ * Sidecar rules are not considered, as they depend on the rest of the directory.
+ *
+ * @param config        configuration
+ * @param path          path to the file
+ * @param fileName      file name
+ * @param statBuffer    receives the lstat() of the file, if one was needed
+ * @param statted       set if `statBuffer` was filled in
+ */
+static hot RuleIndex
+File_findRule(Configuration* config, char* path, char* fileName, struct stat* statBuffer, bool* statted) {
+    RuleIndex rule = File_matchRule(config, fileName);
+
+    unless (rule != NO_RULE || config->blocklist || config->clobberZero) {
+        return NO_RULE;
+    }
+
+    // Ownership is only looked up for what a name rule matched or a content rule may, and before any content is read
+    unless (File_isOwned(config, AT_FDCWD, path)) {
+        return NO_RULE;
+    }
+
+    // Content rules need the file's size, and apply to regular files only
+    if (rule == NO_RULE && lstat(path, statBuffer) == 0) {
+        *statted = true;
+
+        if (config->blocklist && Blocklist_matches(config->blocklist, path, statBuffer)) {
+            rule = Configuration_blocklistRule(config);
+        } else if (config->clobberZero && File_isAllZero(path, statBuffer)) {
+            rule = Configuration_zeroRule(config);
+        }
+    }
+
+    return rule;
+}
+
+/**
+ * Clobber a file that matched a rule
+ *
+ * @param config        configuration
+ * @param path          path to the file
+ * @param rule          rule that matched
+ * @param tally         totals of the directory holding the file
+ * @param statBuffer    lstat() of the file taken already, or NULL
+ */
+static hot pure int // errno 
+File_clobber(Configuration* config, char* path, RuleIndex rule, Tally* tally, const struct stat* statBuffer) {
+    u64 bytes = 0;
+
+    // Sized before it goes, but only counted against the rule once it went (or was handed off)
+    if (config->ruleProfile) {
+        struct stat ownBuffer;
+
+        if (statBuffer) {
+            bytes = statBuffer->st_size;
+        } else if (lstat(path, &ownBuffer) == 0) {
+            bytes = ownBuffer.st_size;
+        }
+    }
+
+    if (config->execBatch) {
+        ExecBatch_add(config->execBatch, config, path);
+
+        if (config->ruleProfile) {
+            RuleProfile_hit(config->ruleProfile, rule, bytes);
+        }
+
+        ++tally->survivors;
+        ++tally->handedOff;
+        return ENONE;
+    }
+
+    if (File_unlink(config, path) == -1) {
+        int error = errno;
+
+        ErrorLog_report(config, "unlink", path, error);
+        ++tally->survivors;
+        return error;
+    } else {
+        if (config->ruleProfile) {
+            RuleProfile_hit(config->ruleProfile, rule, bytes);
+        }
+
+        ++tally->files;
+        tally->bytes += bytes;
+        return ENONE;
+    }
+}
+
+/**
+ * Clobber a file if the configuration says so
+ *
+ * @param config    configuration
+ * @param path      path to the file
+ * @param fileName  file name (last component of `path`)
+ * @param tally     totals of the directory holding the file
+ */
+static hot pure int // errno 
+File_process(Configuration* config, char* path, char* fileName, Tally* tally) {
+    struct stat statBuffer;
+    bool        statted = false;
+    RuleIndex   rule    = File_findRule(config, path, fileName, &statBuffer, &statted);
+
+    if (rule != NO_RULE) {
+        return File_clobber(config, path, rule, tally, statted ? &statBuffer : NULL);
+    }
+
+    ++tally->survivors;
+    return ENONE;
+}
+
+/*
+ * Last filesystem checked by Directory_countSubdirectories(), as most directories live on the same one as their parent
+ */
+static __thread dev_t   Directory_lastDevice        = 0;
+static __thread bool    Directory_lastDeviceCounts  = false;
+
+/**
+ * Returns the number of subdirectories of an open directory, or -1 if the filesystem does not say.
+ * On filesystems that keep classic link counts (as fts relies on), a directory has a link from its parent,
+ * one from its own `.` and one from each subdirectory's `..`. A count of 2 therefore means a leaf.
+ *
+ * @param fd    open directory
+ */
+static hot long
+Directory_countSubdirectories(int fd) {
+    struct stat statBuffer;
+
+    if (fstat(fd, &statBuffer) != 0 || statBuffer.st_nlink < 2) {
+        return -1;
+    }
+
+    if (statBuffer.st_dev != Directory_lastDevice || Directory_lastDevice == 0) {
+        struct statfs fsBuffer;
+
+        // Others (btrfs, NFS, FUSE...) report 1 or a count that does not track subdirectories
+        Directory_lastDevice        = statBuffer.st_dev;
+        Directory_lastDeviceCounts  = fstatfs(fd, &fsBuffer) == 0
+            && (fsBuffer.f_type == EXT4_SUPER_MAGIC
+                || fsBuffer.f_type == XFS_SUPER_MAGIC
+                || fsBuffer.f_type == TMPFS_MAGIC);
+    }
+
+    return Directory_lastDeviceCounts ? (long) statBuffer.st_nlink - 2 : -1;
+}
+
+/**
+ * Record an entry that stays for --why-dirty
+ */
+static inline void
+Directory_noteSurvivor(Configuration* config, const char* directory, const char* name, unsigned char type) {
+    if (config->whyDirty) {
+        WhyDirty_note(config->whyDirty, directory, name, type);
+    }
+}
+
+/**
+ * Delete the files noted for --sorted-deletes, batch by batch in inode order.
+ * The directory may have changed since it was read: a file whose inode is no longer the one listed stays, and
+ * content rules and ownership are checked again, as the file may have been written to meanwhile.
+ *
+ * @param config    configuration
+ * @param dirFd     the directory holding them
+ * @param path      path to the directory
+ * @param deletes   pending deletes
+ * @param tally     totals of the directory
+ * @return number of files deleted
+ */
+static hot u64
+Directory_deletePending(Configuration* config, int dirFd, char* path, DeleteBatch* deletes, Tally* tally) {
+    Arena*  arena       = Arena_get();
+    u64     filesBefore = tally->files;
+
+    DeleteBatch_sort(deletes);
+
+    do {
+        for (size_t index = 0; index < deletes->pendingLen; ++index) {
+            ArenaMark   entryMark   = Arena_mark(arena);
+            char*       name        = deletes->names + deletes->pending[index].offset;
+            char*       entryPath   = Arena_path(arena, path, name);
+            RuleIndex   rule        = deletes->pending[index].rule;
+            u64         filesNow    = tally->files;
+            struct stat statBuffer;
+            bool        statted     = true;
+
+            if (fstatat(dirFd, name, &statBuffer, AT_SYMLINK_NOFOLLOW) != 0) {
+                // Already gone
+                Arena_release(arena, entryMark);
+                continue;
+            }
+
+            bool contentRule = (rule == Configuration_zeroRule(config) && config->clobberZero)
+                            || (rule == Configuration_blocklistRule(config) && config->blocklist);
+
+            if ((u64) statBuffer.st_ino != deletes->pending[index].inode) {
+                Runtime_verbose(config, "%s was replaced after it was listed, keeping it\n", entryPath);
+                ++tally->survivors;
+            } else if ((contentRule || config->owner != (uid_t) -1 || config->group != (gid_t) -1)
+                       && (rule = File_findRule(config, entryPath, name, &statBuffer, &statted)) == NO_RULE) {
+                ++tally->survivors;
+            } else {
+                File_clobber(config, entryPath, rule, tally, &statBuffer);
+            }
+
+            if (tally->files == filesNow && !config->execBatch) {
+                Directory_noteSurvivor(config, path, name, DT_REG);
+            }
+
+            Arena_release(arena, entryMark);
+        }
+    } while (DeleteBatch_load(deletes));
+
+    return tally->files - filesBefore;
+}
+
+/**
+ * Returns the errno that any unlink inside of an open directory would fail with, or ENONE if entries can be removed:
+ * EPERM if it is immutable or append-only, EACCES if we may not write to it, EROFS on a read-only filesystem.
+ * Immutable and append-only directories cannot be removed themselves either.
+ *
+ * @param fd    open directory
+ */
+static cold int // errno
+Directory_lockState(int fd) {
+    int flags = 0;
+
+    // Not every filesystem has inode flags; those that do not cannot set these
+    if (ioctl(fd, FS_IOC_GETFLAGS, &flags) == 0 && (flags & (FS_IMMUTABLE_FL | FS_APPEND_FL))) {
+        return EPERM;
+    }
+
+    if (faccessat(fd, ".", W_OK, AT_EACCESS) != 0) {
+        return errno;
+    }
+
+    return ENONE;
+}
+
+/**
+ * Returns true if an unlink that failed with `error` may have failed because nothing can be unlinked from its
+ * directory (see Directory_lockState())
+ */
+static inline bool
+Directory_isDenial(int error) {
+    return error == EACCES || error == EPERM || error == EROFS;
+}
+
+/*
+ * Depth of the directory being processed below its root (the root is 1), for --tombstone
+ */
+static __thread u32     Directory_depth             = 0;
+
+/*
+ * Set while walking a subtree that was classified to stay, for --tombstone: its subdirectories were read already,
+ * so they are not classified again level by level
+ */
+static __thread bool    Directory_declined          = false;
+
+/**
+ * Returns true if everything in a directory subtree would be clobbered, so that the whole subtree can go at once.
+ * Stops at the first entry that would stay.
+ *
+ * @param config    configuration
+ * @param path      directory
+ * @param frozen    whether the subtree was made read-only to be destroyed, so that EROFS does not keep it
+ * @param clean     receives the files, bytes and directories of the subtree, when it can go, and with
+ *                  --profile-rules the rules they matched (see Directory_settle())
+ */
+static bool
+Directory_classify(Configuration* config, char* path, bool frozen, Tally* clean) {
+    Arena*      arena       = Arena_get();
+    Frame*      dir         = Frame_open(arena, path);
+    DirEntry*   entry;
+    bool        clobberable;
+
+    unless (dir) {
+        return false;
+    }
+
+    int locked  = Directory_lockState(dir->fd);
+
+    clobberable = (locked == ENONE || (frozen && locked == EROFS)) && File_isOwned(config, dir->fd, "");
+
+    while (clobberable && (entry = Frame_read(arena, dir))) {
+        if ((strcmp(entry->d_name, ".") == 0) || (strcmp(entry->d_name, "..") == 0)) {
+            continue;
+        }
+
+        unsigned char   type = entry->d_type;
+        struct stat     statBuffer;
+
+        if (type == DT_UNKNOWN && fstatat(dir->fd, entry->d_name, &statBuffer, AT_SYMLINK_NOFOLLOW) == 0) {
+            type = IFTODT(statBuffer.st_mode);
+        }
+
+        ArenaMark   entryMark   = Arena_mark(arena);
+        char*       entryPath   = Arena_path(arena, path, entry->d_name);
+
+        switch (type) {
+            case DT_DIR:
+                clobberable = !(config->preserveHidden && File_isHidden(entry->d_name))
+                           && Directory_classify(config, entryPath, frozen, clean);
+                clean->collapses += clobberable;
+                break;
+
+            case DT_BLK:
+            case DT_CHR:
+            case DT_FIFO:
+            case DT_LNK:
+            case DT_SOCK:
+                if (config->preserveSpecial) {
+                    clobberable = false;
+                    break;
+                }
+
+                // Otherwise, judged like a regular file
+                // fall through
+            case DT_UNKNOWN:
+            case DT_REG: {
+                    char*       extension   = strrchr(entry->d_name, '.');
+                    RuleIndex   sidecar     = (extension && extension != entry->d_name) ? Configuration_findSidecar(config, extension + 1) : NO_RULE;
+                    RuleIndex   rule        = NO_RULE;
+                    bool        statted     = false;
+
+                    if (config->emptyDirsOnly) {
+                        clobberable = false;
+                    } else if (sidecar != NO_RULE && File_matchRule(config, entry->d_name) == NO_RULE) {
+                        // Were everything else to go, no primary would be left to keep it
+                        clobberable = File_isOwned(config, dir->fd, entry->d_name);
+                        rule        = config->clobberNamesLen + config->clobberExtensionsLen + sidecar;
+                    } else {
+                        rule        = File_findRule(config, entryPath, entry->d_name, &statBuffer, &statted);
+                        clobberable = (rule != NO_RULE);
+                    }
+
+                    if (clobberable) {
+                        u64 bytes = 0;
+
+                        if (statted) {
+                            bytes = statBuffer.st_size;
+                        } else if ((config->summary || config->ruleProfile) && fstatat(dir->fd, entry->d_name, &statBuffer, AT_SYMLINK_NOFOLLOW) == 0) {
+                            bytes = statBuffer.st_size;
+                        }
+
+                        if (config->ruleProfile) {
+                            unless (clean->hits) {
+                                clean->hits = RuleProfile_new(config->ruleProfile->count);
+                            }
+
+                            RuleProfile_hit(clean->hits, rule, bytes);
+                        }
+
+                        ++clean->files;
+                        clean->bytes += bytes;
+                    }
+                }
+                break;
+
+            default:
+                clobberable = false;
+                break;
+        }
+
+        Arena_release(arena, entryMark);
+    }
+
+    // A listing that could not be finished may hide anything
+    if (clobberable && errno != ENONE) {
+        clobberable = false;
+    }
+
+    Frame_close(arena, dir);
+    return clobberable;
+}
+
+/**
+ * Account a subtree classified by Directory_classify(): if it went, its rule counts are added to the profile
+ * and its totals to those of its parent. Its rule counts are freed either way.
+ *
+ * @param config    configuration
+ * @param path      subtree path
+ * @param clean     totals of the subtree
+ * @param gone      whether the subtree went
+ * @param tally     totals of the parent
+ */
+static void
+Directory_settle(Configuration* config, char* path, Tally* clean, bool gone, Tally* tally) {
+    if (clean->hits) {
+        if (gone) {
+            RuleProfile_merge(config->ruleProfile, clean->hits);
+        }
+
+        RuleProfile_free(clean->hits);
+        clean->hits = NULL;
+    }
+
+    unless (gone) {
+        return;
+    }
+
+    if (config->summary) {
+        Summary_record(config->summary, path, clean);
+    }
+
+    Tally_add(tally, clean);
+}
+
+/**
+ * If everything in a subdirectory would be clobbered, rename it to a hidden tombstone and have it deleted
+ * in the background. The subdirectory is renamed first and classified once it is out of sight, so that it is
+ * read only once and nothing can change between the check and the rename; if it does not qualify, it is renamed
+ * back and walked as usual.
+ *
+ * @param config    configuration
+ * @param dirFd     parent directory
+ * @param name      subdirectory name
+ * @param path      subdirectory path
+ * @param tally     totals of the parent; receives the subtree's totals when it was tombstoned
+ * @param declined  set when the subdirectory was classified and has to stay
+ * @return true if the subdirectory is gone from view
+ */
+static bool
+Directory_tombstone(Configuration* config, int dirFd, char* directory, char* name, char* path, Tally* tally, bool* declined) {
+    Tally   clean = { .collapses = 1 };
+    char    tombstone[64];
+
+    snprintf(tombstone, sizeof(tombstone), "%s.%d.%llu", TombstonePrefix, (int) getpid(), (unsigned long long) config->tombstones->made);
+
+    if (config->simulate) {
+        *declined = !Directory_classify(config, path, false, &clean);
+
+        if (*declined) {
+            Directory_settle(config, path, &clean, false, tally);
+            return false;
+        }
+
+        if (config->simulateFormat == SIMULATE_LINES) {
+            Runtime_putError("rename(%s, %s/%s)\n", path, directory, tombstone);
+        }
+
+        ++config->tombstones->made;
+        Directory_settle(config, path, &clean, true, tally);
+        return true;
+    }
+
+    unless (renameat2(dirFd, name, dirFd, tombstone, RENAME_NOREPLACE) == 0) {
+        Runtime_verbose(config, "Could not tombstone %s (ERRNO %u), deleting it in place\n", path, errno);
+        return false;
+    }
+
+    size_t  directoryLength = strlen(directory);
+    char*   tombstonePath   = (char*) malloc(directoryLength + sizeof(tombstone) + 2);
+
+    sprintf(tombstonePath, "%s/%s", directory, tombstone);
+    ++config->tombstones->made;
+
+    *declined = !Directory_classify(config, tombstonePath, false, &clean);
+
+    if (*declined) {
+        Directory_settle(config, path, &clean, false, tally);
+
+        if (renameat2(dirFd, tombstone, dirFd, name, RENAME_NOREPLACE) == 0) {
+            dispose(tombstonePath);
+            return false;
+        }
+
+        // Something took its name meanwhile: leave the tombstone be, as it holds what must stay
+        ErrorLog_report(config, "restore tombstone", tombstonePath, errno);
+        dispose(tombstonePath);
+        ++tally->survivors;
+        Directory_noteSurvivor(config, directory, tombstone, DT_DIR);
+        return true;
+    }
+
+    Tombstones_add(config->tombstones, tombstonePath);
+
+    if (config->notifier) {
+        Notifier_changed(config->notifier, path);
+    }
+
+    Directory_settle(config, path, &clean, true, tally);
+    return true;
+}
+
+/**
+ * Returns true if an entry of a directory is the root of a btrfs subvolume: the first inode number of its own tree,
+ * on btrfs
+ *
+ * @param dirFd     directory
+ * @param entry     entry of the directory
+ */
+static bool
+Directory_isSubvolume(int dirFd, DirEntry* entry) {
+    struct stat     statBuffer;
+    struct statfs   filesystem;
+
+    // Cheap test first: the number is in the listing already
+    unless (entry->d_ino == BTRFS_FIRST_FREE_OBJECTID) {
+        return false;
+    }
+
+    if (fstatat(dirFd, entry->d_name, &statBuffer, AT_SYMLINK_NOFOLLOW) != 0 || statBuffer.st_ino != BTRFS_FIRST_FREE_OBJECTID) {
+        return false;
+    }
+
+    return fstatfs(dirFd, &filesystem) == 0 && filesystem.f_type == BTRFS_SUPER_MAGIC;
+}
+
+/**
+ * Set or clear the read-only flag of a btrfs subvolume
+ *
+ * @param fd        the subvolume, open
+ * @param readOnly  whether to make it read-only
+ * @return errno
+ */
+static int // errno
+Directory_setSubvolumeReadOnly(int fd, bool readOnly) {
+    u64 flags = 0;
+
+    if (ioctl(fd, BTRFS_IOC_SUBVOL_GETFLAGS, &flags) != 0) {
+        return errno;
+    }
+
+    flags = readOnly ? (flags | BTRFS_SUBVOL_RDONLY) : (flags & ~(u64) BTRFS_SUBVOL_RDONLY);
+
+    return (ioctl(fd, BTRFS_IOC_SUBVOL_SETFLAGS, &flags) == 0) ? ENONE : errno;
+}
+
+/**
+ * If everything in a btrfs subvolume would be clobbered, destroy it. btrfs drops the subvolume's tree in
+ * the background, so this takes one ioctl however much the subvolume holds.
+ *
+ * Destroying drops whatever the subvolume holds at that moment, so it is made read-only before it is classified:
+ * nothing can be written to it between the decision and the ioctl. If it is to stay, its flag is put back.
+ *
+ * @param config    configuration
+ * @param dirFd     parent directory
+ * @param name      subvolume name
+ * @param path      subvolume path
+ * @param tally     totals of the parent; receives the subvolume's totals when it was destroyed
+ * @return true if the subvolume is gone
+ */
+static bool
+Directory_destroySubvolume(Configuration* config, int dirFd, char* name, char* path, Tally* tally) {
+    Tally clean = { .collapses = 1 };
+
+    // Simulations change nothing, the flag included
+    if (config->simulate) {
+        unless (Directory_classify(config, path, false, &clean)) {
+            Directory_settle(config, path, &clean, false, tally);
+            return false;
+        }
+
+        if (config->simulateFormat == SIMULATE_LINES) {
+            Runtime_putError("destroy_subvolume(%s)\n", path);
+        }
+    } else {
+        struct btrfs_ioctl_vol_args arguments = { .fd = 0 };
+
+        if (strlen(name) >= sizeof(arguments.name)) {
+            return false;
+        }
+
+        strcpy(arguments.name, name);
+
+        int subvolume = openat(dirFd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+
+        if (subvolume == -1) {
+            return false;
+        }
+
+        u64 flags = 0;
+
+        // A subvolume that is read-only already stays so; any other is frozen, and thawed unless it goes
+        bool wasReadOnly = ioctl(subvolume, BTRFS_IOC_SUBVOL_GETFLAGS, &flags) == 0 && (flags & BTRFS_SUBVOL_RDONLY);
+        int  frozen      = ENONE;
+
+        // Said before it is done, so that a subvolume left read-only by a run that was killed can be traced back
+        unless (wasReadOnly) {
+            Runtime_putError("Making subvolume %s read-only while it is checked (undo with: btrfs property set %s ro false)\n",
+                             path, path);
+            frozen = Directory_setSubvolumeReadOnly(subvolume, true);
+        }
+
+        unless (frozen == ENONE) {
+            Runtime_verbose(config, "Could not make subvolume %s read-only (ERRNO %u), deleting its contents instead\n", path, frozen);
+            close(subvolume);
+            return false;
+        }
+
+        bool gone = Directory_classify(config, path, true, &clean);
+
+        // EPERM without the privilege, ENOTEMPTY when it holds other subvolumes: empty it the slow way then
+        if (gone && ioctl(dirFd, BTRFS_IOC_SNAP_DESTROY, &arguments) != 0) {
+            Runtime_verbose(config, "Could not destroy subvolume %s (ERRNO %u), deleting its contents instead\n", path, errno);
+            gone = false;
+        }
+
+        unless (gone || wasReadOnly) {
+            int thawed = Directory_setSubvolumeReadOnly(subvolume, false);
+
+            unless (thawed == ENONE) {
+                ErrorLog_report(config, "make subvolume writable", path, thawed);
+            }
+        }
+
+        close(subvolume);
+
+        unless (gone) {
+            Directory_settle(config, path, &clean, false, tally);
+            return false;
+        }
+
+        if (config->notifier) {
+            Notifier_changed(config->notifier, path);
+        }
+    }
+
+    Directory_settle(config, path, &clean, true, tally);
+    return true;
+}
+
+/**
+ * Clobber what the configuration says inside of a directory, collapsing any subdirectories that end up empty.
+ * The directory itself is left in place.
+ *
+ * @param config    configuration
+ * @param path      path to the directory
+ * @param tally     receives the totals for the directory's subtree
+ */
+static hot pure int // errno 
+Directory_process(Configuration* config, char* path, Tally* tally) {
+    Arena*      arena   = Arena_get();
+    Frame*      dir     = Frame_open(arena, path);
+    u32         result  = ENONE;
+
+    ++Directory_depth;
+
+    // Subtrees near the root are timed for --history
+    bool        timed   = config->history && dir && Directory_depth <= HistoryDepth + 1;
+    u64         started = timed ? History_now() : 0;
+    
+    if (dir) {
+        DirEntry*   currentEntry    = NULL;
+        u64         removedHere     = 0;
+        bool        settled         = false;
+
+        /*
+         * Subdirectories not seen yet, or -1 if unknown.
+         * Costs an fstat(), so it is only looked up when it can save work: with --empty-dirs-only (where the rest of
+         * a directory is irrelevant once it is known to survive and all of its subdirectories were seen), and when
+         * an entry's type is unknown (a leaf cannot hold directories, so no fstatat() is needed).
+         */
+        long        subdirectoriesLeft  = config->emptyDirsOnly ? Directory_countSubdirectories(dir->fd) : -1;
+        bool        subdirectoriesKnown = config->emptyDirsOnly;
+
+        /*
+         * Sidecars cannot be judged until every primary in the directory has been seen
+         */
+        SidecarIndex sidecars = { 0 };
+
+        /*
+         * With --sorted-deletes, files to delete wait until the listing is done
+         */
+        DeleteBatch deletes = { 0 };
+
+        /*
+         * In a directory where nothing can be unlinked, only subdirectories are worth a look (their contents may
+         * still be removable). Almost every directory can be modified, so this is only checked once an unlink in
+         * it fails the way it would in one that cannot.
+         */
+        int  locked         = ENONE;
+        bool lockChecked    = false;
+
+        while (!settled && (currentEntry = Frame_read(arena, dir))) {
+            if ((strcmp(currentEntry->d_name, ".") == 0) || (strcmp(currentEntry->d_name, "..") == 0)) {
+                continue;
+            }
+
+            ++tally->entries;
+
+            // Between entries, no rule set is held
+            RuleSet_quiesce();
+
+            unsigned char type = currentEntry->d_type;
+
+            if (type == DT_UNKNOWN) {
+                unless (subdirectoriesKnown) {
+                    subdirectoriesLeft  = Directory_countSubdirectories(dir->fd);
+                    subdirectoriesKnown = true;
+                }
+
+                unless (subdirectoriesLeft == 0) {
+                    struct stat statBuffer;
+
+                    if (fstatat(dir->fd, currentEntry->d_name, &statBuffer, AT_SYMLINK_NOFOLLOW) == 0) {
+                        type = IFTODT(statBuffer.st_mode);
+                    }
+                }
+            }
+
+            if (type == DT_DIR && subdirectoriesLeft > 0) {
+                --subdirectoriesLeft;
+            }
+
+            if (locked != ENONE && type != DT_DIR) {
+                ++tally->survivors;
+                Directory_noteSurvivor(config, path, currentEntry->d_name, type);
+
+                settled = tally->survivors > 0 && subdirectoriesLeft == 0;
+                continue;
+            }
+
+            // Everything allocated for this entry, including by the subtree below it, goes when it is done
+            ArenaMark   entryMark           = Arena_mark(arena);
+            char*       currentEntryPath    = Arena_path(arena, path, currentEntry->d_name);
+            u64         survivorsBefore     = tally->survivors;
+            u64         handedOffBefore     = tally->handedOff;
+            u64         removedBefore       = removedHere;
+            bool        declined            = false;
+            bool        denied              = false;
+            
+            switch (type) {
+                case DT_DIR: 
+                    if (config->preserveHidden && File_isHidden(currentEntry->d_name)) {
+                        ++tally->survivors;
+                        Directory_noteSurvivor(config, path, currentEntry->d_name, type);
+                    } else if (config->homogeneousOwners && !File_isOwned(config, dir->fd, currentEntry->d_name)) {
+                        Runtime_verbose(config, "Directory %s belongs to someone else, skipping it\n", currentEntryPath);
+                        ++tally->survivors;
+                        Directory_noteSurvivor(config, path, currentEntry->d_name, type);
+                    } else if (config->destroySubvolumes && !config->plan && locked == ENONE
+                               && Directory_isSubvolume(dir->fd, currentEntry)
+                               && Directory_destroySubvolume(config, dir->fd, currentEntry->d_name, currentEntryPath, tally)) {
+                        ++removedHere;
+                    } else if (Directory_depth <= config->tombstoneDepth && locked == ENONE && !Directory_declined
+                               && Directory_tombstone(config, dir->fd, path, currentEntry->d_name, currentEntryPath, tally, &declined)) {
+                        ++removedHere;
+                    } else {
+                        Tally child             = { 0 };
+                        bool  declinedAbove     = Directory_declined;
+
+                        Directory_declined      = declinedAbove || declined;
+
+                        u32   completionState   = Directory_process(config, currentEntryPath, &child);
+
+                        Directory_declined      = declinedAbove;
+
+                        Tally_add(tally, &child);
+
+                        if (completionState == ENONE) {
+                            if (child.survivors == 0 && (locked != ENONE || !File_isOwned(config, dir->fd, currentEntry->d_name))) {
+                                // Empty, but it cannot be unlinked from here, or is not ours to unlink
+                                ++tally->survivors;
+                                Directory_noteSurvivor(config, path, currentEntry->d_name, type);
+                            } else if (child.survivors == 0) {
+                                // Everything inside was clobbered, so rmdir() can go ahead without re-reading the directory
+                                if (File_unlink(config, currentEntryPath) == -1) {
+                                    denied = Directory_isDenial(errno);
+
+                                    if (errno == ENOTEMPTY) {
+                                        Runtime_verbose(config, "Directory %s is not empty. Not unlinking.\n", currentEntryPath);
+                                    } else {
+                                        ErrorLog_report(config, "rmdir", currentEntryPath, errno);
+                                    }
+                                    ++tally->survivors;
+                                    Directory_noteSurvivor(config, path, currentEntry->d_name, type);
+                                } else {
+                                    ++tally->collapses;
+                                    ++removedHere;
+                                }
+                            } else {
+                                Runtime_verbose(config, "Directory %s is not empty. Not unlinking.\n", currentEntryPath);
+                                ++tally->survivors;
+
+                                if (child.handedOff == child.survivors) {
+                                    ++tally->handedOff;
+                                }
+                            }
+                        } else {
+                            ErrorLog_report(config, "process directory", currentEntryPath, completionState);
+                            ++tally->survivors;
+                            Directory_noteSurvivor(config, path, currentEntry->d_name, type);
+                        }
+                    }
+                    break;
+
+                /*
+                 * Allow custom handling "for special" files 
+                 * Usually, a lot of these are synthetic and can be removed without concern
+                 */
+                case DT_BLK:
+                case DT_CHR:
+                case DT_FIFO:
+                case DT_LNK: 
+                case DT_SOCK:
+                    if (config->preserveSpecial) {
+                        ++tally->survivors;
+                        break;
+                    }
+
+                /*
+                 * Several filesystems will return DT_UNKOWN as they do not implement d_type support.
+                 * Unless fstatat() failed, such entries were resolved above or are in a leaf, so they are not directories
+                 * and are treated as DT_REG.
+                 */
+                case DT_UNKNOWN:
+                case DT_REG: {
+                        if (config->emptyDirsOnly) {
+                            ++tally->survivors;
+                            break;
+                        }
+
+                        u64 filesBefore  = tally->files;
+
+                        if (config->sidecarExtensionsLen > 0) {
+                            char* extension = strrchr(currentEntry->d_name, '.');
+
+                            if (extension && extension != currentEntry->d_name) {
+                                RuleIndex sidecar = Configuration_findSidecar(config, extension + 1);
+
+                                if (sidecar != NO_RULE && File_matchRule(config, currentEntry->d_name) == NO_RULE) {
+                                    RuleIndex firstSidecarRule = config->clobberNamesLen + config->clobberExtensionsLen;
+
+                                    SidecarIndex_defer(&sidecars, currentEntry->d_name, firstSidecarRule + sidecar);
+                                    break;
+                                }
+
+                                if (Configuration_isPrimary(config, extension + 1)) {
+                                    u32 returnStatus = File_process(config, currentEntryPath, currentEntry->d_name, tally);
+
+                                    removedHere += tally->files - filesBefore;
+                                    denied       = Directory_isDenial(returnStatus);
+
+                                    unless (returnStatus == ENONE) {
+                                        Runtime_verbose(config, "File_process(%s) failed: ERRNO %u\n", currentEntryPath, returnStatus);
+                                    }
+                                    break;
+                                }
+                            }
+                        }
+
+                        if (config->sortedDeletes) {
+                            struct stat statBuffer;
+                            bool        statted = false;
+                            RuleIndex   rule    = File_findRule(config, currentEntryPath, currentEntry->d_name, &statBuffer, &statted);
+
+                            if (rule == NO_RULE) {
+                                ++tally->survivors;
+                            } else unless (DeleteBatch_defer(&deletes, currentEntry->d_name, currentEntry->d_ino, rule, config->sortedDeletes)) {
+                                // Nowhere to keep it: delete it now
+                                denied       = Directory_isDenial(File_clobber(config, currentEntryPath, rule, tally,
+                                                                               statted ? &statBuffer : NULL));
+                                removedHere += tally->files - filesBefore;
+                            }
+                            break;
+                        }
+
+                        u32 returnStatus = File_process(config, currentEntryPath, currentEntry->d_name, tally);
+
+                        removedHere += tally->files - filesBefore;
+                        denied       = Directory_isDenial(returnStatus);
+
+                        unless (returnStatus == ENONE) {
+                            Runtime_verbose(config, "File_process(%s) failed: ERRNO %u\n", currentEntryPath, returnStatus);
+                        }
+                    }
+                    break;
+
+                default:
+                    ++tally->survivors;
+                    break;
+            }
+
+            // Other than directories, whatever stays here (and was not handed to --exec-batch) stays for its own sake
+            if (type != DT_DIR && tally->survivors - survivorsBefore > tally->handedOff - handedOffBefore) {
+                Directory_noteSurvivor(config, path, currentEntry->d_name, type);
+            }
+
+            // A primary that stays keeps its sidecars, whatever its type; one that was clobbered itself does not
+            if (config->sidecarExtensionsLen > 0 && removedHere == removedBefore) {
+                char* extension = strrchr(currentEntry->d_name, '.');
+
+                if (extension && extension != currentEntry->d_name && Configuration_isPrimary(config, extension + 1)) {
+                    SidecarIndex_addPrimary(&sidecars, currentEntry->d_name, extension - currentEntry->d_name);
+                }
+            }
+
+            Arena_release(arena, entryMark);
+
+            if (denied && !lockChecked) {
+                lockChecked = true;
+                locked      = Directory_lockState(dir->fd);
+
+                unless (locked == ENONE) {
+                    Runtime_verbose(config, "Directory %s cannot be modified (ERRNO %u), only descending\n", path, locked);
+
+                    unless (subdirectoriesKnown) {
+                        subdirectoriesLeft  = Directory_countSubdirectories(dir->fd);
+                        subdirectoriesKnown = true;
+                    }
+
+                    /*
+                     * An immutable, append-only or read-only directory cannot be removed from its parent either, so
+                     * it stays whatever else happens. One we may not write to can still be removed once it is
+                     * empty, as that only takes write permission on its parent: it stays if anything in it does.
+                     */
+                    unless (locked == EACCES) {
+                        ++tally->survivors;
+                        Directory_noteSurvivor(config, path, "", DT_DIR);
+                    }
+                }
+            }
+
+            // Nothing left to collapse in here, and this directory stays: the rest of the listing does not matter
+            settled = (config->emptyDirsOnly || locked != ENONE) && tally->survivors > 0 && subdirectoriesLeft == 0;
+        }
+
+        // Entries that could not be read may still be there
+        unless (settled || errno == ENONE) {
+            result = errno;
+        }
+
+        // With part of the listing unread, any sidecar may have a primary that was never seen
+        for (size_t index = 0; index < sidecars.pendingLen; ++index) {
+            char* name = sidecars.names + sidecars.pending[index].offset;
+
+            if (result != ENONE || SidecarIndex_hasPrimary(&sidecars, name) || !File_isOwned(config, dir->fd, name)) {
+                ++tally->survivors;
+                Directory_noteSurvivor(config, path, name, DT_REG);
+            } else {
+                ArenaMark   entryMark   = Arena_mark(arena);
+                u64         filesBefore = tally->files;
+
+                File_clobber(config, Arena_path(arena, path, name), sidecars.pending[index].rule, tally, NULL);
+
+                if (tally->files == filesBefore && !config->execBatch) {
+                    Directory_noteSurvivor(config, path, name, DT_REG);
+                }
+
+                removedHere += tally->files - filesBefore;
+                Arena_release(arena, entryMark);
+            }
+        }
+
+        SidecarIndex_free(&sidecars);
+
+        if (deletes.pendingLen > 0 || deletes.runs > 0) {
+            removedHere += Directory_deletePending(config, dir->fd, path, &deletes, tally);
+        }
+
+        DeleteBatch_free(&deletes);
+
+        if (config->durability && removedHere > 0) {
+            struct stat statBuffer;
+
+            if (fstat(dir->fd, &statBuffer) == 0) {
+                // Below the root, paths are built by the walk; the root is as given
+                Durability_touch(config->durability, path, statBuffer.st_dev, Directory_depth > 1);
+            }
+        }
+
+        Frame_close(arena, dir);
+    } else {
+        result = errno;
+    }
+
+    if (config->summary) {
+        Summary_record(config->summary, path, tally);
+    }
+
+    if (timed) {
+        History_record(config->history, path, tally->entries, History_now() - started);
+    }
+
+    --Directory_depth;
+    
+    return result;
+}
+
+/*
+ * SECTION: Root planning
+ * Make sense of the roots passed on the commandline before walking any of them
+ */
+
+/**
+ * A root that survived planning
+ */
+typedef struct {
+    /*
+     * Path as given on the commandline, and as resolved by realpath()
+     */
+    char*   path;
+    char*   realPath;
+
+    dev_t   device;
+    ino_t   inode;
+    mode_t  mode;
+
+    /*
+     * Rough relative cost of walking the root, used to start big roots first
+     */
+    u64     estimate;
+} Root;
+
+/**
+ * Guess how expensive a root is to walk from its own inode, without reading it.
+ * A directory's size grows with its entry count, and its link count with its subdirectory count
+ * (on filesystems that maintain it, where it is at least 2).
+ */
+static pure u64
+Root_estimate(struct stat* statBuffer) {
+    unless (S_ISDIR(statBuffer->st_mode)) {
+        return 1;
+    }
+
+    u64 subdirectories = (statBuffer->st_nlink >= 2) ? statBuffer->st_nlink - 2 : 0;
+
+    return (u64) statBuffer->st_size + subdirectories * 4096;
+}
+
+static int
+Root_compareRealPaths(const void* left, const void* right) {
+    return strcmp(((const Root*) left)->realPath, ((const Root*) right)->realPath);
+}
+
+static int
+Root_compareEstimates(const void* left, const void* right) {
+    const Root* a = (const Root*) left;
+    const Root* b = (const Root*) right;
+
+    if (a->estimate != b->estimate) {
+        return a->estimate < b->estimate ? 1 : -1;
+    } else {
+        return strcmp(a->realPath, b->realPath);
+    }
+}
+
+/**
+ * Returns true if walking `outer` would reach `inner`.
+ * With --preserve-hidden, the walk stops at hidden directories, so a root below one is still needed.
+ */
+static pure bool
+Root_contains(Configuration* config, Root* outer, Root* inner) {
+    unless (S_ISDIR(outer->mode) && Summary_isAncestor(outer->realPath, inner->realPath)) {
+        return false;
+    }
+
+    if (config->preserveHidden) {
+        const char* rest = inner->realPath + strlen(outer->realPath);
+
+        while (*rest) {
+            while (*rest == '/') {
+                ++rest;
+            }
+
+            // Only directories on the way down matter; the inner root itself is walked regardless
+            const char* end = strchrnul(rest, '/');
+
+            if (*rest == '.' && *end == '/') {
+                return false;
+            }
+
+            rest = end;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Resolve the roots passed on the commandline, drop those that another root already covers
+ * (same inode, or nested inside it) and order the rest most-expensive-first.
+ * Merged and inaccessible roots are reported on stderr.
+ *
+ * @param config    configuration
+ * @param paths     paths passed on the commandline
+ * @param count     number of paths
+ * @param planned   receives the number of roots returned
+ * @return heap-allocated array of roots
+ */
+static Root*
+Root_plan(Configuration* config, char** paths, size_t count, size_t* planned) {
+    Root*   roots = (Root*) malloc((count + 1) * sizeof(Root));
+    size_t  used  = 0;
+
+    for (size_t index = 0; index < count; ++index) {
+        char*       path = paths[index];
+        struct stat statBuffer;
+        char*       realPath;
+
+        if (stat(path, &statBuffer) != 0 || (realPath = realpath(path, NULL)) == NULL) {
+            Runtime_putError("%s does not exist or is not accessible\n", path);
+            continue;
+        }
+
+        roots[used++] = (Root) {
+            .path     = path,
+            .realPath = realPath,
+            .device   = statBuffer.st_dev,
+            .inode    = statBuffer.st_ino,
+            .mode     = statBuffer.st_mode,
+            .estimate = Root_estimate(&statBuffer)
+        };
+
+        // What the last walk saw beats what the inode suggests
+        HistoryEntry* history = config->history ? History_find(config->history, realPath) : NULL;
+
+        if (history) {
+            roots[used - 1].estimate = history->entries * HistoryEntryBytes;
+        }
+    }
+
+    // Ancestors sort before their descendants, so one pass against the roots kept so far suffices
+    qsort(roots, used, sizeof(Root), Root_compareRealPaths);
+
+    size_t kept = 0;
+
+    for (size_t index = 0; index < used; ++index) {
+        Root*   root    = roots + index;
+        bool    merged  = false;
+
+        for (size_t other = 0; other < kept && !merged; ++other) {
+            Root* keeper = roots + other;
+
+            if (keeper->device == root->device && keeper->inode == root->inode) {
+                Runtime_putError("Merged root %s: same file as %s\n", root->path, keeper->path);
+                merged = true;
+            } else if (Root_contains(config, keeper, root)) {
+                Runtime_putError("Merged root %s: inside %s\n", root->path, keeper->path);
+                merged = true;
+            }
+        }
+
+        if (merged) {
+            dispose(root->realPath);
+        } else {
+            roots[kept++] = *root;
+        }
+    }
+
+    qsort(roots, kept, sizeof(Root), Root_compareEstimates);
+
+    *planned = kept;
+    return roots;
+}
+
+/*
+ * SECTION: Blocklist building
+ * --blocklist-build: hash everything under the roots into a blocklist file
+ */
+
+static int
+Blocklist_compareEntries(const void* left, const void* right) {
+    const BlocklistEntry* a = (const BlocklistEntry*) left;
+    const BlocklistEntry* b = (const BlocklistEntry*) right;
+
+    if (a->size != b->size) {
+        return a->size < b->size ? -1 : 1;
+    } else if (a->hash != b->hash) {
+        return a->hash < b->hash ? -1 : 1;
+    } else {
+        return 0;
+    }
+}
+
+typedef struct {
+    BlocklistEntry* entries;
+    size_t          length;
+    size_t          capacity;
+    HashPool*       pool;
+    Configuration*  config;
+} BlocklistBuilder;
+
+static void
+BlocklistBuilder_add(BlocklistBuilder* self, char* path) {
+    struct stat statBuffer;
+    u64         hash;
+
+    if (lstat(path, &statBuffer) != 0) {
+        ErrorLog_report(self->config, "stat", path, errno);
+        return;
+    }
+
+    if (S_ISDIR(statBuffer.st_mode)) {
+        Arena*      arena = Arena_get();
+        Frame*      dir   = Frame_open(arena, path);
+        DirEntry*   entry;
+
+        unless (dir) {
+            ErrorLog_report(self->config, "open directory", path, errno);
+            return;
+        }
+
+        while ((entry = Frame_read(arena, dir))) {
+            if ((strcmp(entry->d_name, ".") == 0) || (strcmp(entry->d_name, "..") == 0)) {
+                continue;
+            }
+
+            ArenaMark mark = Arena_mark(arena);
+            BlocklistBuilder_add(self, Arena_path(arena, path, entry->d_name));
+            Arena_release(arena, mark);
+        }
+
+        Frame_close(arena, dir);
+        return;
+    }
+
+    unless (S_ISREG(statBuffer.st_mode) && statBuffer.st_size > 0) {
+        return;
+    }
+
+    int state = File_hashContent(path, self->pool, &hash);
+
+    unless (state == ENONE) {
+        ErrorLog_report(self->config, "hash", path, state);
+        return;
+    }
+
+    if (self->length == self->capacity) {
+        self->capacity = self->capacity ? self->capacity * 2 : 256;
+        self->entries  = (BlocklistEntry*) realloc(self->entries, self->capacity * sizeof(BlocklistEntry));
+    }
+
+    self->entries[self->length++] = (BlocklistEntry) { statBuffer.st_size, hash };
+}
+
+/**
+ * Write a blocklist of every non-empty regular file under the given paths
+ *
+ * @param config    configuration
+ * @param roots     planned roots
+ * @param count     number of roots
+ * @return errno
+ */
+static int // errno
+Blocklist_build(Configuration* config, Root* roots, size_t count) {
+    BlocklistBuilder builder = { NULL, 0, 0, HashPool_new(Configuration_jobs(config)), config };
+
+    for (size_t index = 0; index < count; ++index) {
+        if (config->errorLog) {
+            ErrorLog_enterRoot(config->errorLog, roots[index].path);
+        }
+
+        BlocklistBuilder_add(&builder, roots[index].path);
+    }
+
+    if (config->errorLog) {
+        ErrorLog_print(config->errorLog, stderr);
+    }
+
+    qsort(builder.entries, builder.length, sizeof(BlocklistEntry), Blocklist_compareEntries);
+
+    size_t unique = 0;
+
+    for (size_t index = 0; index < builder.length; ++index) {
+        if (unique == 0 || Blocklist_compareEntries(builder.entries + unique - 1, builder.entries + index) != 0) {
+            builder.entries[unique++] = builder.entries[index];
+        }
+    }
+
+    FILE* output = fopen(config->blocklistBuildPath, "wb");
+
+    unless (output) {
+        Runtime_putError("Could not open %s: ERRNO %u\n", config->blocklistBuildPath, errno);
+        return errno;
+    }
+
+    u64 unique64 = unique;
+
+    fwrite(BlocklistMagic, sizeof(BlocklistMagic), 1, output);
+    fwrite(&unique64, sizeof(u64), 1, output);
+    fwrite(builder.entries, sizeof(BlocklistEntry), unique, output);
+
+    int result = (fclose(output) == 0) ? ENONE : errno;
+
+    if (result == ENONE) {
+        Runtime_putError("Wrote %zu entries to %s\n", unique, config->blocklistBuildPath);
+    } else {
+        Runtime_putError("Could not write %s: ERRNO %u\n", config->blocklistBuildPath, result);
+    }
+
+    dispose(builder.entries);
+
+    if (builder.pool) {
+        HashPool_free(builder.pool);
+    }
+
+    return result;
+}
+
+/*
+ * SECTION: Survey
+ * Parallel, read-only walk that accounts allocated space by extension
+ */
+
+/**
+ * Number of independently locked shards in the extension table.
+ * Must be a power of two.
+ */
+#define SURVEY_SHARDS 64
+
+/**
+ * Totals for one extension, split by whether the rules would clobber the file
+ */
+typedef struct {
+    char*   extension;  // NULL for an unused slot
+    u64     files[2];   // [0] unmatched, [1] matched
+    u64     bytes[2];
+} SurveyEntry;
+
+typedef struct {
+    pthread_mutex_t lock;
+    SurveyEntry*    entries;
+    size_t          capacity;
+    size_t          used;
+} SurveyShard;
+
+typedef struct {
+    Configuration*  config;
+
+    SurveyShard     shards[SURVEY_SHARDS];
+
+    /*
+     * Directories waiting to be read, and the number of workers currently reading one.
+     * The walk is done when both reach zero.
+     */
+    pthread_mutex_t lock;
+    pthread_cond_t  wake;
+    char**          pending;
+    size_t          pendingLen;
+    size_t          pendingCapacity;
+    size_t          busy;
+
+    /*
+     * Roots, to find the root of a directory for --history, and the directories queued from the history up front
+     * (sorted), which their parents leave alone
+     */
+    Root*           roots;
+    size_t          rootsLen;
+    char**          seeded;
+    size_t          seededLen;
+
+    u64             directories;
+    u64             errors;
+} Survey;
+
+static Survey*
+Survey_new(Configuration* config) {
+    Survey* self = (Survey*) calloc(1, sizeof(Survey));
+
+    self->config          = config;
+    self->pendingCapacity = 64;
+    self->pending         = (char**) malloc(self->pendingCapacity * sizeof(char*));
+
+    pthread_mutex_init(&self->lock, NULL);
+    pthread_cond_init(&self->wake, NULL);
+
+    for (size_t index = 0; index < SURVEY_SHARDS; ++index) {
+        SurveyShard* shard = self->shards + index;
+
+        pthread_mutex_init(&shard->lock, NULL);
+        shard->capacity = 64;
+        shard->entries  = (SurveyEntry*) calloc(shard->capacity, sizeof(SurveyEntry));
+    }
+
+    return self;
+}
+
+static SurveyEntry*
+SurveyShard_slot(SurveyEntry* entries, size_t capacity, u64 hash, const char* extension) {
+    size_t index = hash & (capacity - 1);
+
+    while (entries[index].extension && strcmp(entries[index].extension, extension) != 0) {
+        index = (index + 1) & (capacity - 1);
+    }
+
+    return entries + index;
+}
+
+static void
+SurveyShard_grow(SurveyShard* self) {
+    size_t          capacity = self->capacity * 2;
+    SurveyEntry*    entries  = (SurveyEntry*) calloc(capacity, sizeof(SurveyEntry));
+
+    for (size_t index = 0; index < self->capacity; ++index) {
+        if (self->entries[index].extension) {
+            u64 hash = String_hash(self->entries[index].extension, strlen(self->entries[index].extension));
+            *SurveyShard_slot(entries, capacity, hash, self->entries[index].extension) = self->entries[index];
+        }
+    }
+
+    dispose(self->entries);
+    self->entries  = entries;
+    self->capacity = capacity;
+}
+
+/**
+ * Account one file
+ *
+ * @param self      survey
+ * @param extension extension, or "" for none
+ * @param matched   whether the rules would clobber the file
+ * @param bytes     allocated bytes
+ */
+static hot void
+Survey_account(Survey* self, const char* extension, bool matched, u64 bytes) {
+    u64             hash  = String_hash(extension, strlen(extension));
+    SurveyShard*    shard = self->shards + ((hash >> 32) & (SURVEY_SHARDS - 1));
+
+    pthread_mutex_lock(&shard->lock);
+
+    SurveyEntry* entry = SurveyShard_slot(shard->entries, shard->capacity, hash, extension);
+
+    unless (entry->extension) {
+        if ((shard->used + 1) * 2 > shard->capacity) {
+            SurveyShard_grow(shard);
+            entry = SurveyShard_slot(shard->entries, shard->capacity, hash, extension);
+        }
+
+        entry->extension = strdup(extension);
+        ++shard->used;
+    }
+
+    ++entry->files[matched];
+    entry->bytes[matched] += bytes;
+
+    pthread_mutex_unlock(&shard->lock);
+}
+
+/**
+ * Queue directories for the workers
+ *
+ * @param self  survey
+ * @param paths heap-allocated paths, ownership is taken
+ * @param count number of paths
+ */
+static void
+Survey_push(Survey* self, char** paths, size_t count) {
+    if (count == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&self->lock);
+
+    if (self->pendingLen + count > self->pendingCapacity) {
+        while (self->pendingLen + count > self->pendingCapacity) {
+            self->pendingCapacity *= 2;
+        }
+
+        self->pending = (char**) realloc(self->pending, self->pendingCapacity * sizeof(char*));
+    }
+
+    memcpy(self->pending + self->pendingLen, paths, count * sizeof(char*));
+    self->pendingLen += count;
+
+    if (count == 1) {
+        pthread_cond_signal(&self->wake);
     } else {
-        // pick RMDIR or UNLINK
-        struct stat statBuffer;
-        stat(path, &statBuffer);
+        pthread_cond_broadcast(&self->wake);
+    }
+
+    pthread_mutex_unlock(&self->lock);
+}
+
+/**
+ * Account for a file, given the directory holding it
+ *
+ * @param self  survey
+ * @param dirFd directory holding the file
+ * @param name  file name
+ * @param type  d_type of the entry, or DT_UNKNOWN
+ */
+static hot void
+Survey_file(Survey* self, int dirFd, char* name, unsigned char type) {
+    Configuration*  config = self->config;
+    struct statx    statBuffer;
+    u64             bytes  = 0;
+
+    if (statx(dirFd, name, AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT | AT_STATX_DONT_SYNC,
+              STATX_BLOCKS | STATX_TYPE | STATX_UID | STATX_GID, &statBuffer) == 0) {
+        bytes = statBuffer.stx_blocks * 512;
+    } else {
+        __atomic_add_fetch(&self->errors, 1, __ATOMIC_RELAXED);
+        statBuffer.stx_mask = 0;
+    }
+
+    bool special = type != DT_REG && type != DT_UNKNOWN;
+    bool owned   = (config->owner == (uid_t) -1 || ((statBuffer.stx_mask & STATX_UID) && statBuffer.stx_uid == config->owner))
+                && (config->group == (gid_t) -1 || ((statBuffer.stx_mask & STATX_GID) && statBuffer.stx_gid == config->group));
+    bool matched = owned && !(special && config->preserveSpecial) && File_matchRule(config, name) != NO_RULE;
+
+    char* extensionStart = strrchr(name, '.');
+
+    Survey_account(self, extensionStart ? extensionStart + 1 : "", matched, bytes);
+}
+
+/**
+ * Returns the innermost root that a directory was reached from
+ */
+static Root*
+Survey_rootOf(Survey* self, const char* path) {
+    Root*   found       = NULL;
+    size_t  foundLength = 0;
+
+    for (size_t index = 0; index < self->rootsLen; ++index) {
+        Root*   root    = self->roots + index;
+        size_t  length  = strlen(root->path);
+
+        if (length >= foundLength && strncmp(root->path, path, length) == 0
+            && (path[length] == '/' || path[length] == '\0' || (length > 0 && root->path[length - 1] == '/'))) {
+            found       = root;
+            foundLength = length;
+        }
+    }
+
+    return found;
+}
+
+/**
+ * Read one directory, accounting its files and queueing its subdirectories
+ */
+static hot void
+Survey_directory(Survey* self, char* path) {
+    Configuration*  config = self->config;
+    Arena*          arena  = Arena_get();
+    Frame*          dir    = Frame_open(arena, path);
+
+    unless (dir) {
+        int     error   = errno;
+        Root*   root    = Survey_rootOf(self, path);
+
+        ErrorLog_reportUnder(config, root ? root->path : NULL, "open directory", path, error);
+        __atomic_add_fetch(&self->errors, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    int fd = dir->fd;
+
+    __atomic_add_fetch(&self->directories, 1, __ATOMIC_RELAXED);
+
+    char**      children         = NULL;
+    size_t      childrenLen      = 0;
+    size_t      childrenCapacity = 0;
+    DirEntry*   currentEntry     = NULL;
+    u64         entries          = 0;
+    u64         started          = config->history ? History_now() : 0;
+
+    while ((currentEntry = Frame_read(arena, dir))) {
+        char*           name = currentEntry->d_name;
+        unsigned char   type = currentEntry->d_type;
+
+        if ((strcmp(name, ".") == 0) || (strcmp(name, "..") == 0)) {
+            continue;
+        }
 
-        if (S_ISDIR(statBuffer.st_mode)) {
-            return rmdir(path);
+        ++entries;
+
+        if (type == DT_UNKNOWN) {
+            struct stat statBuffer;
+
+            if (fstatat(fd, name, &statBuffer, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(statBuffer.st_mode)) {
+                type = DT_DIR;
+            }
+        }
+
+        if (type == DT_DIR) {
+            if (config->preserveHidden && File_isHidden(name)) {
+                continue;
+            }
+
+            if (childrenLen == childrenCapacity) {
+                childrenCapacity = childrenCapacity ? childrenCapacity * 2 : 16;
+                children         = (char**) realloc(children, childrenCapacity * sizeof(char*));
+            }
+
+            asprintf(children + childrenLen++, "%s/%s", path, name);
+
+            // Already queued from the history
+            if (self->seededLen > 0 && bsearch(children + childrenLen - 1, self->seeded, self->seededLen, sizeof(char*), RuleSet_compare)) {
+                --childrenLen;
+                dispose(children[childrenLen]);
+            }
         } else {
-            return unlink(path);
+            Survey_file(self, fd, name, type);
+        }
+    }
+
+    Frame_close(arena, dir);
+
+    if (config->history) {
+        Root* root = Survey_rootOf(self, path);
+
+        if (root) {
+            History_add(config->history, root->path, root->realPath, path, entries, History_now() - started);
+        }
+    }
+
+    // Queued paths are handed to other threads, so they come from malloc() rather than the arena
+    Survey_push(self, children, childrenLen);
+    dispose(children);
+}
+
+static void*
+Survey_worker(void* context) {
+    Survey* self    = (Survey*) context;
+    bool    online  = RuleSet_online();
+
+    pthread_mutex_lock(&self->lock);
+
+    for (;;) {
+        while (self->pendingLen == 0 && self->busy > 0) {
+            pthread_cond_wait(&self->wake, &self->lock);
+        }
+
+        if (self->pendingLen == 0) {
+            break;
+        }
+
+        char* path = self->pending[--self->pendingLen];
+        ++self->busy;
+
+        pthread_mutex_unlock(&self->lock);
+        Survey_directory(self, path);
+        dispose(path);
+        RuleSet_quiesce();
+        pthread_mutex_lock(&self->lock);
+
+        if (--self->busy == 0 && self->pendingLen == 0) {
+            pthread_cond_broadcast(&self->wake);
+        }
+    }
+
+    pthread_mutex_unlock(&self->lock);
+
+    if (online) {
+        RuleSet_offline();
+    }
+
+    Arena_retire();
+
+    return NULL;
+}
+
+static int
+Survey_compareEntries(const void* left, const void* right) {
+    const SurveyEntry* a = (const SurveyEntry*) left;
+    const SurveyEntry* b = (const SurveyEntry*) right;
+    u64 totalA = a->bytes[0] + a->bytes[1];
+    u64 totalB = b->bytes[0] + b->bytes[1];
+
+    if (totalA != totalB) {
+        return totalA < totalB ? 1 : -1;
+    } else {
+        return strcmp(a->extension, b->extension);
+    }
+}
+
+/**
+ * Print the extension table, largest first
+ */
+static cold void
+Survey_print(Survey* self, FILE* stream) {
+    size_t count = 0;
+
+    for (size_t index = 0; index < SURVEY_SHARDS; ++index) {
+        count += self->shards[index].used;
+    }
+
+    SurveyEntry*    sorted = (SurveyEntry*) malloc((count + 1) * sizeof(SurveyEntry));
+    SurveyEntry     total  = { 0 };
+    size_t          used   = 0;
+
+    for (size_t index = 0; index < SURVEY_SHARDS; ++index) {
+        SurveyShard* shard = self->shards + index;
+
+        for (size_t slot = 0; slot < shard->capacity; ++slot) {
+            if (shard->entries[slot].extension) {
+                sorted[used++] = shard->entries[slot];
+            }
+        }
+    }
+
+    qsort(sorted, count, sizeof(SurveyEntry), Survey_compareEntries);
+
+    fprintf(stream, "%-16s %12s %16s %12s %16s\n", "extension", "files", "allocated", "matched", "matched bytes");
+
+    for (size_t index = 0; index < count; ++index) {
+        SurveyEntry* entry = sorted + index;
+
+        fprintf(stream, "%-16s %12llu %16llu %12llu %16llu\n",
+                *entry->extension ? entry->extension : "(none)",
+                entry->files[0] + entry->files[1], entry->bytes[0] + entry->bytes[1],
+                entry->files[1], entry->bytes[1]);
+
+        for (int matched = 0; matched < 2; ++matched) {
+            total.files[matched] += entry->files[matched];
+            total.bytes[matched] += entry->bytes[matched];
+        }
+    }
+
+    fprintf(stream, "%-16s %12llu %16llu %12llu %16llu\n", "(total)",
+            total.files[0] + total.files[1], total.bytes[0] + total.bytes[1], total.files[1], total.bytes[1]);
+    fprintf(stream, "\n%llu directories read, %llu errors\n", self->directories, self->errors);
+
+    dispose(sorted);
+}
+
+static int
+Survey_compareWeights(const void* left, const void* right) {
+    u64 a = ((const HistoryEntry*) left)->micros;
+    u64 b = ((const HistoryEntry*) right)->micros;
+
+    return (a > b) - (a < b);
+}
+
+/**
+ * Queue the subtrees that took the biggest share of the last walk, so that workers split them from the start
+ * rather than when the walk gets to them. They are queued after the roots and smallest first, so that the
+ * biggest is taken first. Their parents leave them out when they are read.
+ *
+ * @param self      survey
+ * @param jobs      number of workers
+ */
+static void
+Survey_seed(Survey* self, u32 jobs) {
+    Configuration*  config      = self->config;
+    History*        history     = config->history;
+    u64             total[2]    = { 0, 0 };     // [0] entries, [1] micros
+
+    for (size_t index = 0; index < self->rootsLen; ++index) {
+        HistoryEntry* entry = S_ISDIR(self->roots[index].mode) ? History_find(history, self->roots[index].realPath) : NULL;
+
+        if (entry) {
+            total[0] += entry->entries;
+            total[1] += entry->micros;
+        }
+    }
+
+    // Durations are what the workers wait on; entries stand in for them when none were recorded
+    bool            byTime      = total[1] > 0;
+    u64             threshold   = total[byTime] / (HistorySplitShare * jobs);
+    HistoryEntry*   candidates  = (HistoryEntry*) malloc((history->used + 1) * sizeof(HistoryEntry));
+    size_t          found       = 0;
+
+    if (total[byTime] == 0) {
+        dispose(candidates);
+        return;
+    }
+
+    for (size_t slot = 0; slot < history->capacity; ++slot) {
+        HistoryEntry* entry = history->entries + slot;
+
+        unless (entry->path && (byTime ? entry->micros : entry->entries) >= threshold) {
+            continue;
+        }
+
+        for (size_t index = 0; index < self->rootsLen; ++index) {
+            Root* root = self->roots + index;
+
+            unless (S_ISDIR(root->mode) && Summary_isAncestor(root->realPath, entry->path)) {
+                continue;
+            }
+
+            const char* relative    = entry->path + strlen(root->realPath);
+            bool        usable      = true;
+            struct stat statBuffer;
+
+            while (*relative == '/') {
+                ++relative;
+            }
+
+            // Hidden directories are not walked with --preserve-hidden
+            for (const char* component = relative; *component && usable; component = strchrnul(component, '/')) {
+                while (*component == '/') {
+                    ++component;
+                }
+
+                usable = !(config->preserveHidden && File_isHidden((char*) component));
+            }
+
+            char* walked = NULL;
+
+            asprintf(&walked, "%s/%s", root->path, relative);
+
+            if (usable && History_depth(root->path, walked) <= HistoryDepth
+                && lstat(walked, &statBuffer) == 0 && S_ISDIR(statBuffer.st_mode)) {
+                candidates[found]          = *entry;
+                candidates[found].path     = walked;
+                candidates[found++].micros = byTime ? entry->micros : entry->entries;
+            } else {
+                dispose(walked);
+            }
+
+            break;
         }
     }
+
+    qsort(candidates, found, sizeof(HistoryEntry), Survey_compareWeights);
+
+    self->seeded    = (char**) malloc((found + 1) * sizeof(char*));
+    self->seededLen = found;
+
+    for (size_t index = 0; index < found; ++index) {
+        self->seeded[index] = strdup(candidates[index].path);
+
+        Runtime_verbose(config, "Queueing %s up front\n", candidates[index].path);
+        Survey_push(self, &candidates[index].path, 1);
+    }
+
+    qsort(self->seeded, self->seededLen, sizeof(char*), RuleSet_compare);
+    dispose(candidates);
 }
 
 /**
- * Returns true if a file should be clobbered according to the configuration
+ * Survey the given roots with `config->jobs` threads and print the table
  *
  * @param config    configuration
- * @param basename  file name
+ * @param roots     planned roots
+ * @param count     number of roots
  */
-static hot pure bool
-File_shouldClobber(Configuration* config, char* basename) {
-    if (Configuration_shouldClobberName(config, basename)) {
-        return true;
-    } else {
-        // Get the file's extension, if present.
-        char* extensionStart = strrchr(basename, '.');
+static int // errno
+Survey_run(Configuration* config, Root* roots, size_t count) {
+    Survey* self = Survey_new(config);
+    u32     jobs = Configuration_jobs(config);
+
+    self->roots    = roots;
+    self->rootsLen = count;
 
-        if (extensionStart) {
-            return Configuration_shouldClobberExtension(config, ++extensionStart);
+    // Workers take the most recently queued directory first, so queue the cheapest root first
+    for (size_t index = count; index-- > 0;) {
+        if (config->history && S_ISDIR(roots[index].mode)) {
+            History_enterRoot(config->history, roots[index].path, roots[index].realPath);
+        }
+
+        char* root = roots[index].path;
+
+        if (S_ISDIR(roots[index].mode)) {
+            char* copy = strdup(root);
+            Survey_push(self, &copy, 1);
         } else {
-            return false;
+            char*   directoryCopy = strdup(root);
+            char*   nameCopy      = strdup(root);
+            int     dirFd         = open(dirname(directoryCopy), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+            Survey_file(self, dirFd, basename(nameCopy), S_ISREG(roots[index].mode) ? DT_REG : DT_UNKNOWN);
+
+            if (dirFd != -1) {
+                close(dirFd);
+            }
+
+            dispose(directoryCopy);
+            dispose(nameCopy);
+        }
+    }
+
+    if (config->history) {
+        Survey_seed(self, jobs);
+    }
+
+    pthread_t* threads = (pthread_t*) malloc(jobs * sizeof(pthread_t));
+
+    for (u32 index = 0; index < jobs; ++index) {
+        if (pthread_create(threads + index, NULL, Survey_worker, self) != 0) {
+            jobs = index;
+            break;
+        }
+    }
+
+    // Help out, which also guarantees progress if no thread could be started
+    Survey_worker(self);
+
+    // Waiting, this thread must not hold back the workers' reloads
+    RuleSet_offline();
+
+    for (u32 index = 0; index < jobs; ++index) {
+        pthread_join(threads[index], NULL);
+    }
+
+    RuleSet_online();
+
+    dispose(threads);
+    Survey_print(self, stdout);
+
+    if (config->history) {
+        int historyState = History_save(config->history, config->historyPath);
+
+        unless (historyState == ENONE) {
+            Runtime_putError("Could not save history to %s: ERRNO %u\n", config->historyPath, historyState);
         }
     }
+
+    return ENONE;
+}
+
+/*
+ * SECTION: Estimate
+ * Knuth's estimator of tree size: follow random paths from the root, weighting what each directory holds by the
+ * product of the branching factors above it. Every probe is an unbiased estimate; their spread gives the interval.
+ */
+
+static const u32 EstimateDefaultProbes = 2000;
+
+typedef enum {
+    ESTIMATE_DIRECTORIES,
+    ESTIMATE_ENTRIES,
+    ESTIMATE_MATCHES,
+    ESTIMATE_BYTES,
+    ESTIMATE_QUANTITIES
+} EstimateQuantity;
+
+static const char* EstimateQuantityNames[ESTIMATE_QUANTITIES] = {
+    "directories", "entries", "matched files", "matched bytes"
+};
+
+typedef struct {
+    u64     state;
+    u64     probes;
+    u64     directoriesRead;
+    u64     entriesRead;
+    double  seconds;
+
+    /*
+     * Directories read so far, and the entries and time of their first reads, which the walk time is projected from
+     */
+    StringSet   visited;
+    u64         firstEntries;
+    double      firstSeconds;
+
+    double  sums[ESTIMATE_QUANTITIES];
+    double  squares[ESTIMATE_QUANTITIES];
+    double  means[ESTIMATE_QUANTITIES];
+    double  variances[ESTIMATE_QUANTITIES];
+} Estimate;
+
+static double
+Estimate_now() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
 }
 
 /**
- * Returns true if a file is hidden (name begins with `.`)
- *
- * @param basename  file name 
+ * xorshift64*; uniform enough for picking children
  */
-static pure bool 
-File_isHidden(char* basename) {
-    return (basename - strchrnul(basename, '.')) == 0;
+static u64
+Estimate_random(Estimate* self) {
+    self->state ^= self->state >> 12;
+    self->state ^= self->state << 25;
+    self->state ^= self->state >> 27;
+    return self->state * 2685821657736338717ULL;
 }
 
 /**
- * Returns true if a directory is empty
+ * List one directory of a probe: count what it holds and return the names of its subdirectories
  *
- * @param dir   directory (must be opened/closed by the caller)
+ * @param self      estimate
+ * @param config    configuration
+ * @param arena     arena of the calling thread; names are allocated from it
+ * @param path      directory
+ * @param counts    receives entries, matches and bytes for this directory
+ * @param children  receives subdirectory names
+ * @return number of subdirectories
  */
-static pure bool 
-Directory_isEmpty(char* path) {
-    Directory* dir = opendir(path);
+static size_t
+Estimate_list(Estimate* self, Configuration* config, Arena* arena, const char* path, double* counts, char*** children) {
+    Frame*      dir             = Frame_open(arena, path);
+    DirEntry*   entry;
+    size_t      childrenLen     = 0;
+    size_t      childrenSize    = 16;
 
-    if (dir) {
-        u32         index = 0;
-        DirEntry*   entry = NULL;
+    *children = (char**) Arena_alloc(arena, childrenSize * sizeof(char*));
 
-        while (entry = readdir(dir)) {
-            // Account for `.` and `..`
-            if (++index > 2) {
-                break;
+    unless (dir) {
+        return 0;
+    }
+
+    ++self->directoriesRead;
+
+    while ((entry = Frame_read(arena, dir))) {
+        if ((strcmp(entry->d_name, ".") == 0) || (strcmp(entry->d_name, "..") == 0)) {
+            continue;
+        }
+
+        ++self->entriesRead;
+        ++counts[ESTIMATE_ENTRIES];
+
+        unsigned char   type = entry->d_type;
+        struct stat     statBuffer;
+
+        if (type == DT_UNKNOWN && fstatat(dir->fd, entry->d_name, &statBuffer, AT_SYMLINK_NOFOLLOW) == 0) {
+            type = S_ISDIR(statBuffer.st_mode) ? DT_DIR : DT_REG;
+        }
+
+        if (type == DT_DIR) {
+            if (config->preserveHidden && File_isHidden(entry->d_name)) {
+                continue;
+            }
+
+            if (childrenLen == childrenSize) {
+                char** grown = (char**) Arena_alloc(arena, childrenSize * 2 * sizeof(char*));
+
+                memcpy(grown, *children, childrenSize * sizeof(char*));
+                *children     = grown;
+                childrenSize *= 2;
+            }
+
+            size_t nameLength = strlen(entry->d_name);
+
+            (*children)[childrenLen] = (char*) Arena_alloc(arena, nameLength + 1);
+            memcpy((*children)[childrenLen++], entry->d_name, nameLength + 1);
+        } else if (File_matchRule(config, entry->d_name) != NO_RULE) {
+            ++counts[ESTIMATE_MATCHES];
+
+            if (fstatat(dir->fd, entry->d_name, &statBuffer, AT_SYMLINK_NOFOLLOW) == 0) {
+                counts[ESTIMATE_BYTES] += statBuffer.st_blocks * 512.0;
             }
         }
+    }
+
+    Frame_close(arena, dir);
+    return childrenLen;
+}
+
+/**
+ * One probe: descend from `root` to a leaf, picking a subdirectory uniformly at random at every level
+ *
+ * @param self      estimate
+ * @param config    configuration
+ * @param root      root directory
+ */
+static void
+Estimate_probe(Estimate* self, Configuration* config, const char* root) {
+    Arena*      arena                          = Arena_get();
+    ArenaMark   mark                           = Arena_mark(arena);
+    double      weight                         = 1;
+    double      totals[ESTIMATE_QUANTITIES]    = { 0 };
+    const char* path                           = root;
+
+    for (;;) {
+        double  counts[ESTIMATE_QUANTITIES] = { 0 };
+        char**  children;
+        double  listed                      = Estimate_now();
+        size_t  childrenLen                 = Estimate_list(self, config, arena, path, counts, &children);
+
+        // Later probes read the levels near the root again, from the cache, where the walk reads them once
+        if (StringSet_add(&self->visited, path, strlen(path))) {
+            self->firstSeconds += Estimate_now() - listed;
+            self->firstEntries += counts[ESTIMATE_ENTRIES];
+        }
+
+        counts[ESTIMATE_DIRECTORIES] = 1;
+
+        for (int quantity = 0; quantity < ESTIMATE_QUANTITIES; ++quantity) {
+            totals[quantity] += weight * counts[quantity];
+        }
+
+        if (childrenLen == 0) {
+            break;
+        }
+
+        weight *= childrenLen;
+        path    = Arena_path(arena, path, children[Estimate_random(self) % childrenLen]);
+    }
 
-        closedir(dir);
+    for (int quantity = 0; quantity < ESTIMATE_QUANTITIES; ++quantity) {
+        self->sums[quantity]    += totals[quantity];
+        self->squares[quantity] += totals[quantity] * totals[quantity];
+    }
+
+    ++self->probes;
+    Arena_release(arena, mark);
+}
+
+/**
+ * Fold the probes of one root into the estimate and start over for the next root.
+ * Roots are disjoint, so their estimates add up, and so do the variances of those estimates.
+ *
+ * @param self      estimate
+ * @param probes    number of probes made of the root
+ */
+static void
+Estimate_finishRoot(Estimate* self, u32 probes) {
+    for (int quantity = 0; quantity < ESTIMATE_QUANTITIES; ++quantity) {
+        double mean     = self->sums[quantity] / probes;
+        double variance = (probes > 1) ? (self->squares[quantity] - probes * mean * mean) / (probes - 1) : 0;
 
-        return index <= 2;
-    } else {
-        Runtime_putError("Directory_isEmpty(%s): could not open directory: ERRNO %u\n", path, errno);
-        return false;
+        self->means[quantity]     += mean;
+        self->variances[quantity] += (variance > 0 ? variance : 0) / probes;
+        self->sums[quantity]       = 0;
+        self->squares[quantity]    = 0;
     }
 }
 
-static hot pure int // errno 
-File_process(Configuration* config, char* path) {
-    char* pathCopy = strdup(path);
-    char* fileName = basename(pathCopy);
-    
-    bool shouldClobber = File_shouldClobber(config, fileName);
-    
-    dispose(pathCopy);
+/**
+ * Print each quantity with a 95% interval, then the projected walk time
+ */
+static cold void
+Estimate_print(Estimate* self, FILE* stream) {
+    double margins[ESTIMATE_QUANTITIES];
 
-    if (shouldClobber) {
-        if (File_unlink(config, path) == -1) {
-            Runtime_putError("Could not unlink %s: ERRNO %u\n", path, errno);
-            return errno;
-        } else {
-            return ENONE;
-        }
-    } else {
-        return ENONE;
+    fprintf(stream, "%-16s %16s %16s %16s\n", "quantity", "estimate", "low", "high");
+
+    for (int quantity = 0; quantity < ESTIMATE_QUANTITIES; ++quantity) {
+        double mean = self->means[quantity];
+
+        margins[quantity] = 1.96 * sqrt(self->variances[quantity] > 0 ? self->variances[quantity] : 0);
+
+        fprintf(stream, "%-16s %16.0f %16.0f %16.0f\n", EstimateQuantityNames[quantity], mean,
+                (mean > margins[quantity]) ? mean - margins[quantity] : 0, mean + margins[quantity]);
     }
-}
 
-static hot pure int // errno 
-Directory_process(Configuration* config, char* path) {
-    Directory*  dir     = opendir(path);
-    u32         result  = ENONE;
-    
-    if (dir) {
-        DirEntry* currentEntry = NULL;
+    // The probes read directories the way the walk would, so the rate of their first reads carries over
+    double entries  = self->means[ESTIMATE_ENTRIES];
+    double margin   = margins[ESTIMATE_ENTRIES];
+    double perEntry = self->firstEntries ? self->firstSeconds / self->firstEntries : 0;
 
-        while (currentEntry = readdir(dir)) {
-            if ((strcmp(currentEntry->d_name, ".") == 0) || (strcmp(currentEntry->d_name, "..") == 0)) {
-                continue;
-            }
+    fprintf(stream, "%-16s %16.2f %16.2f %16.2f\n", "walk seconds",
+            entries * perEntry, (entries > margin) ? (entries - margin) * perEntry : 0, (entries + margin) * perEntry);
 
-            char* currentEntryPath;
-            {
-                asprintf(&currentEntryPath, "%s/%s", path, currentEntry->d_name);
-            }
-            
-            switch (currentEntry->d_type) {
-                case DT_DIR: 
-                    unless (config->preserveHidden && File_isHidden(currentEntry->d_name)) {
-                        u32 completionState = Directory_process(config, currentEntryPath);
+    fprintf(stream, "\n%llu probes, %llu directories read (%zu distinct) in %.2fs\n",
+            (unsigned long long) self->probes, (unsigned long long) self->directoriesRead, self->visited.length,
+            self->seconds);
+}
 
-                        if (completionState == ENONE) {
-                            if (Directory_isEmpty(currentEntryPath)) {
-                                if (File_unlink(config, currentEntryPath) == -1) {
-                                    Runtime_putError("Could not unlink directory %s: ERRNO %u\n", currentEntryPath, errno);
-                                }
-                            } else {
-                                Runtime_verbose(config, "Directory %s is not empty. Not unlinking.\n", currentEntryPath);
-                            }
-                        } else {
-                            Runtime_putError("Could not process directory %s: ERRNO %u\n", currentEntryPath, completionState);
-                        }
-                    }
-                    break;
+/**
+ * Estimate a run over the given roots and print the estimate
+ *
+ * @param config    configuration
+ * @param roots     planned roots
+ * @param count     number of roots
+ */
+static int // errno
+Estimate_run(Configuration* config, Root* roots, size_t count) {
+    Estimate    self     = { 0 };
+    u64         dirRoots = 0;
+    double      started  = Estimate_now();
 
-                /*
-                 * Allow custom handling "for special" files 
-                 * Usually, a lot of these are synthetic and can be removed without concern
-                 */
-                case DT_BLK:
-                case DT_CHR:
-                case DT_FIFO:
-                case DT_LNK: 
-                case DT_SOCK:
-                    if (config->preserveSpecial) {
-                        break;
-                    }
+    self.state = ((u64) started * 1000003) ^ ((u64) getpid() << 32) ^ 0x9E3779B97F4A7C15ULL;
 
-                /*
-                 * Several filesystems will return DT_UNKOWN as they do not implement d_type support
-                 * as such, it should be treated as DT_REG.
-                 */
-                case DT_UNKNOWN:
-                case DT_REG: {
-                        u32 returnStatus = File_process(config, currentEntryPath);
+    for (size_t index = 0; index < count; ++index) {
+        unless (S_ISDIR(roots[index].mode)) {
+            continue;
+        }
 
-                        unless (returnStatus == ENONE) {
-                            Runtime_verbose(config, "File_process(%s) failed: ERRNO %u\n", currentEntryPath, returnStatus);
-                        }
-                    }
-                    break;
-            }
+        ++dirRoots;
 
-            dispose(currentEntryPath);
+        for (u32 probe = 0; probe < config->estimateProbes; ++probe) {
+            Estimate_probe(&self, config, roots[index].path);
         }
 
-        closedir(dir);
-    } else {
-        result = errno;
+        Estimate_finishRoot(&self, config->estimateProbes);
     }
-    
-    return result;
+
+    self.seconds = Estimate_now() - started;
+
+    if (dirRoots == 0) {
+        Runtime_putError("--estimate needs at least one directory\n");
+        return EINVAL;
+    }
+
+    Estimate_print(&self, stdout);
+    StringSet_free(&self.visited);
+    return ENONE;
 }
 
 /**
@@ -493,6 +8038,16 @@ main (int argc, char** argv) {
     char* const imageName = *argv;
     Configuration* runtimeConfig = Configuration_new();
 
+    {
+        bool malformed;
+
+        runtimeConfig->execBatch = ExecBatch_extract(&argc, argv, &malformed);
+
+        if (malformed) {
+            return EINVAL;
+        }
+    }
+
     {
         int optionOrd;
 
@@ -526,10 +8081,165 @@ main (int argc, char** argv) {
                     break;
                 case RUN_SIMULATE:
                     runtimeConfig->simulate = true;
+
+                    if (optarg == NULL || strcmp(optarg, "lines") == 0) {
+                        runtimeConfig->simulateFormat = SIMULATE_LINES;
+                    } else if (strcmp(optarg, "summary") == 0) {
+                        runtimeConfig->simulateFormat = SIMULATE_SUMMARY;
+                    } else if (strcmp(optarg, "json") == 0) {
+                        runtimeConfig->simulateFormat = SIMULATE_JSON;
+                    } else {
+                        Runtime_putError("Unknown --simulate format `%s`\n", optarg);
+                        return EINVAL;
+                    }
                     break;
                 case VERBOSE_LOGGING:
                     runtimeConfig->verbose = true;
                     break;
+                case PROFILE_RULES:
+                    runtimeConfig->profileRules = true;
+                    break;
+                case RUN_ESTIMATE:
+                    if (optarg && atoi(optarg) <= 0) {
+                        Runtime_putError("--estimate requires a positive number of probes\n");
+                        return EINVAL;
+                    }
+
+                    runtimeConfig->estimateProbes = optarg ? (u32) atoi(optarg) : EstimateDefaultProbes;
+                    break;
+                case WHY_DIRTY:
+                    runtimeConfig->whyDirty = WhyDirty_new();
+                    break;
+                case TOMBSTONE:
+                    if (optarg && atoi(optarg) <= 0) {
+                        Runtime_putError("--tombstone requires a positive depth\n");
+                        return EINVAL;
+                    }
+
+                    runtimeConfig->tombstoneDepth = optarg ? (u32) atoi(optarg) : 1;
+                    break;
+                case NOTIFY:
+                    runtimeConfig->notifyPath = optarg;
+                    break;
+                case NOTIFY_INTERVAL:
+                    if (atoi(optarg) <= 0) {
+                        Runtime_putError("--notify-interval requires a positive number of seconds\n");
+                        return EINVAL;
+                    }
+
+                    runtimeConfig->notifyInterval = atoi(optarg);
+                    break;
+                case RULES_FILE:
+                    runtimeConfig->rulesPath = optarg;
+                    runtimeConfig->rules     = RuleSet_load(optarg);
+
+                    unless (runtimeConfig->rules) {
+                        Runtime_putError("Could not load rules from %s: ERRNO %u\n", optarg, errno);
+                        return errno;
+                    }
+                    break;
+                case DESTROY_SUBVOLUMES:
+                    runtimeConfig->destroySubvolumes = true;
+                    break;
+                case OWNER: {
+                        struct passwd*  user    = getpwnam(optarg);
+                        char*           end;
+
+                        if (user) {
+                            runtimeConfig->owner = user->pw_uid;
+                        } else {
+                            runtimeConfig->owner = (uid_t) strtoul(optarg, &end, 10);
+
+                            if (*optarg == '\0' || *end != '\0') {
+                                Runtime_putError("--owner: no such user %s\n", optarg);
+                                return EINVAL;
+                            }
+                        }
+                    }
+                    break;
+                case GROUP: {
+                        struct group*   group   = getgrnam(optarg);
+                        char*           end;
+
+                        if (group) {
+                            runtimeConfig->group = group->gr_gid;
+                        } else {
+                            runtimeConfig->group = (gid_t) strtoul(optarg, &end, 10);
+
+                            if (*optarg == '\0' || *end != '\0') {
+                                Runtime_putError("--group: no such group %s\n", optarg);
+                                return EINVAL;
+                            }
+                        }
+                    }
+                    break;
+                case HOMOGENEOUS_OWNERS:
+                    runtimeConfig->homogeneousOwners = true;
+                    break;
+                case HISTORY:
+                    runtimeConfig->historyPath = optarg;
+                    runtimeConfig->history     = History_load(optarg);
+
+                    unless (runtimeConfig->history) {
+                        Runtime_putError("Could not load history from %s: ERRNO %u\n", optarg, errno);
+                        return errno;
+                    }
+                    break;
+                case SORTED_DELETES:
+                    if (optarg && (atoi(optarg) <= 0 || atoi(optarg) >= 4096)) {
+                        Runtime_putError("--sorted-deletes requires a size between 1 and 4095 MiB\n");
+                        return EINVAL;
+                    }
+
+                    runtimeConfig->sortedDeletes = (size_t) (optarg ? atoi(optarg) : 64) << 20;
+                    break;
+                case RUN_SURVEY:
+                    runtimeConfig->survey = true;
+                    break;
+                case DURABLE:
+                    runtimeConfig->durability = Durability_new();
+                    break;
+                case PRINT_STATS:
+                    runtimeConfig->stats = true;
+                    break;
+                case EMPTY_DIRS_ONLY:
+                    runtimeConfig->emptyDirsOnly = true;
+                    break;
+                case ORPHAN_SIDECARS:
+                    Configuration_appendList(&runtimeConfig->sidecarExtensions, &runtimeConfig->sidecarExtensionsLen, optarg);
+                    break;
+                case CLOBBER_ZERO:
+                    runtimeConfig->clobberZero = true;
+                    break;
+                case BLOCKLIST:
+                    runtimeConfig->blocklistPath = optarg;
+                    runtimeConfig->blocklist     = Blocklist_open(optarg);
+
+                    unless (runtimeConfig->blocklist) {
+                        Runtime_putError("Could not load blocklist %s: ERRNO %u\n", optarg, errno);
+                        return errno;
+                    }
+                    break;
+                case BLOCKLIST_BUILD:
+                    runtimeConfig->blocklistBuildPath = optarg;
+                    break;
+                case PLAN:
+                    runtimeConfig->planPath = optarg;
+                    break;
+                case APPLY:
+                    runtimeConfig->applyPath = optarg;
+                    break;
+                case PRIMARY_EXT:
+                    Configuration_appendList(&runtimeConfig->primaryExtensions, &runtimeConfig->primaryExtensionsLen, optarg);
+                    break;
+                case JOBS:
+                    if (optarg && atoi(optarg) > 0) {
+                        runtimeConfig->jobs = atoi(optarg);
+                    } else {
+                        Runtime_putError("--jobs requires a positive number\n");
+                        return EINVAL;
+                    }
+                    break;
                 default:
                     Runtime_putError("\n"); // Put space between getopt.h's message and our blurb 
                     Runtime_printHelp(imageName);
@@ -544,38 +8254,284 @@ main (int argc, char** argv) {
         size_t n_files  = argc - optind;
         size_t index    = 0;
 
+        if (runtimeConfig->applyPath) {
+            if (n_files > 0 || runtimeConfig->planPath) {
+                Runtime_putError("--apply takes no paths, and cannot be combined with --plan\n");
+                return EINVAL;
+            }
+
+            runtimeConfig->errorLog = ErrorLog_new();
+            runtimeConfig->dirCache = DirCache_new();
+
+            int applyState = Plan_apply(runtimeConfig, runtimeConfig->applyPath);
+
+            ErrorLog_print(runtimeConfig->errorLog, stderr);
+
+            if (runtimeConfig->durability && !runtimeConfig->simulate) {
+                int flushState = Durability_flush(runtimeConfig->durability, runtimeConfig);
+
+                unless (flushState == ENONE) {
+                    return flushState;
+                }
+            }
+
+            DirCache_free(runtimeConfig->dirCache);
+
+            return applyState;
+        }
+
         if (n_files == 0) {
             Runtime_printHelp(imageName);
             return ENONE;
         }
 
+        if (runtimeConfig->emptyDirsOnly && (Configuration_ruleCount(runtimeConfig) > 0 || runtimeConfig->rulesPath)) {
+            Runtime_putError("--empty-dirs-only cannot be combined with clobber rules\n");
+            return EINVAL;
+        }
+
+        if ((runtimeConfig->sidecarExtensionsLen > 0) != (runtimeConfig->primaryExtensionsLen > 0)) {
+            Runtime_putError("--orphan-sidecars and --primary must be given together\n");
+            return EINVAL;
+        }
+
+        if (runtimeConfig->rulesPath) {
+            int watchState = RuleSet_watch(runtimeConfig);
+
+            unless (watchState == ENONE) {
+                Runtime_putError("Could not watch for SIGHUP to reload rules: ERRNO %u\n", watchState);
+                return watchState;
+            }
+        }
+
+        // Started once SIGHUP is blocked, as threads keep the signal mask they were created with
+        if (runtimeConfig->blocklist) {
+            runtimeConfig->blocklist->pool = HashPool_new(Configuration_jobs(runtimeConfig));
+
+            unless (runtimeConfig->blocklist->pool) {
+                Runtime_verbose(runtimeConfig, "Could not start hashing threads (ERRNO %u), hashing on one\n", errno);
+            }
+        }
+
+        size_t n_roots;
+        Root*  roots    = Root_plan(runtimeConfig, files, n_files, &n_roots);
+
+        runtimeConfig->errorLog = ErrorLog_new();
+
+        if (runtimeConfig->blocklistBuildPath) {
+            return Blocklist_build(runtimeConfig, roots, n_roots);
+        }
+
+        if (runtimeConfig->estimateProbes) {
+            int estimateState = Estimate_run(runtimeConfig, roots, n_roots);
+
+            Arena_retire();
+
+            if (runtimeConfig->stats) {
+                Stats_print(stderr);
+            }
+
+            return estimateState;
+        }
+
+        if (runtimeConfig->survey) {
+            int surveyState = Survey_run(runtimeConfig, roots, n_roots);
+
+            ErrorLog_print(runtimeConfig->errorLog, stderr);
+
+            if (runtimeConfig->stats) {
+                Stats_print(stderr);
+            }
+
+            return surveyState;
+        }
+
         bool   dirty    = false;
 
-        while (index < n_files) {
-            char* fileName = *(files + index);
+        if (runtimeConfig->planPath) {
+            if (runtimeConfig->execBatch) {
+                Runtime_putError("--plan cannot be combined with --exec-batch\n");
+                return EINVAL;
+            }
+
+            if (runtimeConfig->tombstoneDepth) {
+                Runtime_putError("--plan cannot be combined with --tombstone\n");
+                return EINVAL;
+            }
+
+            runtimeConfig->plan = Plan_create(runtimeConfig->planPath);
+
+            unless (runtimeConfig->plan) {
+                Runtime_putError("Could not open %s: ERRNO %u\n", runtimeConfig->planPath, errno);
+                return errno;
+            }
+
+            // Planning is a simulation whose operations go to the plan
+            runtimeConfig->simulate = true;
+        }
+
+        if (runtimeConfig->simulate && runtimeConfig->durability) {
+            // Nothing to flush
+            dispose(runtimeConfig->durability);
+        }
+
+        if (runtimeConfig->simulate && runtimeConfig->simulateFormat != SIMULATE_LINES) {
+            runtimeConfig->summary = Summary_new();
+        }
+
+        if (runtimeConfig->summary || runtimeConfig->profileRules) {
+            runtimeConfig->ruleProfile = RuleProfile_new(Configuration_ruleCount(runtimeConfig));
+        }
+
+        if (runtimeConfig->tombstoneDepth) {
+            if (runtimeConfig->execBatch) {
+                Runtime_putError("--tombstone cannot be combined with --exec-batch\n");
+                return EINVAL;
+            }
+
+            runtimeConfig->tombstones = Tombstones_new();
+        }
+
+        // Simulations change nothing
+        if (runtimeConfig->notifyPath && !runtimeConfig->simulate) {
+            runtimeConfig->notifier = Notifier_new(runtimeConfig->notifyPath, runtimeConfig->notifyInterval);
+        }
+
+        while (index < n_roots) {
+            char* fileName = (roots + index)->path;
+            Tally tally    = { 0 };
+
+            ErrorLog_enterRoot(runtimeConfig->errorLog, fileName);
+
+            if (runtimeConfig->history) {
+                History_enterRoot(runtimeConfig->history, fileName, (roots + index)->realPath);
+            }
+
+            if (runtimeConfig->whyDirty) {
+                WhyDirty_reset(runtimeConfig->whyDirty);
+            }
+
+            if (runtimeConfig->notifier) {
+                Notifier_enterRoot(runtimeConfig->notifier, fileName, (roots + index)->realPath);
+            }
 
             // Check if it's a directory or otherwise.
             // If it's a file, remove it according to clobber etc...
-            struct stat statBuffer;
-            if (stat(fileName, &statBuffer) == 0) {
-                if (S_ISDIR(statBuffer.st_mode)) {
-                    Directory_process(runtimeConfig, fileName);
+            if (S_ISDIR((roots + index)->mode)) {
+                u32 completionState = Directory_process(runtimeConfig, fileName, &tally);
 
-                    if (Directory_isEmpty(fileName)) {
-                        File_unlink(runtimeConfig, fileName);
-                    } else {
-                        dirty = true;
+                // Tombstones inside the root have to be gone before it can be
+                if (runtimeConfig->tombstones && completionState == ENONE && tally.survivors == 0) {
+                    Tombstones_wait(runtimeConfig->tombstones);
+                }
+
+                if (completionState == ENONE && tally.survivors == 0 && File_isOwned(runtimeConfig, AT_FDCWD, fileName)
+                    && File_unlink(runtimeConfig, fileName) == 0) {
+                    ++tally.collapses;
+
+                    if (runtimeConfig->durability) {
+                        Durability_touchParentOf(runtimeConfig->durability, fileName);
+                    }
+
+                    if (runtimeConfig->summary) {
+                        Summary_record(runtimeConfig->summary, fileName, &(Tally) { .collapses = 1 });
+                    }
+                } else if (completionState != ENONE || tally.survivors > tally.handedOff) {
+                    dirty = true;
+
+                    if (runtimeConfig->whyDirty && completionState != ENONE) {
+                        printf("%s stayed: could not be read (ERRNO %u)\n", fileName, completionState);
+                    } else if (runtimeConfig->whyDirty) {
+                        WhyDirty_print(runtimeConfig->whyDirty, fileName, stdout);
                     }
-                } else {
-                    File_process(runtimeConfig, fileName);
                 }
             } else {
-                Runtime_putError("%s does not exist or is not accessible\n", fileName);
+                char* pathCopy = strdup(fileName);
+
+                File_process(runtimeConfig, fileName, basename(pathCopy), &tally);
+                dispose(pathCopy);
+
+                if (runtimeConfig->durability && tally.files > 0) {
+                    Durability_touchParentOf(runtimeConfig->durability, fileName);
+                }
+            }
+
+            if (runtimeConfig->summary) {
+                Tally_add(&runtimeConfig->summary->total, &tally);
             }
 
             ++index;
         }
 
+        if (runtimeConfig->summary) {
+            if (runtimeConfig->simulateFormat == SIMULATE_JSON) {
+                Summary_printJson(runtimeConfig->summary, runtimeConfig, stdout);
+            } else {
+                Summary_printTree(runtimeConfig->summary, runtimeConfig, stdout);
+            }
+        }
+
+        if (runtimeConfig->profileRules) {
+            if (runtimeConfig->summary) {
+                fputc('\n', stdout);
+            }
+
+            RuleProfile_print(runtimeConfig->ruleProfile, runtimeConfig, stdout);
+        }
+
+        if (runtimeConfig->execBatch && ExecBatch_finish(runtimeConfig->execBatch, runtimeConfig) > 0) {
+            dirty = true;
+        }
+
+        if (runtimeConfig->tombstones && Tombstones_finish(runtimeConfig->tombstones) > 0) {
+            dirty = true;
+        }
+
+        if (runtimeConfig->notifier) {
+            Notifier_finish(runtimeConfig->notifier);
+        }
+
+        ErrorLog_print(runtimeConfig->errorLog, stderr);
+
+        if (runtimeConfig->history) {
+            int historyState = History_save(runtimeConfig->history, runtimeConfig->historyPath);
+
+            unless (historyState == ENONE) {
+                Runtime_putError("Could not save history to %s: ERRNO %u\n", runtimeConfig->historyPath, historyState);
+            }
+        }
+
+        if (runtimeConfig->plan) {
+            int planState = Plan_close(runtimeConfig->plan, runtimeConfig->planPath);
+
+            unless (planState == ENONE) {
+                return planState;
+            }
+        }
+
+        if (runtimeConfig->durability) {
+            // Modified directories tend to be siblings, so they are opened relative to their open parents
+            runtimeConfig->dirCache = DirCache_new();
+
+            int flushState = Durability_flush(runtimeConfig->durability, runtimeConfig);
+
+            DirCache_free(runtimeConfig->dirCache);
+            runtimeConfig->dirCache = NULL;
+
+            unless (flushState == ENONE) {
+                return flushState;
+            }
+        }
+
+        // The walk is over, so nothing is matching against replaced rules any more
+        RuleSet_offline();
+        RuleSet_collect();
+        Arena_retire();
+
+        if (runtimeConfig->stats) {
+            Stats_print(stderr);
+        }
+
         if (dirty) {
             return ENOTEMPTY;
         } else {
@@ -0,0 +1,104 @@
+#!/bin/sh
+#
+# Exercise --destroy-subvolumes on a scratch btrfs filesystem in a loopback image.
+#
+# Needs root (for mount and subvolume destruction) and btrfs-progs. Usage:
+#
+#     sudo tests/btrfs-loopback.sh [path/to/scrub]
+#
+# Without an argument, scrub.c is compiled to a temporary binary first.
+
+set -eu
+
+here=$(cd "$(dirname "$0")" && pwd)
+work=$(mktemp -d)
+image="$work/btrfs.img"
+mnt="$work/mnt"
+scrub=${1:-}
+failures=0
+
+cleanup() {
+    if mountpoint -q "$mnt" 2>/dev/null; then
+        umount "$mnt"
+    fi
+
+    rm -rf "$work"
+}
+
+trap cleanup EXIT INT TERM
+
+fail() {
+    echo "FAIL: $*" >&2
+    failures=$((failures + 1))
+}
+
+for tool in mkfs.btrfs btrfs truncate mount umount; do
+    command -v "$tool" >/dev/null || { echo "$tool is needed" >&2; exit 2; }
+done
+
+if [ "$(id -u)" -ne 0 ]; then
+    echo "Run as root: mounting and destroying subvolumes need it" >&2
+    exit 2
+fi
+
+if [ -z "$scrub" ]; then
+    scrub="$work/scrub"
+    gcc -std=gnu99 -O2 -pthread -o "$scrub" "$here/../scrub.c" -lm
+fi
+
+# btrfs will not make a filesystem much smaller than this
+truncate -s 256M "$image"
+mkfs.btrfs -q "$image"
+mkdir "$mnt"
+mount -o loop "$image" "$mnt"
+
+# Nothing but junk: destroyed with one ioctl
+btrfs -q subvolume create "$mnt/junk"
+mkdir "$mnt/junk/deep"
+touch "$mnt/junk/a.tmp" "$mnt/junk/deep/b.tmp"
+
+# Something to keep: emptied of its junk, and writable again afterwards
+btrfs -q subvolume create "$mnt/mixed"
+touch "$mnt/mixed/c.tmp" "$mnt/mixed/keep.txt"
+
+# Holds another subvolume, which the destroy ioctl refuses: emptied the slow way
+btrfs -q subvolume create "$mnt/outer"
+btrfs -q subvolume create "$mnt/outer/inner"
+touch "$mnt/outer/d.tmp" "$mnt/outer/inner/e.tmp"
+
+# Read-only already: it would go, but cannot be emptied, and must stay read-only if it stays
+btrfs -q subvolume create "$mnt/frozen"
+touch "$mnt/frozen/f.tmp" "$mnt/frozen/keep.txt"
+btrfs property set "$mnt/frozen" ro true
+
+status=0
+"$scrub" --destroy-subvolumes -ctmp "$mnt" || status=$?
+
+# Some entries stay, so the run reports the tree as not empty
+[ "$status" -ne 0 ] || fail "expected a non-zero exit status, got $status"
+
+[ ! -e "$mnt/junk" ] || fail "junk subvolume still exists"
+
+[ -e "$mnt/mixed/keep.txt" ] || fail "mixed/keep.txt was deleted"
+[ ! -e "$mnt/mixed/c.tmp" ] || fail "mixed/c.tmp was not deleted"
+[ "$(btrfs property get "$mnt/mixed" ro)" = "ro=false" ] || fail "mixed was left read-only"
+
+[ ! -e "$mnt/outer/d.tmp" ] || fail "outer/d.tmp was not deleted"
+[ ! -e "$mnt/outer/inner" ] || fail "outer/inner subvolume still exists"
+
+[ -e "$mnt/frozen/keep.txt" ] || fail "frozen/keep.txt was deleted"
+[ "$(btrfs property get "$mnt/frozen" ro)" = "ro=true" ] || fail "frozen was made writable"
+
+# Simulations change nothing, the read-only flag included
+btrfs -q subvolume create "$mnt/simulated"
+touch "$mnt/simulated/g.tmp"
+"$scrub" --simulate --destroy-subvolumes -ctmp "$mnt" >/dev/null 2>&1 || true
+
+[ -e "$mnt/simulated/g.tmp" ] || fail "simulation deleted simulated/g.tmp"
+[ "$(btrfs property get "$mnt/simulated" ro)" = "ro=false" ] || fail "simulation made simulated read-only"
+
+if [ "$failures" -eq 0 ]; then
+    echo "All checks passed"
+fi
+
+exit "$failures"